@@ -0,0 +1,165 @@
+// Timing test for the C++ extension of the MPI library
+//
+// Times a few common expressions three ways:  through the C API with
+// all temporaries set up ahead of time (the best one can do by hand),
+// through the C API with a temporary made and cleared for every
+// intermediate result (which is what a value-returning wrapper does),
+// and through mpi::Int.
+//
+// Usage: bench [<iterations>] [<bits>]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "mpicpp.h"
+
+extern "C"
+{
+    #include "mpprime.h"
+}
+
+using mpi::Int;
+using mpi::check;
+
+typedef std::chrono::steady_clock clk;
+
+static double since(clk::time_point start)
+{
+	return std::chrono::duration<double>(clk::now() - start).count();
+}
+
+static void report(const char *what, double t_c, double t_tmp,
+		   double t_cpp)
+{
+	std::printf("%-22s %8.3fs  %8.3fs  %8.3fs  %6.2fx\n", what, t_c,
+		    t_tmp, t_cpp, t_cpp > 0 ? t_c / t_cpp : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	int  num = 200000, prec = 1024;
+
+	if (argc > 1 && std::atoi(argv[1]) > 0)
+		num = std::atoi(argv[1]);
+	if (argc > 2 && std::atoi(argv[2]) > 0)
+		prec = std::atoi(argv[2]);
+	prec = (prec + MP_DIGIT_BIT - 1) / MP_DIGIT_BIT;
+
+	std::srand(1);
+
+	Int a, b, c;
+
+	check(mpp_random_size(a.get(), prec));
+	check(mpp_random_size(b.get(), prec));
+	check(mpp_random_size(c.get(), prec));
+
+	std::printf("C++ interface timing test\n"
+		    "Precision:  %d digits (%d bits)\n"
+		    "# of tests: %d\n\n", prec, (int)(prec * MP_DIGIT_BIT),
+		    num);
+	std::printf("%-22s %9s  %9s  %9s  %7s\n", "", "C API", "C+temps",
+		    "mpi::Int", "C/Int");
+
+	mp_int  d, t, u;
+	double  t_c, t_tmp, t_cpp;
+	clk::time_point start;
+	Int     e, acc;
+
+	mp_init(&d); mp_init(&t); mp_init(&u);
+
+	// d = a * b + c
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++) {
+		mp_mul(a.raw(), b.raw(), &d);
+		mp_add(&d, c.raw(), &d);
+	}
+	t_c = since(start);
+
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++) {
+		mp_int  p, s;
+
+		mp_init(&p); mp_init(&s);
+		mp_mul(a.raw(), b.raw(), &p);
+		mp_add(&p, c.raw(), &s);
+		mp_exch(&s, &d);
+		mp_clear(&p); mp_clear(&s);
+	}
+	t_tmp = since(start);
+
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++)
+		e = a * b + c;
+	t_cpp = since(start);
+
+	if (mp_cmp(e.raw(), &d) != 0)
+		std::printf("d = a * b + c: results differ!\n");
+	report("d = a * b + c", t_c, t_tmp, t_cpp);
+
+	// acc += a * b
+	mp_zero(&d);
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++) {
+		mp_mul(a.raw(), b.raw(), &t);
+		mp_add(&d, &t, &d);
+	}
+	t_c = since(start);
+
+	mp_zero(&d);
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++) {
+		mp_int  p;
+
+		mp_init(&p);
+		mp_mul(a.raw(), b.raw(), &p);
+		mp_add(&d, &p, &d);
+		mp_clear(&p);
+	}
+	t_tmp = since(start);
+
+	acc = 0;
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++)
+		acc += a * b;
+	t_cpp = since(start);
+
+	if (mp_cmp(acc.raw(), &d) != 0)
+		std::printf("acc += a * b: results differ!\n");
+	report("acc += a * b", t_c, t_tmp, t_cpp);
+
+	// d = (a + b) * (c - a)
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++) {
+		mp_add(a.raw(), b.raw(), &t);
+		mp_sub(c.raw(), a.raw(), &u);
+		mp_mul(&t, &u, &d);
+	}
+	t_c = since(start);
+
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++) {
+		mp_int  p, q, s;
+
+		mp_init(&p); mp_init(&q); mp_init(&s);
+		mp_add(a.raw(), b.raw(), &p);
+		mp_sub(c.raw(), a.raw(), &q);
+		mp_mul(&p, &q, &s);
+		mp_exch(&s, &d);
+		mp_clear(&p); mp_clear(&q); mp_clear(&s);
+	}
+	t_tmp = since(start);
+
+	start = clk::now();
+	for (int ix = 0; ix < num; ix++)
+		e = (a + b) * (c - a);
+	t_cpp = since(start);
+
+	if (mp_cmp(e.raw(), &d) != 0)
+		std::printf("d = (a + b) * (c - a): results differ!\n");
+	report("d = (a + b) * (c - a)", t_c, t_tmp, t_cpp);
+
+	mp_clear(&d); mp_clear(&t); mp_clear(&u);
+
+	return 0;
+}
@@ -1,286 +1,717 @@
-
-
-/**************************
-
-  This is the C++ interface header file for the mpi library
-   by scroussette@yahoo.com
-
- *************************/
-
-#ifndef MPICPP_H
-#define MPICPP_H
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <iostream.h>
-
-typedef int		mp_bool;
-#define MP_EQ	0
-#define MP_GT	1
-#define MP_LT	-1
-#define TRUE	1
-#define FALSE	0
-
-// extern C is needed if mpi.c is compiled as a C file and not as
-// a C++ file
-extern "C"                    
-{
-    #include "mpi.h"
-}
-
-// This the class definition for an object of mp_int type
-
-class Mpi
-{
-    // Private mpi object accessible only via member
-	// functions or friend functions
-    mp_int mpi_n;
-
-public:
-	// This public member variable will contain the result of the last 
-	// operation performed on this object.  If it's other than MP_OKAY
-	// then there was an error.
-	mp_err err;
-
-	// The constructors
-	Mpi(void)					{err=mp_init(&mpi_n);} 
-    Mpi(mp_digit i)				{if ((err=mp_init(&mpi_n))==MP_OKAY) mp_set(&mpi_n,i);}  
-    Mpi(mp_int *a)				{err=mp_init_copy(&mpi_n,a);} 
-    Mpi(Mpi &a)					{err=mp_init_copy(&mpi_n, &(a.mpi_n));} 
-    Mpi(char *s,mp_word base=10) 
-			{	err=mp_init(&mpi_n);
-				if(err==MP_OKAY) err=mp_read_radix(&mpi_n,s,base);
-			}
-
-	// The overloaded operators
-    Mpi& operator=(mp_digit i)	{mp_set(&mpi_n,i); return *this;}
-    Mpi& operator=(Mpi &a)		{err=mp_copy(&(a.mpi_n),&mpi_n); return *this;}
-    Mpi& operator=(mp_int *a)	{err=mp_copy(a,&mpi_n); return *this;}
-	// for mp_read_radix we use base 10 by default
-    Mpi& operator=(char* s)		{err=mp_read_radix(&mpi_n,s,10);return *this;}
-
-    Mpi& operator++()			{err=mp_add_d(&mpi_n,1,&mpi_n); return *this;}
-    Mpi& operator+=(mp_digit i)	{err=mp_add_d(&mpi_n,i,&mpi_n); return *this;}
-    Mpi& operator+=(mp_int *a)	{err=mp_add(&mpi_n,a,&mpi_n); return *this;}
-    Mpi& operator+=(Mpi &a)		{err=mp_add(&mpi_n,&(a.mpi_n),&mpi_n); return *this;}
-
-    Mpi& operator--()			{err=mp_sub_d(&mpi_n,1,&mpi_n); return *this;}
-    Mpi& operator-=(mp_digit i)	{err=mp_sub_d(&mpi_n,i,&mpi_n); return *this;}
-    Mpi& operator-=(mp_int *a)	{err=mp_sub(&mpi_n,a,&mpi_n); return *this;}
-    Mpi& operator-=(Mpi &a)		{err=mp_sub(&mpi_n,&(a.mpi_n),&mpi_n); return *this;}
-
-    Mpi& operator*=(mp_digit i) {err=mp_mul_d(&mpi_n,i,&mpi_n); return *this;}
-    Mpi& operator*=(mp_int *i)  {err=mp_mul(&mpi_n,i,&mpi_n); return *this;}
-    Mpi& operator*=(Mpi &i)		{err=mp_mul(&mpi_n,&(i.mpi_n),&mpi_n); return *this;}
-
-    Mpi& operator/=(mp_digit i) {err=mp_div_d(&mpi_n,i,&mpi_n,NULL);return *this;}
-    Mpi& operator/=(mp_int *i)  {err=mp_div(&mpi_n,i,&mpi_n,NULL); return *this;}
-    Mpi& operator/=(Mpi &i)		{err=mp_div(&mpi_n,&(i.mpi_n),&mpi_n,NULL); return *this;}
-
-    Mpi& operator%=(mp_digit i)	{	
-				mp_digit a; 
-				if ((err==mp_div_d(&mpi_n,i,NULL,&a))==MP_OKAY) 
-					mp_set(&mpi_n,a);
-				return *this;
-			}
-    Mpi& operator%=(mp_int *i)	{err=mp_div(&mpi_n,i,NULL,&mpi_n);return *this;}
-    Mpi& operator%=(Mpi &i)		{err=mp_div(&mpi_n,&(i.mpi_n),NULL,&mpi_n); return *this;}
-
-	mp_digit operator[](mp_word i){return DIGIT(&mpi_n,i);};
-
-	// Negation operator: x = -a
-    friend Mpi operator-(Mpi &a);
-
-    friend Mpi operator+(Mpi &a,	mp_digit i);
-    friend Mpi operator+(mp_digit i, Mpi &a);
-    friend Mpi operator+(Mpi&a,		Mpi&b);
-
-    friend Mpi operator-(Mpi &a,	mp_digit i);
-    friend Mpi operator-(mp_digit i, Mpi &a);
-    friend Mpi operator-(Mpi&a,		Mpi&b);
-
-    friend Mpi operator*(Mpi &a,	mp_digit i);
-    friend Mpi operator*(mp_digit i, Mpi &a);
-    friend Mpi operator*(Mpi&a,		Mpi&b);
-
-    friend Mpi operator/(Mpi &a,	mp_digit i);
-    friend Mpi operator/(Mpi&a,		Mpi&b);
-    
-    friend mp_digit operator%(Mpi &a,	mp_digit i);
-    friend Mpi operator%(Mpi&a,		Mpi&b);
-
-	// Exponentiation:
-    friend Mpi operator^(Mpi&a,		Mpi&b);
-    friend Mpi operator^(Mpi&a,		mp_digit b);
-
-
-	// Comparison operators
-    friend mp_bool operator<=(Mpi &a, Mpi &b){
-		if (mp_cmp(&(a.mpi_n),&(b.mpi_n))<=MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator>=(Mpi &a, Mpi &b){
-		if (mp_cmp(&(a.mpi_n),&(b.mpi_n))>=MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator==(Mpi &a, Mpi &b){
-		if (mp_cmp(&(a.mpi_n),&(b.mpi_n))==MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator!=(Mpi &a, Mpi &b){
-		if (mp_cmp(&(a.mpi_n),&(b.mpi_n))!=MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator<(Mpi &a, Mpi &b){
-		if (mp_cmp(&(a.mpi_n),&(b.mpi_n))==MP_LT)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator>(Mpi &a, Mpi &b){
-		if (mp_cmp(&(a.mpi_n),&(b.mpi_n))==MP_GT)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator<=(Mpi &a, mp_digit b){
-		if (mp_cmp_d(&(a.mpi_n),b)<=MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator>=(Mpi &a, mp_digit b){
-		if (mp_cmp_d(&(a.mpi_n),b)>=MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator==(Mpi &a, mp_digit b){
-		if (mp_cmp_d(&(a.mpi_n),b)==MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator!=(Mpi &a, mp_digit b){
-		if (mp_cmp_d(&(a.mpi_n),b)!=MP_EQ)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator<(Mpi &a, mp_digit b){
-		if (mp_cmp_d(&(a.mpi_n),b)==MP_LT)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-    friend mp_bool operator>(Mpi &a, mp_digit b){
-		if (mp_cmp_d(&(a.mpi_n),b)==MP_GT)
-			return TRUE;
-		else 
-			return FALSE;
-	}
-	// send the Mpi to a character string
-    friend char * operator<<(char * s,Mpi &a);
-	//		or to a stream
-	friend ostream &operator<<(ostream &s, Mpi &a);
-
-	//*********
-	// The other functions
-
-
-friend mp_err mp_init(Mpi &mp)										{return (mp.err=  mp_init(&(mp.mpi_n)));};
-friend mp_err mp_init_size(Mpi &mp, mp_size prec)                   {return (mp.err=  mp_init_size(&(mp.mpi_n), prec));};
-friend mp_err mp_init_copy(Mpi &mp, Mpi &from)                      {return (mp.err=  mp_init_copy(&(mp.mpi_n), &(from.mpi_n)));};
-friend mp_err mp_copy(Mpi &from, Mpi &to)                           {return (to.err=  mp_copy(&(from.mpi_n), &(to.mpi_n)));};
-friend	void   mp_exch(Mpi &mp1, Mpi &mp2)                          {				  mp_exch(&(mp1.mpi_n), &(mp2.mpi_n));};
-friend	void   mp_clear(Mpi &mp)                                    {				  mp_clear(&(mp.mpi_n));};
-friend	void   mp_zero(Mpi &mp)                                     {				  mp_zero(&(mp.mpi_n));};
-friend	void   mp_set(Mpi &mp, mp_digit d)                          {				  mp_set(&(mp.mpi_n), d);};
-friend mp_err mp_set_int(Mpi &mp, long z)                           {return (mp.err=  mp_set_int(&(mp.mpi_n),z));};
-
-
-friend mp_err mp_add_d(Mpi &a, mp_digit d, Mpi &b)                  {return (b.err=  mp_add_d(&(a.mpi_n),  d, &(b.mpi_n)));};
-friend mp_err mp_sub_d(Mpi &a, mp_digit d, Mpi &b)                  {return (b.err=  mp_sub_d(&(a.mpi_n),  d, &(b.mpi_n)));};
-friend mp_err mp_mul_d(Mpi &a, mp_digit d, Mpi &b)                  {return (b.err=  mp_mul_d(&(a.mpi_n),  d, &(b.mpi_n)));};
-friend mp_err mp_mul_2(Mpi &a, Mpi &c)                              {return (c.err=  mp_mul_2(&(a.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_div_d(Mpi &a, mp_digit d, Mpi &q, mp_digit *r)     {return (q.err=  mp_div_d(&(a.mpi_n),  d, &(q.mpi_n), r));};
-friend mp_err mp_div_2(Mpi &a, Mpi &c)                              {return (c.err=  mp_div_2(&(a.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_expt_d(Mpi &a, mp_digit d, Mpi &c)                 {return (c.err=  mp_expt_d(&(a.mpi_n),  d, &(c.mpi_n)));};
-
-
-friend mp_err mp_abs(Mpi &a, Mpi &b)                                {return (b.err=  mp_abs(&(a.mpi_n), &(b.mpi_n)));};
-friend mp_err mp_neg(Mpi &a, Mpi &b)                                {return (b.err=  mp_neg(&(a.mpi_n), &(b.mpi_n)));};
-
-
-friend mp_err mp_add(Mpi &a, Mpi &b, Mpi &c)                        {return (c.err=  mp_add(&(a.mpi_n), &(b.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_sub(Mpi &a, Mpi &b, Mpi &c)                        {return (c.err=  mp_sub(&(a.mpi_n), &(b.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_mul(Mpi &a, Mpi &b, Mpi &c)                        {return (c.err=  mp_mul(&(a.mpi_n), &(b.mpi_n), &(c.mpi_n)));};
-#if MP_SQUARE
-friend mp_err mp_sqr(Mpi &a, Mpi &b)                                {return (b.err=  mp_sqr(&(a.mpi_n), &(b.mpi_n)));};
-#endif
-friend mp_err mp_div(Mpi &a, Mpi &b, Mpi &q, Mpi &r)                {return (q.err=  mp_div(&(a.mpi_n), &(b.mpi_n), &(q.mpi_n), &(r.mpi_n)));};
-friend mp_err mp_div_2d(Mpi &a, mp_digit d, Mpi &q, Mpi &r)         {return (q.err=  mp_div_2d(&(a.mpi_n),  d, &(q.mpi_n), &(r.mpi_n)));};
-friend mp_err mp_expt(Mpi &a, Mpi &b, Mpi &c)                       {return (c.err=  mp_expt(&(a.mpi_n), &(b.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_2expt(Mpi &a, mp_digit k)                          {return (a.err=  mp_2expt(&(a.mpi_n),  k));};
-friend mp_err mp_sqrt(Mpi &a, Mpi &b)                               {return (b.err=  mp_sqrt(&(a.mpi_n), &(b.mpi_n)));};
-
-
-#if MP_MODARITH
-friend mp_err mp_mod(Mpi &a, Mpi &m, Mpi &c)                        {return (c.err=  mp_mod(&(a.mpi_n), &(m.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_mod_d(Mpi &a, mp_digit d, mp_digit *c)             {return (a.err=  mp_mod_d(&(a.mpi_n),  d, c));};
-friend mp_err mp_addmod(Mpi &a, Mpi &b, Mpi &m, Mpi &c)             {return (c.err=  mp_addmod(&(a.mpi_n), &(b.mpi_n), &(m.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_submod(Mpi &a, Mpi &b, Mpi &m, Mpi &c)             {return (c.err=  mp_submod(&(a.mpi_n), &(b.mpi_n), &(m.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_mulmod(Mpi &a, Mpi &b, Mpi &m, Mpi &c)             {return (c.err=  mp_mulmod(&(a.mpi_n), &(b.mpi_n), &(m.mpi_n), &(c.mpi_n)));};
-#if MP_SQUARE
-friend mp_err mp_sqrmod(Mpi &a, Mpi &m, Mpi &c)                     {return (c.err=  mp_sqrmod(&(a.mpi_n), &(m.mpi_n), &(c.mpi_n)));};
-#endif
-friend mp_err mp_exptmod(Mpi &a, Mpi &b, Mpi &m, Mpi &c)            {return (c.err=  mp_exptmod(&(a.mpi_n), &(b.mpi_n), &(m.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_exptmod_d(Mpi &a, mp_digit d, Mpi &m, Mpi &c)      {return (c.err=  mp_exptmod_d(&(a.mpi_n),  d, &(m.mpi_n), &(c.mpi_n)));};
-#endif 
-
-
-friend	int    mp_cmp_z(Mpi &a)                                     {return mp_cmp_z(&(a.mpi_n));};
-friend	int    mp_cmp_d(Mpi &a, mp_digit d)                         {return mp_cmp_d(&(a.mpi_n),  d);};
-friend	int    mp_cmp(Mpi &a, Mpi &b)                               {return mp_cmp(&(a.mpi_n), &(b.mpi_n));};
-friend	int    mp_cmp_mag(Mpi &a, Mpi &b)                           {return mp_cmp_mag(&(a.mpi_n), &(b.mpi_n));};
-friend	int    mp_cmp_int(Mpi &a, long z)                           {return mp_cmp_int(&(a.mpi_n),z);};
-friend	int    mp_isodd(Mpi &a)                                     {return mp_isodd(&(a.mpi_n));};
-friend	int    mp_iseven(Mpi &a)                                    {return mp_iseven(&(a.mpi_n));};
-
-
-#if MP_NUMTH
-friend mp_err mp_gcd(Mpi &a, Mpi &b, Mpi &c)                        {return (c.err=  mp_gcd(&(a.mpi_n), &(b.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_lcm(Mpi &a, Mpi &b, Mpi &c)                        {return (c.err=  mp_lcm(&(a.mpi_n), &(b.mpi_n), &(c.mpi_n)));};
-friend mp_err mp_xgcd(Mpi &a, Mpi &b, Mpi &g, Mpi &x, Mpi &y)       {return (g.err=  mp_xgcd(&(a.mpi_n), &(b.mpi_n), &(g.mpi_n), &(x.mpi_n), &(y.mpi_n)));};
-friend mp_err mp_invmod(Mpi &a, Mpi &m, Mpi &c)                     {return (c.err=  mp_invmod(&(a.mpi_n), &(m.mpi_n), &(c.mpi_n)));};
-#endif
-
-
-#if MP_IOFUNC
-friend	void   mp_print(Mpi &mp, FILE *ofp)                         {return mp_print(&(mp.mpi_n),ofp);};
-#endif
-
-
-friend mp_err mp_read_raw(Mpi &mp, char *str, int len)              {return (mp.err=  mp_read_raw(&(mp.mpi_n),str,len));};
-friend	int    mp_raw_size(Mpi &mp)                                 {return			  mp_raw_size(&(mp.mpi_n));};
-friend mp_err mp_toraw(Mpi &mp, char *str)                          {return (mp.err=  mp_toraw(&(mp.mpi_n),str));};
-friend mp_err mp_read_radix(Mpi &mp, char *str, int radix)          {return (mp.err=  mp_read_radix(&(mp.mpi_n),str,radix));};
-friend	int    mp_radix_size(Mpi &mp, int radix)                    {return (mp.err=  mp_radix_size(&(mp.mpi_n),radix));};
-friend mp_err mp_toradix(Mpi &mp, char *str, int radix)             {return (mp.err=  mp_toradix(&(mp.mpi_n),str,radix));};
-
-
-	// The destructor: clear the mpi
-    ~Mpi() { mp_clear(&mpi_n); }
-};
-
-
-#endif
-
+/**************************
+
+  This is the C++ interface header file for the mpi library
+   originally by scroussette@yahoo.com
+
+  Header-only, and needs C++17.  mpi::Int owns an mp_int: it is
+  initialized by the constructors, cleared by the destructor, and a
+  move hands over the digit buffer rather than copying it.
+
+  Arithmetic on Ints builds a small expression object instead of a
+  temporary Int, and the whole expression is evaluated when it is
+  assigned.  The leftmost operand is computed straight into the
+  destination, so that
+
+      d = a * b + c;    // mp_mul(a, b, d); mp_add(d, c, d)
+      d += a * b;       // one scratch product, then mp_add
+
+  make no temporaries at all; any other intermediate results go into
+  scratch values that are kept per thread and reused, so they do not
+  hit the allocator once they have grown to size.  Because an
+  expression holds references to its operands, don't keep one in an
+  'auto' variable; assign it to an Int.
+
+  Errors from the library are thrown as mpi::error.
+
+ *************************/
+
+#ifndef MPICPP_H
+#define MPICPP_H
+
+#include <climits>
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+// extern C is needed if mpi.c is compiled as a C file and not as
+// a C++ file
+extern "C"
+{
+    #include "mpi.h"
+}
+
+namespace mpi {
+
+// Thrown for any result other than MP_OKAY
+class error : public std::runtime_error
+{
+public:
+	explicit error(mp_err code)
+		: std::runtime_error(mp_strerror(code)), code_(code) {}
+
+	mp_err code() const noexcept { return code_; }
+
+private:
+	mp_err code_;
+};
+
+inline void check(mp_err res)
+{
+	if (res != MP_OKAY)
+		throw error(res);
+}
+
+class Int;
+
+namespace detail {
+
+// {{{ Expression nodes
+
+// A small integer operand, of any built-in type; uses the single digit
+// functions if it fits
+struct Small {
+	unsigned long long mag;
+	bool neg;
+};
+
+inline bool fits_digit(const Small &s)
+{
+	return !s.neg && s.mag <= MP_DIGIT_MAX;
+}
+
+// As mp_set_int(), but for the full range of every integer type
+inline mp_err set_small(mp_int *dst, const Small &s)
+{
+	mp_err res;
+
+	mp_zero(dst);
+	for (int ix = sizeof(s.mag) - 1; ix >= 0; --ix) {
+		if ((res = mp_mul_2d(dst, CHAR_BIT, dst)) != MP_OKAY)
+			return res;
+		res = mp_add_d(dst,
+			       (mp_digit)((s.mag >> (ix * CHAR_BIT)) & UCHAR_MAX),
+			       dst);
+		if (res != MP_OKAY)
+			return res;
+	}
+	if (s.neg)
+		return mp_neg(dst, dst);
+	return MP_OKAY;
+}
+
+template <class L, class R> struct Add { L l; R r; };
+template <class L, class R> struct Sub { L l; R r; };
+template <class L, class R> struct Mul { L l; R r; };
+template <class E>          struct Neg { E e; };
+
+template <class T> struct is_add : std::false_type {};
+template <class L, class R> struct is_add<Add<L, R>> : std::true_type {};
+template <class T> struct is_sub : std::false_type {};
+template <class L, class R> struct is_sub<Sub<L, R>> : std::true_type {};
+template <class T> struct is_mul : std::false_type {};
+template <class L, class R> struct is_mul<Mul<L, R>> : std::true_type {};
+template <class T> struct is_neg : std::false_type {};
+template <class E> struct is_neg<Neg<E>> : std::true_type {};
+
+template <class T>
+constexpr bool is_int_v = std::is_same_v<std::decay_t<T>, Int>;
+
+template <class T>
+constexpr bool is_smallnode_v = std::is_same_v<std::decay_t<T>, Small>;
+
+template <class T>
+constexpr bool is_node_v = is_int_v<T> ||
+	is_add<std::decay_t<T>>::value || is_sub<std::decay_t<T>>::value ||
+	is_mul<std::decay_t<T>>::value || is_neg<std::decay_t<T>>::value;
+
+template <class T>
+constexpr bool is_small_v = std::is_integral_v<std::decay_t<T>> &&
+	!std::is_same_v<std::decay_t<T>, bool>;
+
+// Ints are held by reference, integers as Small, other nodes by value
+template <class T>
+using wrap_t = std::conditional_t<is_int_v<T>, const Int &,
+		   std::conditional_t<is_small_v<T>, Small, std::decay_t<T>>>;
+
+template <class T>
+Small small(T t)
+{
+	if constexpr (std::is_signed_v<T>) {
+		if (t < 0)
+			return Small{0ULL - static_cast<unsigned long long>(t), true};
+	}
+	return Small{static_cast<unsigned long long>(t), false};
+}
+
+template <class T>
+wrap_t<T> wrap(const T &t)
+{
+	if constexpr (is_small_v<T>)
+		return small(t);
+	else
+		return t;
+}
+
+// }}}
+
+// {{{ Scratch values
+
+// Per-thread pool of scratch mp_ints, used as a stack by the evaluator
+class scratch
+{
+public:
+	scratch();
+	~scratch() { --depth(); }
+
+	scratch(const scratch &) = delete;
+	scratch &operator=(const scratch &) = delete;
+
+	mp_int *get() const noexcept { return p_; }
+
+private:
+	static std::deque<Int> &pool();
+	static std::size_t &depth();
+
+	mp_int *p_;
+};
+
+// }}}
+
+} // namespace detail
+
+// {{{ class Int
+
+class Int
+{
+public:
+	// The constructors
+	Int() { check(mp_init(&v_)); }
+
+	// The rest delegate to Int(), so that the digits are freed if
+	// they go on to throw
+	template <class T, std::enable_if_t<detail::is_small_v<T>, int> = 0>
+	Int(T z) : Int() { set_small(detail::small(z)); }
+
+	explicit Int(std::string_view s, int radix = 10) : Int() { read(s, radix); }
+
+	explicit Int(const mp_int *a)
+	{
+		check(mp_init_copy(&v_, const_cast<mp_int *>(a)));
+	}
+
+	Int(const Int &a) { check(mp_init_copy(&v_, a.raw())); }
+
+	// Take over a's digits; a may afterward only be assigned or destroyed
+	Int(Int &&a) noexcept : v_(a.v_) { a.release(); }
+
+	// Build straight from an expression, e.g. Int d = a * b + c
+	template <class L, class R>
+	Int(const detail::Add<L, R> &e) : Int() { assign(e); }
+	template <class L, class R>
+	Int(const detail::Sub<L, R> &e) : Int() { assign(e); }
+	template <class L, class R>
+	Int(const detail::Mul<L, R> &e) : Int() { assign(e); }
+	template <class E>
+	Int(const detail::Neg<E> &e)    : Int() { assign(e); }
+
+	~Int() { mp_clear(&v_); }
+
+	// Assignment
+	Int &operator=(const Int &a)
+	{
+		ready();
+		check(mp_copy(a.raw(), &v_));
+		return *this;
+	}
+
+	Int &operator=(Int &&a) noexcept
+	{
+		if (this != &a) {
+			mp_clear(&v_);
+			v_ = a.v_;
+			a.release();
+		}
+		return *this;
+	}
+
+	template <class E, std::enable_if_t<detail::is_node_v<E> ||
+					    detail::is_small_v<E>, int> = 0>
+	Int &operator=(const E &e)
+	{
+		ready();
+		assign(detail::wrap(e));
+		return *this;
+	}
+
+	// Compound assignment: *this is always the leftmost operand
+	template <class E>
+	Int &operator+=(const E &e) { return update(detail::wrap(e), 0); }
+	template <class E>
+	Int &operator-=(const E &e) { return update(detail::wrap(e), 1); }
+	template <class E>
+	Int &operator*=(const E &e) { return update(detail::wrap(e), 2); }
+
+	Int &operator/=(const Int &d)
+	{
+		check(mp_div(&v_, d.raw(), &v_, NULL));
+		return *this;
+	}
+
+	Int &operator%=(const Int &m)
+	{
+		check(mp_mod(&v_, m.raw(), &v_));
+		return *this;
+	}
+
+	Int &operator++() { check(mp_add_d(&v_, 1, &v_)); return *this; }
+	Int &operator--() { check(mp_sub_d(&v_, 1, &v_)); return *this; }
+
+	// Conversions
+	void read(std::string_view s, int radix = 10)
+	{
+		std::string buf(s);
+
+		check_radix(radix);
+		check(mp_read_radix(&v_, (unsigned char *)buf.data(), radix));
+	}
+
+	std::string str(int radix = 10) const
+	{
+		check_radix(radix);
+
+		std::string buf(mp_radix_size(raw(), radix), '\0');
+
+		check(mp_toradix(raw(), (unsigned char *)&buf[0], radix));
+		buf.resize(buf.find('\0'));
+		return buf;
+	}
+
+	// Queries
+	int  sign() const noexcept { return mp_cmp_z(raw()); }
+	bool is_zero() const noexcept { return sign() == 0; }
+	bool is_odd() const noexcept { return mp_isodd(raw()) != 0; }
+	bool is_even() const noexcept { return mp_iseven(raw()) != 0; }
+	int  bits() const noexcept { return mp_count_bits(raw()); }
+	mp_digit operator[](mp_size i) const noexcept
+	{
+		return i < USED(&v_) ? DIGIT(&v_, i) : 0;
+	}
+
+	void swap(Int &a) noexcept { std::swap(v_, a.v_); }
+
+	// Access for calling the C API directly
+	mp_int       *get() noexcept { ready_nothrow(); return &v_; }
+	const mp_int *get() const noexcept { return &v_; }
+	mp_int       *raw() const noexcept { return const_cast<mp_int *>(&v_); }
+
+	// Evaluate an expression into dst (used by the operators above)
+	template <class E>
+	static void eval(mp_int *dst, const E &e);
+
+private:
+	void release() noexcept
+	{
+		DIGITS(&v_) = NULL;
+		USED(&v_) = 0;
+		ALLOC(&v_) = 0;
+		SIGN(&v_) = MP_ZPOS;
+	}
+
+	// Moved-from values get fresh digits before being written to
+	void ready()
+	{
+		if (DIGITS(&v_) == NULL)
+			check(mp_init(&v_));
+	}
+
+	void ready_nothrow() noexcept
+	{
+		if (DIGITS(&v_) == NULL)
+			mp_init(&v_);
+	}
+
+	// The library asserts on these rather than returning an error
+	static void check_radix(int radix)
+	{
+		if (radix < 2 || radix > MAX_RADIX)
+			throw error(MP_BADARG);
+	}
+
+	void set_small(const detail::Small &z)
+	{
+		if (detail::fits_digit(z))
+			mp_set(&v_, (mp_digit)z.mag);
+		else
+			check(detail::set_small(&v_, z));
+	}
+
+	template <class E> void assign(const E &e);
+	template <class E> Int &update(const E &e, int op);
+
+	mp_int v_;
+};
+
+// }}}
+
+// {{{ Evaluation
+
+namespace detail {
+
+inline std::deque<Int> &scratch::pool()
+{
+	static thread_local std::deque<Int> p;
+	return p;
+}
+
+inline std::size_t &scratch::depth()
+{
+	static thread_local std::size_t d = 0;
+	return d;
+}
+
+inline scratch::scratch()
+{
+	std::deque<Int> &p = pool();
+
+	if (depth() == p.size())
+		p.emplace_back();
+	p_ = p[depth()].get();
+	++depth();
+}
+
+// How many times does e refer to x, and is x its leftmost leaf?
+template <class E>
+int refs(const E &e, const mp_int *x)
+{
+	if constexpr (is_int_v<E>)
+		return e.get() == x;
+	else if constexpr (is_smallnode_v<E>)
+		return 0;
+	else if constexpr (is_neg<E>::value)
+		return refs(e.e, x);
+	else
+		return refs(e.l, x) + refs(e.r, x);
+}
+
+template <class E>
+bool leftmost(const E &e, const mp_int *x)
+{
+	if constexpr (is_int_v<E>)
+		return e.get() == x;
+	else if constexpr (is_smallnode_v<E>)
+		return false;
+	else if constexpr (is_neg<E>::value)
+		return leftmost(e.e, x);
+	else
+		return leftmost(e.l, x);
+}
+
+// dst = dst (op) r, where op is 0 for +, 1 for -, 2 for *
+template <class R>
+void apply(mp_int *dst, const R &r, int op)
+{
+	if constexpr (is_int_v<R>) {
+		mp_int *b = r.raw();
+
+		check(op == 0 ? mp_add(dst, b, dst) :
+		      op == 1 ? mp_sub(dst, b, dst) : mp_mul(dst, b, dst));
+	} else if constexpr (is_smallnode_v<R>) {
+		if (fits_digit(r)) {
+			mp_digit d = (mp_digit)r.mag;
+
+			check(op == 0 ? mp_add_d(dst, d, dst) :
+			      op == 1 ? mp_sub_d(dst, d, dst) :
+					mp_mul_d(dst, d, dst));
+		} else {
+			scratch t;
+
+			check(set_small(t.get(), r));
+			check(op == 0 ? mp_add(dst, t.get(), dst) :
+			      op == 1 ? mp_sub(dst, t.get(), dst) :
+					mp_mul(dst, t.get(), dst));
+		}
+	} else {
+		scratch t;
+
+		Int::eval(t.get(), r);
+		check(op == 0 ? mp_add(dst, t.get(), dst) :
+		      op == 1 ? mp_sub(dst, t.get(), dst) :
+				mp_mul(dst, t.get(), dst));
+	}
+}
+
+// Evaluate e into dst, assuming dst is not referred to by e except
+// possibly as its leftmost leaf
+template <class E>
+void eval_into(mp_int *dst, const E &e)
+{
+	if constexpr (is_int_v<E>) {
+		check(mp_copy(e.raw(), dst));
+	} else if constexpr (is_smallnode_v<E>) {
+		if (fits_digit(e))
+			mp_set(dst, (mp_digit)e.mag);
+		else
+			check(set_small(dst, e));
+	} else if constexpr (is_neg<E>::value) {
+		eval_into(dst, e.e);
+		check(mp_neg(dst, dst));
+	} else if constexpr (is_mul<E>::value) {
+		using L = std::decay_t<decltype(e.l)>;
+		using R = std::decay_t<decltype(e.r)>;
+
+		if constexpr (is_int_v<L> && is_int_v<R>) {
+			if (e.l.get() == e.r.get())
+				check(mp_sqr(e.l.raw(), dst));
+			else
+				check(mp_mul(e.l.raw(), e.r.raw(), dst));
+		} else if constexpr (is_int_v<L> && is_smallnode_v<R>) {
+			if (fits_digit(e.r)) {
+				check(mp_mul_d(e.l.raw(), (mp_digit)e.r.mag, dst));
+			} else {
+				eval_into(dst, e.l);
+				apply(dst, e.r, 2);
+			}
+		} else {
+			eval_into(dst, e.l);
+			apply(dst, e.r, 2);
+		}
+	} else {
+		// Add or Sub:  the left side goes straight into dst
+		using L = std::decay_t<decltype(e.l)>;
+		constexpr int op = is_add<E>::value ? 0 : 1;
+
+		if constexpr (is_int_v<L> && is_int_v<std::decay_t<decltype(e.r)>>) {
+			check(op == 0 ? mp_add(e.l.raw(), e.r.raw(), dst) :
+			      mp_sub(e.l.raw(), e.r.raw(), dst));
+		} else {
+			eval_into(dst, e.l);
+			apply(dst, e.r, op);
+		}
+	}
+}
+
+} // namespace detail
+
+template <class E>
+void Int::eval(mp_int *dst, const E &e)
+{
+	int n = detail::refs(e, dst);
+
+	if (n == 0 || (n == 1 && detail::leftmost(e, dst))) {
+		detail::eval_into(dst, e);
+	} else {
+		// dst is read after it would be overwritten; go via scratch
+		detail::scratch t;
+
+		detail::eval_into(t.get(), e);
+		mp_exch(t.get(), dst);
+	}
+}
+
+template <class E>
+void Int::assign(const E &e)
+{
+	eval(&v_, e);
+}
+
+template <class E>
+Int &Int::update(const E &e, int op)
+{
+	ready();
+	if (detail::refs(e, &v_) == 0) {
+		detail::apply(&v_, e, op);
+	} else {
+		detail::scratch t;
+
+		eval(t.get(), e);
+		check(op == 0 ? mp_add(&v_, t.get(), &v_) :
+		      op == 1 ? mp_sub(&v_, t.get(), &v_) :
+				mp_mul(&v_, t.get(), &v_));
+	}
+	return *this;
+}
+
+// }}}
+
+// {{{ Operators building expressions
+
+#define MPICPP_BINOP(OP, NODE)                                             \
+template <class A, class B,                                                 \
+	  std::enable_if_t<(detail::is_node_v<A> || detail::is_node_v<B>) && \
+			   (detail::is_node_v<A> || detail::is_small_v<A>) && \
+			   (detail::is_node_v<B> || detail::is_small_v<B>),   \
+			   int> = 0>                                        \
+detail::NODE<detail::wrap_t<A>, detail::wrap_t<B>>                          \
+operator OP(const A &a, const B &b)                                         \
+{                                                                           \
+	return {detail::wrap(a), detail::wrap(b)};                          \
+}
+
+MPICPP_BINOP(+, Add)
+MPICPP_BINOP(-, Sub)
+MPICPP_BINOP(*, Mul)
+
+#undef MPICPP_BINOP
+
+template <class A, std::enable_if_t<detail::is_node_v<A>, int> = 0>
+detail::Neg<detail::wrap_t<A>> operator-(const A &a)
+{
+	return {detail::wrap(a)};
+}
+
+// }}}
+
+// {{{ Operations that produce a new value
+
+template <class E, std::enable_if_t<detail::is_node_v<E>, int> = 0>
+Int value(const E &e)
+{
+	Int out;
+
+	Int::eval(out.get(), detail::wrap(e));
+	return out;
+}
+
+inline Int operator/(const Int &a, const Int &b)
+{
+	Int q;
+
+	check(mp_div(a.raw(), b.raw(), q.get(), NULL));
+	return q;
+}
+
+inline Int operator%(const Int &a, const Int &m)
+{
+	Int r;
+
+	check(mp_mod(a.raw(), m.raw(), r.get()));
+	return r;
+}
+
+inline mp_digit operator%(const Int &a, mp_digit d)
+{
+	mp_digit r;
+
+	check(mp_mod_d(a.raw(), d, &r));
+	return r;
+}
+
+inline Int abs(const Int &a)
+{
+	Int r;
+
+	check(mp_abs(a.raw(), r.get()));
+	return r;
+}
+
+inline Int pow(const Int &a, mp_digit e)
+{
+	Int r;
+
+	check(mp_expt_d(a.raw(), e, r.get()));
+	return r;
+}
+
+inline Int sqrt(const Int &a)
+{
+	Int r;
+
+	check(mp_sqrt(a.raw(), r.get()));
+	return r;
+}
+
+inline Int exptmod(const Int &a, const Int &e, const Int &m)
+{
+	Int r;
+
+	check(mp_exptmod(a.raw(), e.raw(), m.raw(), r.get()));
+	return r;
+}
+
+inline Int gcd(const Int &a, const Int &b)
+{
+	Int r;
+
+	check(mp_gcd(a.raw(), b.raw(), r.get()));
+	return r;
+}
+
+inline Int lcm(const Int &a, const Int &b)
+{
+	Int r;
+
+	check(mp_lcm(a.raw(), b.raw(), r.get()));
+	return r;
+}
+
+// Empty if a has no inverse mod m
+inline std::optional<Int> invmod(const Int &a, const Int &m)
+{
+	Int    r;
+	mp_err res = mp_invmod(a.raw(), m.raw(), r.get());
+
+	if (res == MP_UNDEF)
+		return std::nullopt;
+	check(res);
+	return r;
+}
+
+// }}}
+
+// {{{ Comparisons
+
+inline int cmp(const Int &a, const Int &b) noexcept
+{
+	return mp_cmp(a.raw(), b.raw());
+}
+
+// Values beyond the range of long are compared against a scratch copy
+inline int cmp(const Int &a, const detail::Small &z)
+{
+	if (z.mag <= LONG_MAX)
+		return mp_cmp_int(a.raw(), z.neg ? -(long)z.mag : (long)z.mag);
+
+	detail::scratch t;
+
+	check(detail::set_small(t.get(), z));
+	return mp_cmp(a.raw(), t.get());
+}
+
+#define MPICPP_CMP(OP)                                                     \
+inline bool operator OP(const Int &a, const Int &b) noexcept               \
+	{ return cmp(a, b) OP 0; }                                          \
+template <class T, std::enable_if_t<detail::is_small_v<T>, int> = 0>        \
+bool operator OP(const Int &a, T z)                                         \
+	{ return cmp(a, detail::small(z)) OP 0; }
+
+MPICPP_CMP(==)
+MPICPP_CMP(!=)
+MPICPP_CMP(<)
+MPICPP_CMP(<=)
+MPICPP_CMP(>)
+MPICPP_CMP(>=)
+
+#undef MPICPP_CMP
+
+// }}}
+
+// Output uses the stream's base: hex, oct, or decimal
+inline std::ostream &operator<<(std::ostream &s, const Int &a)
+{
+	std::ios_base::fmtflags f = s.flags() & std::ios_base::basefield;
+
+	return s << a.str(f == std::ios_base::hex ? 16 :
+			  f == std::ios_base::oct ? 8 : 10);
+}
+
+inline void swap(Int &a, Int &b) noexcept { a.swap(b); }
+
+} // namespace mpi
+
+#endif
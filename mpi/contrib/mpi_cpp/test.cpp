@@ -1,206 +1,280 @@
-
-
-// Test program and examples for the C++ extension of the MPI library
-//   by scroussette@yahoo.com
-
-#include <stdio.h>
-#include <iostream.h>
-
-// extern C is needed if mpi.c is compiled as a C file and not as
-// a C++ file
-extern "C"                    
-{
-    #include "mpi.h"
-}
-
-#include "mpicpp.h"
-
-void testallfunctions(void);
-
-void main(void) {
-	// Init 'a' in decimal
-	Mpi a("10000001");
-	// Init 'b' with 100 in decimal or 144 in octal
-	Mpi b("144",8),d;
-	Mpi c, *p, *q;
-	int j;
-	mp_digit digit;
-
-	cout << "a=" << a << " b=" << b;
-
-	if (a==b)
-		cout << " a==b"<< endl;
-	else
-		cout << " a!=b"<<endl;
-
-	// Assign a value to d in decimal
-	d="123456789012345678901234567890";
-	cout << "d=" << d << endl;
-
-	// make arithmetic operations
-	c=a+b;
-	cout << "c=a+b=" << c << endl;
-	j=(c+1)%3;
-	cout << (c+1) << " mod 3=" << j << endl;
-	d=a%b;
-	cout << "c%b =" << d << endl;
-	d=a-b;
-	cout << "a-b=" << d << endl;
-	d=c/b;
-	cout << "c/b=" << d << endl;
-	d=-c/b;
-	cout << "-c/b=" << d << endl;
-
-	if (a%2==0)
-		cout << a << " is even"<<endl;
-	else
-		cout << a << " is odd"<<endl;
-
-	mp_mod(a, b, c);
-	if (c.err==MP_OKAY)
-		cout << a << " mod " << b << " = " << c << endl;
-	else
-		cout << "error"<<endl;
-
-	digit=a[1];
-	// it would be nice if we had a global variable with a default 
-	// radix for the conversions, like "s_mp_defradix", and 
-	// functions to read and set this value.  We wouldn't have
-	// to use the setf function of the stream.
-	cout.setf(ios::hex);
-	cout << "digit 1 of 0x" << a  <<	"=0x" << digit << endl;
-	cout.setf(ios::dec);
-
-	// exemple on how to initialize a new object in hexadecimal
-	p=new Mpi("c7ae466bcafa7c994480ade2e2bd4d121840a000",16);
-	q=new Mpi("8eeae81b84c7f27e080fde64ff05254000000000",16);
-	// and divide
-	if (p->err==MP_OKAY && q->err==MP_OKAY)
-		if (mp_div(*p,*q,a,b)==MP_OKAY)
-			cout <<*p << " div " << *q << " = " << a << " rem=" << b << endl;
-
-	// test exponentiation operator
-	a="25";
-	b="26";
-	c=a^b;
-	cout << a << " exp " << b << "=" << c << endl;
-	c=a^3;
-	cout << a << " exp " << 3 << "=" << c << endl;
-
-	cout << endl;
-
-
-	testallfunctions();
-
-}
-
-// This is simply to check that all functions run correctly
-void testallfunctions(void) {
-	Mpi mp, mp1, mp2;
-	Mpi from, to;
-	Mpi a,b,c,g,m,x,y;
-	mp_digit d,r,k;
-	char str[500];
-	int radix,len;
-	long z;
-	mp_size prec;
-
-	d=r=k=1;
-	radix=10;
-	len=5;
-	z=2;
-	prec=3;
-
-	// The Mpi objects are always initialized by the constructors
-	// when declared.
-//	mp_init(mp);										
-//	mp_init_size(mp, prec);                   
-//	mp_init_copy(mp, from);
-
-	// To test mp_clear:
-	Mpi p;
-	mp_clear(p);                                  
-
-	mp_copy(from, to);                           
-	mp_exch(mp1, mp2);                        
-	mp_zero(mp);                                   
-	mp_set(mp, d);                        
-	mp_set_int(mp, z);                           
-
-
-	mp_add_d(a, d, b);                  
-	mp_sub_d(a, d, b);                  
-	mp_mul_d(a, d, b);                  
-	mp_mul_2(a, c);                              
-	mp_div_d(a, d, c, &r);     
-	mp_div_2(a, c);                              
-	mp_expt_d(a, d, c);                 
-
-
-	mp_abs(a, b);                                
-	mp_neg(a, b);                                
-
-
-	mp_add(a, b, c);                        
-	mp_sub(a, b, c);                        
-	mp_mul(a, b, c);                        
-#if MP_SQUARE
-	mp_sqr(a, b);                                
-#endif
-	mp_div(a, b, x, y);                
-	mp_div_2d(a, d, x, y);         
-	mp_expt(a, b, c);                       
-	mp_2expt(a, k);                          
-	mp_sqrt(a, b);                               
-
-
-#if MP_MODARITH
-	mp_mod(a, m, c);                        
-	mp_mod_d(a, d, &r);             
-	mp_addmod(a, b, m, c);             
-	mp_submod(a, b, m, c);             
-	mp_mulmod(a, b, m, c);             
-#if MP_SQUARE
-	mp_sqrmod(a, m, c);                     
-#endif
-	mp_exptmod(a, b, m, c);            
-	mp_exptmod_d(a, d, m, c);      
-#endif 
-
-
-	mp_cmp_z(a);                                   
-	mp_cmp_d(a, d);                       
-	mp_cmp(a, b);                             
-	mp_cmp_mag(a, b);                         
-	mp_cmp_int(a, z);                         
-	mp_isodd(a);                                   
-	mp_iseven(a);                                  
-
-
-#if MP_NUMTH
-	mp_gcd(a, b, c);                        
-	mp_lcm(a, b, c);                        
-	mp_xgcd(a, b, g, x, y);       
-	mp_invmod(a, m, c);                     
-#endif
-
-
-#if MP_IOFUNC
-	FILE *ofp;
-	ofp=fopen( "testcpp.txt", "w");
-	if (ofp!=NULL) {
-		mp_print(mp, ofp);
-		fclose(ofp);
-	}
-#endif
-
-
-	mp_read_raw(mp, str, len);              
-	mp_raw_size(mp);                               
-	mp_toraw(mp, str);                          
-	mp_read_radix(mp, str, radix);          
-	mp_radix_size(mp, radix);                  
-	mp_toradix(mp, str, radix);             
-
-
-}
+// Test program and examples for the C++ extension of the MPI library
+//   originally by scroussette@yahoo.com
+//
+// Every result is checked against the same computation done through
+// the C API; the program prints each failure and exits with the number
+// of failed checks, so 0 means everything passed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <utility>
+
+#include "mpicpp.h"
+
+extern "C"
+{
+    #include "mpprime.h"
+}
+
+using mpi::Int;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+	do {                                                               \
+		if (!(cond)) {                                             \
+			std::cerr << __FILE__ << ":" << __LINE__           \
+				  << ": check failed: " #cond << std::endl; \
+			++failures;                                        \
+		}                                                          \
+	} while (0)
+
+// A random value of about ndig digits, possibly negative
+static Int random_int(int ndig)
+{
+	Int r;
+
+	mpi::check(mpp_random_size(r.get(), ndig));
+	if (std::rand() & 1)
+		mpi::check(mp_neg(r.get(), r.get()));
+	return r;
+}
+
+// The examples from the original test program, now checked
+static void test_basics()
+{
+	Int a("10000001");
+	Int b("144", 8);        // 100 in octal
+	Int c, d;
+
+	CHECK(b == 100);
+	CHECK(a != b);
+	CHECK(a > b && b < a && a >= a && a <= a);
+
+	d = Int("123456789012345678901234567890");
+	CHECK(d.str() == "123456789012345678901234567890");
+
+	c = a + b;
+	CHECK(c == 10000101);
+	CHECK(value(c + 1) % 3 == 1);
+	CHECK(a % b == 1);
+	CHECK(Int(a - b) == 9999901);
+	CHECK(c / b == 100001);
+	CHECK(value(-c) / b == -100001);
+	CHECK(a.is_odd() && !a.is_even());
+
+	Int p("c7ae466bcafa7c994480ade2e2bd4d121840a000", 16);
+	Int q("8eeae81b84c7f27e080fde64ff05254000000000", 16);
+	Int quo, rem;
+
+	mpi::check(mp_div(p.raw(), q.raw(), quo.get(), rem.get()));
+	CHECK(quo == 1);
+	CHECK(rem.str(16) == "38C35E5046328A1B3C70CF7DE3B827D21840A000");
+	CHECK(p == value(quo * q + rem));
+
+	// 25^26, and back again
+	Int e = mpi::pow(Int(25), 26);
+	CHECK(e.str() ==
+	      "2220446049250313080847263336181640625");
+	CHECK(mpi::sqrt(e) == mpi::pow(Int(25), 13));
+
+	// digit access, and small values that don't fit in a digit
+	Int f("12345678", 16);
+	CHECK(f[0] == 0x5678 && f[1] == 0x1234 && f[7] == 0);
+
+	Int g(-70000);
+	CHECK(g == -70000 && g.sign() < 0);
+	g = value(g * -3 + 100000);
+	CHECK(g == 310000);
+
+	// the full range of the unsigned and long long types
+	Int h = 18446744073709551615ULL;
+	CHECK(h.str() == "18446744073709551615" && h == 18446744073709551615ULL);
+	CHECK(h > 0 && h != -1);
+	h = value(h + 18446744073709551615ULL);
+	CHECK(h.str() == "36893488147419103230");
+	h = value(g * 18446744073709551615ULL - 1);
+	CHECK(h.str() == "5718490662849961000649999");
+	h = LLONG_MIN;
+	CHECK(h.str() == "-9223372036854775808" && h == LLONG_MIN && h < LONG_MAX);
+}
+
+static void test_moves()
+{
+	Int a("98765432109876543210987654321");
+	mp_digit *dp = DIGITS(a.get());
+
+	Int b(std::move(a));
+	CHECK(DIGITS(b.get()) == dp);     // the digits were handed over
+
+	// A moved-from value can be assigned to again
+	a = 42;
+	CHECK(a == 42);
+	a = std::move(b);
+	CHECK(DIGITS(a.get()) == dp);
+	b = a * a;
+	CHECK(b == value(a * a));
+	CHECK(b.str() ==
+	      "9754610579850632525872580399356500533456774881877789971041");
+	Int c(std::move(b));
+	b += 7;
+	CHECK(b == 7);
+
+	std::swap(a, c);
+	CHECK(DIGITS(c.get()) == dp);
+}
+
+// The expressions that are evaluated without temporaries
+static void test_fused()
+{
+	for (int ix = 0; ix < 50; ++ix) {
+		Int a = random_int(1 + ix % 9), b = random_int(1 + ix % 7);
+		Int c = random_int(3), d, t;
+
+		// d = a * b + c
+		d = a * b + c;
+		mpi::check(mp_mul(a.raw(), b.raw(), t.get()));
+		mpi::check(mp_add(t.raw(), c.raw(), t.get()));
+		CHECK(d == t);
+
+		// d += a * b
+		Int acc = d;
+		acc += a * b;
+		mpi::check(mp_mul(a.raw(), b.raw(), t.get()));
+		mpi::check(mp_add(d.raw(), t.raw(), t.get()));
+		CHECK(acc == t);
+
+		// d = (a - c) * (b + 3) - 1
+		d = (a - c) * (b + 3) - 1;
+		Int u, v;
+		mpi::check(mp_sub(a.raw(), c.raw(), u.get()));
+		mpi::check(mp_add_d(b.raw(), 3, v.get()));
+		mpi::check(mp_mul(u.raw(), v.raw(), t.get()));
+		mpi::check(mp_sub_d(t.raw(), 1, t.get()));
+		CHECK(d == t);
+
+		// squaring
+		d = a * a;
+		mpi::check(mp_sqr(a.raw(), t.get()));
+		CHECK(d == t);
+
+		// negation
+		d = -(a + b);
+		mpi::check(mp_add(a.raw(), b.raw(), t.get()));
+		mpi::check(mp_neg(t.raw(), t.get()));
+		CHECK(d == t);
+	}
+}
+
+// The destination appears on the right-hand side
+static void test_aliasing()
+{
+	for (int ix = 0; ix < 50; ++ix) {
+		Int x = random_int(1 + ix % 5), y = random_int(1 + ix % 4);
+		Int x0 = x, t, u;
+
+		// x = x * y + x:  x is read after the product is formed
+		x = x * y + x;
+		mpi::check(mp_mul(x0.raw(), y.raw(), t.get()));
+		mpi::check(mp_add(t.raw(), x0.raw(), t.get()));
+		CHECK(x == t);
+
+		// x += x * y
+		x = x0;
+		x += x * y;
+		CHECK(x == t);
+
+		// x = y - x:  x is not the leftmost operand
+		x = x0;
+		x = y - x;
+		mpi::check(mp_sub(y.raw(), x0.raw(), t.get()));
+		CHECK(x == t);
+
+		// x = x * x - x
+		x = x0;
+		x = x * x - x;
+		mpi::check(mp_sqr(x0.raw(), t.get()));
+		mpi::check(mp_sub(t.raw(), x0.raw(), t.get()));
+		CHECK(x == t);
+
+		// x *= x + 1
+		x = x0;
+		x *= x + 1;
+		mpi::check(mp_add_d(x0.raw(), 1, u.get()));
+		mpi::check(mp_mul(x0.raw(), u.raw(), t.get()));
+		CHECK(x == t);
+
+		// x -= x
+		x = x0;
+		x -= x;
+		CHECK(x.is_zero());
+	}
+}
+
+static void test_number_theory()
+{
+	Int a(240), b(46);
+
+	CHECK(mpi::gcd(a, b) == 2);
+	CHECK(mpi::lcm(a, b) == 5520);
+
+	std::optional<Int> inv = mpi::invmod(Int(3), Int(11));
+	CHECK(inv && *inv == 4);
+	CHECK(!mpi::invmod(Int(4), Int(12)));
+
+	Int m("1000000007");
+	CHECK(mpi::exptmod(Int(2), Int(10), m) == 1024);
+	CHECK(mpi::exptmod(Int(3), Int(m - 1), m) == 1);     // Fermat
+
+	Int r("-17");
+	CHECK(r % Int(5) == 3);
+	CHECK(mpi::abs(r) % (mp_digit)5 == 2);
+	CHECK(mpi::abs(r) == 17);
+}
+
+static void test_output_and_errors()
+{
+	std::ostringstream s;
+	Int a("-255");
+
+	s << a << " " << std::hex << a << " " << std::oct << a;
+	CHECK(s.str() == "-255 -FF -377");
+
+	bool thrown = false;
+	try {
+		Int q = Int(1) / Int(0);
+		(void)q;
+	} catch (const mpi::error &e) {
+		thrown = (e.code() == MP_RANGE);
+	}
+	CHECK(thrown);
+
+	thrown = false;
+	try {
+		Int bad("12", 99);
+	} catch (const mpi::error &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+}
+
+int main()
+{
+	std::srand(1);
+
+	test_basics();
+	test_moves();
+	test_fused();
+	test_aliasing();
+	test_number_theory();
+	test_output_and_errors();
+
+	if (failures)
+		std::cout << failures << " check(s) failed" << std::endl;
+	else
+		std::cout << "all tests passed" << std::endl;
+
+	return failures;
+}
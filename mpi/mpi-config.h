@@ -76,6 +76,33 @@
 #define MP_PTAB_SIZE  128  /* how many built-in primes?         */
 #endif
 
+#ifndef MP_LEHMER_DIGITS
+/*
+  mp_xgcd() (and so mp_invmod()) switches from the binary algorithm
+  to Lehmer's when both operands have at least this many digits.
+ */
+#define MP_LEHMER_DIGITS 4 /* where to start using Lehmer's GCD   */
+#endif
+
+#ifndef MP_THREADS
+/*
+  When set, mpp_make_prime() may test several candidates at once on
+  POSIX threads.  You will need to link with -lpthread (or whatever
+  your system requires) if you turn this on.
+ */
+#define MP_THREADS    0  /* multi-threaded prime search?        */
+#endif
+
+#ifndef MP_ASM
+/*
+  On x86-64 with GCC or Clang, add, subtract and multiply a 64-bit
+  word at a time using the BMI2 (mulx) and ADX (adcx/adox)
+  instructions, if the processor has them; this is checked when the
+  library first needs it.  Set to zero to always use the portable C.
+ */
+#define MP_ASM        1  /* use x86-64 carry-chain kernels?     */
+#endif
+
 #ifndef MP_COMPAT_MACROS
 #define MP_COMPAT_MACROS 0   /* define compatibility macros?    */
 #endif
@@ -58,9 +58,62 @@
 
 #endif
 
+/*
+  Number of leading bits Lehmer's algorithm works with in mp_xgcd();
+  this leaves room in a long for the intermediate sums and products.
+ */
+#define MP_LEHMER_BITS  ((int)(sizeof(long) * CHAR_BIT) - 4)
+
 /* Default precision for newly created mp_int's      */
 static unsigned int s_mp_defprec = MP_DEFPREC;
 
+/*
+  The x86-64 kernels work on 64-bit words (limbs) made of several
+  digits each; the digits are stored least significant first, so on a
+  little-endian machine a run of them can be read as a run of words.
+ */
+#if MP_ASM && defined(__GNUC__) && defined(__x86_64__) && \
+    !defined(_WIN32) && MP_DIGIT_SIZE < 8
+#define MP_X86_64       1
+#include <cpuid.h>
+
+#ifndef bit_BMI2
+#define bit_BMI2  (1 << 8)
+#endif
+#ifndef bit_ADX
+#define bit_ADX   (1 << 19)
+#endif
+
+typedef unsigned long  mp_limb;
+#define MP_LIMB_DIGITS  (sizeof(mp_limb) / sizeof(mp_digit))
+
+/* A double word, for products of words computed in C                 */
+__extension__ typedef unsigned __int128  mp_dlimb;
+#define MP_LIMB_BIT     (sizeof(mp_limb) * CHAR_BIT)
+
+/* Does the processor have BMI2 and ADX?  -1 until we have looked     */
+static int s_mpx_cpu = -1;
+#else
+#define MP_X86_64       0
+#endif
+
+/*
+  On a little-endian host, the bytes of the digit array are the
+  magnitude in little-endian order, whatever the digit size; the
+  binary conversions then come down to copying, with the bytes of each
+  64-bit word swapped for big-endian.
+ */
+#ifndef MP_BIN_WORDS
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__SIZEOF_LONG__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && __SIZEOF_LONG__ == 8
+#define MP_BIN_WORDS    1
+#endif
+#endif
+#endif
+#ifndef MP_BIN_WORDS
+#define MP_BIN_WORDS    0
+#endif
+
 /* {{{ Digit arithmetic macros */
 
 /*
@@ -167,6 +220,9 @@ void     s_mp_exch(mp_int *a, mp_int *b);      /* swap a and b in place   */
 mp_err   s_mp_lshd(mp_int *mp, mp_size p);     /* left-shift by p digits  */
 void     s_mp_rshd(mp_int *mp, mp_size p);     /* right-shift by p digits */
 void     s_mp_div_2d(mp_int *mp, mp_digit d);  /* divide by 2^d in place  */
+mp_size  s_mp_ctz(mp_int *mp);                 /* count trailing 0 bits   */
+void     s_mp_shr(mp_int *mp, mp_size k);      /* divide by 2^k in place  */
+mp_err   s_mp_shl(mp_int *mp, mp_size k);      /* multiply by 2^k in place*/
 void     s_mp_mod_2d(mp_int *mp, mp_digit d);  /* modulo 2^d in place     */
 mp_err   s_mp_mul_2d(mp_int *mp, mp_digit d);  /* multiply by 2^d in place*/
 void     s_mp_div_2(mp_int *mp);               /* divide by 2 in place    */
@@ -179,18 +235,41 @@ mp_err   s_mp_div_d(mp_int *mp, mp_digit d, mp_digit *r);
 		                               /* unsigned digit divide   */
 mp_err   s_mp_reduce(mp_int *x, mp_int *m, mp_int *mu);
                                                /* Barrett reduction       */
+mp_err   s_mp_xgcd_lehmer(mp_int *a, mp_int *b, mp_int *g, 
+			  mp_int *x, mp_int *y);
+                                               /* Lehmer extended GCD     */
+void     s_mp_lehmer_top(mp_int *u, mp_int *v, long *uh, long *vh);
+                                               /* leading bits of u and v */
+mp_err   s_mp_lincomb(mp_int *a, long ca, mp_int *b, long cb,
+		      mp_int *c, mp_int *t1, mp_int *t2);
+                                               /* c = ca a + cb b         */
 mp_err   s_mp_add(mp_int *a, mp_int *b);       /* magnitude addition      */
 mp_err   s_mp_sub(mp_int *a, mp_int *b);       /* magnitude subtract      */
 mp_err   s_mp_mul(mp_int *a, mp_int *b);       /* magnitude multiply      */
+#if MP_X86_64
+int      s_mpx_ok(void);                       /* can we use the kernels? */
+mp_limb  s_mpx_add_n(mp_digit *r, mp_digit *a, mp_digit *b, mp_size n);
+                                               /* r = a + b, n words      */
+mp_limb  s_mpx_sub_n(mp_digit *r, mp_digit *a, mp_digit *b, mp_size n);
+                                               /* r = a - b, n words      */
+mp_limb  s_mpx_mul_1(mp_digit *r, mp_digit *a, mp_size n, mp_limb d);
+                                               /* r = a * d, n words      */
+mp_limb  s_mpx_addmul_1(mp_digit *r, mp_digit *a, mp_size n, mp_limb d);
+                                               /* r += a * d, n words     */
+mp_err   s_mpx_mul(mp_int *a, mp_int *b);      /* s_mp_mul() by words     */
+mp_err   s_mpx_sqr(mp_int *a, mp_int *tmp);    /* s_mp_sqr() by words     */
+#endif
 #if 0
 void     s_mp_kmul(mp_digit *a, mp_digit *b, mp_digit *out, mp_size len);
                                                /* multiply buffers in place */
 #endif
 #if MP_SQUARE
-mp_err   s_mp_sqr(mp_int *a);                  /* magnitude square        */
+mp_err   s_mp_sqr(mp_int *a, mp_int *tmp);     /* magnitude square        */
 #else
-#define  s_mp_sqr(a) s_mp_mul(a, a)
+#define  s_mp_sqr(a, t) s_mp_mul(a, a)
 #endif
+mp_err   s_mp_sqr_start(mp_int *tmp, mp_size len);
+                                               /* ready tmp for a square  */
 mp_err   s_mp_div(mp_int *a, mp_int *b);       /* magnitude divide        */
 mp_err   s_mp_2expt(mp_int *a, mp_digit k);    /* a = 2^k                 */
 int      s_mp_cmp(mp_int *a, mp_int *b);       /* magnitude comparison    */
@@ -198,6 +277,13 @@ int      s_mp_cmp_d(mp_int *a, mp_digit d);    /* magnitude digit compare */
 int      s_mp_ispow2(mp_int *v);               /* is v a power of 2?      */
 int      s_mp_ispow2d(mp_digit d);             /* is d a power of 2?      */
 
+mp_err   s_mp_read_bin(mp_int *mp, unsigned char *str, int len, int big);
+                                                /* magnitude from bytes   */
+void     s_mp_write_bin(mp_int *mp, unsigned char *str, int len, int big);
+                                                /* bytes from magnitude   */
+void     s_mp_revcopy(unsigned char *dst, unsigned char *src, int len);
+                                                /* copy bytes reversed    */
+
 int      s_mp_tovalue(char ch, int r);          /* convert ch to value    */
 char     s_mp_todigit(int val, int r, int low); /* convert val to digit   */
 int      s_mp_outlen(int bits, int r);          /* output length in bytes */
@@ -492,7 +578,7 @@ void   mp_set(mp_int *mp, mp_digit d)
 mp_err mp_set_int(mp_int *mp, long z)
 {
   int            ix;
-  unsigned long  v = abs(z);
+  unsigned long  v = labs(z);
   mp_err         res;
 
   ARGCHK(mp != NULL, MP_BADARG);
@@ -757,7 +843,7 @@ mp_err mp_div_2(mp_int *a, mp_int *c)
 
 mp_err mp_expt_d(mp_int *a, mp_digit d, mp_int *c)
 {
-  mp_int   s, x;
+  mp_int   s, x, t;
   mp_err   res;
   mp_sign  cs = MP_ZPOS;
 
@@ -767,6 +853,8 @@ mp_err mp_expt_d(mp_int *a, mp_digit d, mp_int *c)
     return res;
   if((res = mp_init_copy(&x, a)) != MP_OKAY)
     goto X;
+  if((res = mp_init(&t)) != MP_OKAY)
+    goto T;
 
   DIGIT(&s, 0) = 1;
 
@@ -781,7 +869,7 @@ mp_err mp_expt_d(mp_int *a, mp_digit d, mp_int *c)
 
     d >>= 1;
 
-    if((res = s_mp_sqr(&x)) != MP_OKAY)
+    if((res = s_mp_sqr(&x, &t)) != MP_OKAY)
       goto CLEANUP;
   }
 
@@ -790,6 +878,8 @@ mp_err mp_expt_d(mp_int *a, mp_digit d, mp_int *c)
   s_mp_exch(&s, c);
 
 CLEANUP:
+  mp_clear(&t);
+T:
   mp_clear(&x);
 X:
   mp_clear(&s);
@@ -1122,7 +1212,7 @@ mp_err mp_sqr(mp_int *a, mp_int *b)
   if((res = mp_copy(a, b)) != MP_OKAY)
     return res;
 
-  if((res = s_mp_sqr(b)) != MP_OKAY)
+  if((res = s_mp_sqr(b, NULL)) != MP_OKAY)
     return res;
 
   SIGN(b) = MP_ZPOS;
@@ -1267,7 +1357,7 @@ mp_err mp_div_2d(mp_int *a, mp_digit d, mp_int *q, mp_int *r)
 
 mp_err mp_expt(mp_int *a, mp_int *b, mp_int *c)
 {
-  mp_int   s, x;
+  mp_int   s, x, t;
   mp_err   res;
   mp_digit d;
   int      dig, bit;
@@ -1284,6 +1374,8 @@ mp_err mp_expt(mp_int *a, mp_int *b, mp_int *c)
 
   if((res = mp_init_copy(&x, a)) != MP_OKAY)
     goto X;
+  if((res = mp_init(&t)) != MP_OKAY)
+    goto T;
 
   /* Loop over low-order digits in ascending order */
   for(dig = 0; dig < (USED(b) - 1); dig++) {
@@ -1298,7 +1390,7 @@ mp_err mp_expt(mp_int *a, mp_int *b, mp_int *c)
 
       d >>= 1;
       
-      if((res = s_mp_sqr(&x)) != MP_OKAY)
+      if((res = s_mp_sqr(&x, &t)) != MP_OKAY)
 	goto CLEANUP;
     }
   }
@@ -1314,7 +1406,7 @@ mp_err mp_expt(mp_int *a, mp_int *b, mp_int *c)
 
     d >>= 1;
 
-    if((res = s_mp_sqr(&x)) != MP_OKAY)
+    if((res = s_mp_sqr(&x, &t)) != MP_OKAY)
       goto CLEANUP;
   }
   
@@ -1324,6 +1416,8 @@ mp_err mp_expt(mp_int *a, mp_int *b, mp_int *c)
   res = mp_copy(&s, c);
 
 CLEANUP:
+  mp_clear(&t);
+T:
   mp_clear(&x);
 X:
   mp_clear(&s);
@@ -1423,7 +1517,7 @@ mp_err mp_mod_d(mp_int *a, mp_digit d, mp_digit *c)
 
   ARGCHK(a != NULL && c != NULL, MP_BADARG);
 
-  if(s_mp_cmp_d(a, d) > 0) {
+  if(s_mp_cmp_d(a, d) >= 0) {
     if((res = mp_div_d(a, d, NULL, &rem)) != MP_OKAY)
       return res;
 
@@ -1636,7 +1730,7 @@ mp_err mp_sqrmod(mp_int *a, mp_int *m, mp_int *c)
 
 mp_err mp_exptmod(mp_int *a, mp_int *b, mp_int *m, mp_int *c)
 {
-  mp_int   s, x, mu;
+  mp_int   s, x, mu, t;
   mp_err   res;
   mp_digit d, *db = DIGITS(b);
   mp_size  ub = USED(b);
@@ -1654,6 +1748,8 @@ mp_err mp_exptmod(mp_int *a, mp_int *b, mp_int *m, mp_int *c)
   if((res = mp_mod(&x, m, &x)) != MP_OKAY ||
      (res = mp_init(&mu)) != MP_OKAY)
     goto MU;
+  if((res = mp_init_size(&t, 2 * USED(m))) != MP_OKAY)
+    goto T;
 
   mp_set(&s, 1);
 
@@ -1678,7 +1774,7 @@ mp_err mp_exptmod(mp_int *a, mp_int *b, mp_int *m, mp_int *c)
 
       d >>= 1;
 
-      if((res = s_mp_sqr(&x)) != MP_OKAY)
+      if((res = s_mp_sqr(&x, &t)) != MP_OKAY)
 	goto CLEANUP;
       if((res = s_mp_reduce(&x, m, &mu)) != MP_OKAY)
 	goto CLEANUP;
@@ -1698,7 +1794,7 @@ mp_err mp_exptmod(mp_int *a, mp_int *b, mp_int *m, mp_int *c)
 
     d >>= 1;
 
-    if((res = s_mp_sqr(&x)) != MP_OKAY)
+    if((res = s_mp_sqr(&x, &t)) != MP_OKAY)
       goto CLEANUP;
     if((res = s_mp_reduce(&x, m, &mu)) != MP_OKAY)
       goto CLEANUP;
@@ -1707,6 +1803,8 @@ mp_err mp_exptmod(mp_int *a, mp_int *b, mp_int *m, mp_int *c)
   s_mp_exch(&s, c);
 
  CLEANUP:
+  mp_clear(&t);
+ T:
   mp_clear(&mu);
  MU:
   mp_clear(&x);
@@ -1723,7 +1821,7 @@ mp_err mp_exptmod(mp_int *a, mp_int *b, mp_int *m, mp_int *c)
 
 mp_err mp_exptmod_d(mp_int *a, mp_digit d, mp_int *m, mp_int *c)
 {
-  mp_int   s, x;
+  mp_int   s, x, t;
   mp_err   res;
 
   ARGCHK(a != NULL && c != NULL, MP_BADARG);
@@ -1732,6 +1830,8 @@ mp_err mp_exptmod_d(mp_int *a, mp_digit d, mp_int *m, mp_int *c)
     return res;
   if((res = mp_init_copy(&x, a)) != MP_OKAY)
     goto X;
+  if((res = mp_init(&t)) != MP_OKAY)
+    goto T;
 
   mp_set(&s, 1);
 
@@ -1744,7 +1844,7 @@ mp_err mp_exptmod_d(mp_int *a, mp_digit d, mp_int *m, mp_int *c)
 
     d /= 2;
 
-    if((res = s_mp_sqr(&x)) != MP_OKAY ||
+    if((res = s_mp_sqr(&x, &t)) != MP_OKAY ||
        (res = mp_mod(&x, m, &x)) != MP_OKAY)
       goto CLEANUP;
   }
@@ -1752,6 +1852,8 @@ mp_err mp_exptmod_d(mp_int *a, mp_digit d, mp_int *m, mp_int *c)
   s_mp_exch(&s, c);
 
 CLEANUP:
+  mp_clear(&t);
+T:
   mp_clear(&x);
 X:
   mp_clear(&s);
@@ -1917,13 +2019,18 @@ int    mp_iseven(mp_int *a)
 
 /*
   Like the old mp_gcd() function, except computes the GCD using the
-  binary algorithm due to Josef Stein in 1961 (via Knuth).
+  binary algorithm due to Josef Stein in 1961 (via Knuth).  The powers
+  of two are stripped a whole run of zero bits at a time, and the
+  subtractions are done in place on the magnitudes; if the operands
+  are of very different sizes, one division brings them together
+  first.
  */
 mp_err mp_gcd(mp_int *a, mp_int *b, mp_int *c)
 {
   mp_err   res;
-  mp_int   u, v, t;
-  mp_size  k = 0;
+  mp_int   u, v;
+  mp_size  k, zu, zv;
+  int      cmp;
 
   ARGCHK(a != NULL && b != NULL && c != NULL, MP_BADARG);
 
@@ -1939,80 +2046,57 @@ mp_err mp_gcd(mp_int *a, mp_int *b, mp_int *c)
     SIGN(c) = MP_ZPOS; return MP_OKAY;
   }
 
-  if((res = mp_init(&t)) != MP_OKAY)
-    return res;
   if((res = mp_init_copy(&u, a)) != MP_OKAY)
-    goto U;
+    return res;
   if((res = mp_init_copy(&v, b)) != MP_OKAY)
-    goto V;
+    goto U;
 
   SIGN(&u) = MP_ZPOS;
   SIGN(&v) = MP_ZPOS;
 
-  /* Divide out common factors of 2 until at least 1 of a, b is even */
-  while(mp_iseven(&u) && mp_iseven(&v)) {
-    s_mp_div_2(&u);
-    s_mp_div_2(&v);
-    ++k;
-  }
-
-  /* Initialize t */
-  if(mp_isodd(&u)) {
-    if((res = mp_copy(&v, &t)) != MP_OKAY)
+  /* Keep u the larger, and cut it down to size if it is much larger */
+  if(s_mp_cmp(&u, &v) < 0)
+    s_mp_exch(&u, &v);
+  if(USED(&u) > USED(&v) + 1) {
+    if((res = mp_mod(&u, &v, &u)) != MP_OKAY)
       goto CLEANUP;
-    
-    /* t = -v */
-    if(SIGN(&v) == MP_ZPOS)
-      SIGN(&t) = MP_NEG;
-    else
-      SIGN(&t) = MP_ZPOS;
-    
-  } else {
-    if((res = mp_copy(&u, &t)) != MP_OKAY)
+    if(mp_cmp_z(&u) == MP_EQ) {
+      res = mp_copy(&v, c);
       goto CLEANUP;
-
-  }
-
-  for(;;) {
-    while(mp_iseven(&t)) {
-      s_mp_div_2(&t);
     }
+  }
 
-    if(mp_cmp_z(&t) == MP_GT) {
-      if((res = mp_copy(&t, &u)) != MP_OKAY)
-	goto CLEANUP;
-
-    } else {
-      if((res = mp_copy(&t, &v)) != MP_OKAY)
-	goto CLEANUP;
+  /* Take out the common power of two, and make both odd */
+  zu = s_mp_ctz(&u);
+  zv = s_mp_ctz(&v);
+  k = (zu < zv) ? zu : zv;
+  s_mp_shr(&u, zu);
+  s_mp_shr(&v, zv);
 
-      /* v = -t */
-      if(SIGN(&t) == MP_ZPOS)
-	SIGN(&v) = MP_NEG;
-      else
-	SIGN(&v) = MP_ZPOS;
-    }
+  /* (u, v) = (u, v - u), keeping u <= v and both odd */
+  for(;;) {
+    if((cmp = s_mp_cmp(&u, &v)) == 0)
+      break;
+    if(cmp > 0)
+      s_mp_exch(&u, &v);
 
-    if((res = mp_sub(&u, &v, &t)) != MP_OKAY)
+    if((res = s_mp_sub(&v, &u)) != MP_OKAY)
       goto CLEANUP;
-
-    if(s_mp_cmp_d(&t, 0) == MP_EQ)
-      break;
+    s_mp_shr(&v, s_mp_ctz(&v));
   }
 
-  s_mp_2expt(&v, k);       /* v = 2^k   */
-  res = mp_mul(&u, &v, c); /* c = u * v */
+  if((res = s_mp_shl(&u, k)) != MP_OKAY)
+    goto CLEANUP;
+  res = mp_copy(&u, c);
 
  CLEANUP:
   mp_clear(&v);
- V:
-  mp_clear(&u);
  U:
-  mp_clear(&t);
+  mp_clear(&u);
 
   return res;
 
-} /* end mp_bgcd() */
+} /* end mp_gcd() */
 
 /* }}} */
 
@@ -2063,19 +2147,42 @@ mp_err mp_lcm(mp_int *a, mp_int *b, mp_int *c)
 
   Compute g = (a, b) and values x and y satisfying Bezout's identity
   (that is, ax + by = g).  This uses the extended binary GCD algorithm
-  based on the Stein algorithm used for mp_gcd()
+  based on the Stein algorithm used for mp_gcd(), or for operands of
+  MP_LEHMER_DIGITS digits or more, Lehmer's algorithm, which does most
+  of the work on the leading bits in machine words.
  */
 
 mp_err mp_xgcd(mp_int *a, mp_int *b, mp_int *g, mp_int *x, mp_int *y)
 {
   mp_int   gx, xc, yc, u, v, A, B, C, D;
   mp_int  *clean[9];
+  mp_sign  sa, sb;
   mp_err   res;
   int      last = -1;
 
   if(mp_cmp_z(b) == 0)
     return MP_RANGE;
 
+  sa = SIGN(a);
+  sb = SIGN(b);
+
+  /* (0, b) = |b| = 0 * 0 + b * (+/-1); the loop below never ends on 0 */
+  if(mp_cmp_z(a) == 0) {
+    if(g && (res = mp_abs(b, g)) != MP_OKAY)
+      return res;
+    if(y) {
+      mp_set(y, 1);
+      if(sb == MP_NEG)
+	SIGN(y) = MP_NEG;
+    }
+    if(x)
+      mp_zero(x);
+    return MP_OKAY;
+  }
+
+  if(USED(a) >= MP_LEHMER_DIGITS && USED(b) >= MP_LEHMER_DIGITS)
+    return s_mp_xgcd_lehmer(a, b, g, x, y);
+
   /* Initialize all these variables we need */
   if((res = mp_init(&u)) != MP_OKAY) goto CLEANUP;
   clean[++last] = &u;
@@ -2154,6 +2261,12 @@ mp_err mp_xgcd(mp_int *a, mp_int *b, mp_int *g, mp_int *x, mp_int *y)
 
     /* If we're done, copy results to output */
     if(mp_cmp_z(&u) == 0) {
+      /* C and D are for |a| and |b|; fix them up for a and b */
+      if(sa == MP_NEG)
+	mp_neg(&C, &C);
+      if(sb == MP_NEG)
+	mp_neg(&D, &D);
+
       if(x)
 	if((res = mp_copy(&C, x)) != MP_OKAY) goto CLEANUP;
 
@@ -2213,6 +2326,9 @@ mp_err mp_invmod(mp_int *a, mp_int *m, mp_int *c)
     goto CLEANUP;
   }
 
+  /* x inverts a; the answer has always been |a|^-1 with a's sign */
+  if(sa == MP_NEG)
+    mp_neg(&x, &x);
   res = mp_mod(&x, m, c);
   SIGN(c) = sa;
 
@@ -2323,32 +2439,38 @@ mp_err mp_to_signed_bin(mp_int *mp, unsigned char *str)
 /*
   mp_read_unsigned_bin(mp, str, len)
 
-  Read in an unsigned value (base 256) into the given mp_int
+  Read in an unsigned value (base 256) into the given mp_int; the most
+  significant byte comes first.
  */
 
 mp_err  mp_read_unsigned_bin(mp_int *mp, unsigned char *str, int len)
 {
-  int     ix;
-  mp_err  res;
-
   ARGCHK(mp != NULL && str != NULL && len > 0, MP_BADARG);
 
-  mp_zero(mp);
+  return s_mp_read_bin(mp, str, len, 1);
 
-  for(ix = 0; ix < len; ix++) {
-    if((res = s_mp_mul_2d(mp, CHAR_BIT)) != MP_OKAY)
-      return res;
-
-    if((res = mp_add_d(mp, str[ix], mp)) != MP_OKAY)
-      return res;
-  }
-  
-  return MP_OKAY;
-  
 } /* end mp_read_unsigned_bin() */
 
 /* }}} */
 
+/* {{{ mp_read_unsigned_bin_le(mp, str, len) */
+
+/*
+  mp_read_unsigned_bin_le(mp, str, len)
+
+  As mp_read_unsigned_bin(), but the least significant byte comes first.
+ */
+
+mp_err  mp_read_unsigned_bin_le(mp_int *mp, unsigned char *str, int len)
+{
+  ARGCHK(mp != NULL && str != NULL && len > 0, MP_BADARG);
+
+  return s_mp_read_bin(mp, str, len, 0);
+
+} /* end mp_read_unsigned_bin_le() */
+
+/* }}} */
+
 /* {{{ mp_unsigned_bin_size(mp) */
 
 int     mp_unsigned_bin_size(mp_int *mp) 
@@ -2380,55 +2502,56 @@ int     mp_unsigned_bin_size(mp_int *mp)
 
 mp_err mp_to_unsigned_bin(mp_int *mp, unsigned char *str)
 {
-  mp_digit      *dp, *end, d;
-  unsigned char *spos;
-
   ARGCHK(mp != NULL && str != NULL, MP_BADARG);
 
-  dp = DIGITS(mp);
-  end = dp + USED(mp) - 1;
-  spos = str;
+  s_mp_write_bin(mp, str, mp_unsigned_bin_size(mp), 1);
 
-  /* Special case for zero, quick test */
-  if(dp == end && *dp == 0) {
-    *str = '\0';
-    return MP_OKAY;
-  }
+  return MP_OKAY;
 
-  /* Generate digits in reverse order */
-  while(dp < end) {
-    int      ix;
+} /* end mp_to_unsigned_bin() */
 
-    d = *dp;
-    for(ix = 0; ix < sizeof(mp_digit); ++ix) {
-      *spos = d & UCHAR_MAX;
-      d >>= CHAR_BIT;
-      ++spos;
-    }
+/* }}} */
 
-    ++dp;
-  }
+/* {{{ mp_to_fixlen_bin(mp, str, len) */
 
-  /* Now handle last digit specially, high order zeroes are not written */
-  d = *end;
-  while(d != 0) {
-    *spos = d & UCHAR_MAX;
-    d >>= CHAR_BIT;
-    ++spos;
-  }
+/*
+  mp_to_fixlen_bin(mp, str, len)
 
-  /* Reverse everything to get digits in the correct order */
-  while(--spos > str) {
-    unsigned char t = *str;
-    *str = *spos;
-    *spos = t;
+  Write the magnitude of mp into exactly len bytes at str, most
+  significant first, with leading zeroes as needed.  Returns MP_RANGE
+  (and writes nothing) if it does not fit.
+ */
 
-    ++str;
-  }
+mp_err mp_to_fixlen_bin(mp_int *mp, unsigned char *str, int len)
+{
+  ARGCHK(mp != NULL && str != NULL && len > 0, MP_BADARG);
+
+  if(mp_unsigned_bin_size(mp) > len)
+    return MP_RANGE;
+
+  s_mp_write_bin(mp, str, len, 1);
 
   return MP_OKAY;
 
-} /* end mp_to_unsigned_bin() */
+} /* end mp_to_fixlen_bin() */
+
+/* }}} */
+
+/* {{{ mp_to_fixlen_bin_le(mp, str, len) */
+
+/* As mp_to_fixlen_bin(), but the least significant byte comes first    */
+mp_err mp_to_fixlen_bin_le(mp_int *mp, unsigned char *str, int len)
+{
+  ARGCHK(mp != NULL && str != NULL && len > 0, MP_BADARG);
+
+  if(mp_unsigned_bin_size(mp) > len)
+    return MP_RANGE;
+
+  s_mp_write_bin(mp, str, len, 0);
+
+  return MP_OKAY;
+
+} /* end mp_to_fixlen_bin_le() */
 
 /* }}} */
 
@@ -3054,6 +3177,62 @@ void     s_mp_div_2d(mp_int *mp, mp_digit d)
 
 /* }}} */
 
+/* {{{ s_mp_ctz(mp) */
+
+/* Count the zero bits below the lowest one bit of mp (0 if mp is 0)     */
+
+mp_size  s_mp_ctz(mp_int *mp)
+{
+  mp_size   ix = 0, k = 0;
+  mp_digit  d;
+
+  while(ix < USED(mp) && DIGIT(mp, ix) == 0)
+    ++ix;
+  if(ix == USED(mp))
+    return 0;
+
+  d = DIGIT(mp, ix);
+  while((d & 1) == 0) {
+    d >>= 1;
+    ++k;
+  }
+
+  return ix * DIGIT_BIT + k;
+
+} /* end s_mp_ctz() */
+
+/* }}} */
+
+/* {{{ s_mp_shr(mp, k) */
+
+/* Divide by 2^k in place, for any k, not just k < 2^DIGIT_BIT           */
+
+void     s_mp_shr(mp_int *mp, mp_size k)
+{
+  s_mp_rshd(mp, k / DIGIT_BIT);
+  s_mp_div_2d(mp, (mp_digit)(k % DIGIT_BIT));
+
+} /* end s_mp_shr() */
+
+/* }}} */
+
+/* {{{ s_mp_shl(mp, k) */
+
+/* Multiply by 2^k in place, for any k                                    */
+
+mp_err   s_mp_shl(mp_int *mp, mp_size k)
+{
+  mp_err   res;
+
+  if((res = s_mp_lshd(mp, k / DIGIT_BIT)) != MP_OKAY)
+    return res;
+
+  return s_mp_mul_2d(mp, (mp_digit)(k % DIGIT_BIT));
+
+} /* end s_mp_shl() */
+
+/* }}} */
+
 /* {{{ s_mp_norm(a, b) */
 
 /*
@@ -3191,7 +3370,16 @@ mp_err   s_mp_mul_d(mp_int *a, mp_digit d)
     dp = DIGITS(a);
   }
 
-  for(ix = 0; ix < max; ix++) {
+  ix = 0;
+#if MP_X86_64
+  /* Whole words first; the carry out is less than d, so one digit   */
+  if(max >= MP_LIMB_DIGITS && s_mpx_ok()) {
+    ix = max - max % MP_LIMB_DIGITS;
+    k = s_mpx_mul_1(dp, dp, ix / MP_LIMB_DIGITS, d);
+  }
+#endif
+
+  for(; ix < max; ix++) {
     w = (dp[ix] * d) + k;
     dp[ix] = ACCUM(w);
     k = CARRYOUT(w);
@@ -3295,7 +3483,16 @@ mp_err   s_mp_add(mp_int *a, mp_int *b)        /* magnitude addition      */
    */
   pa = DIGITS(a);
   pb = DIGITS(b);
-  for(ix = 0; ix < used; ++ix) {
+  ix = 0;
+#if MP_X86_64
+  if(used >= MP_LIMB_DIGITS && s_mpx_ok()) {
+    ix = used - used % MP_LIMB_DIGITS;
+    w = s_mpx_add_n(pa, pa, pb, ix / MP_LIMB_DIGITS);
+    pa += ix;
+    pb += ix;
+  }
+#endif
+  for(; ix < used; ++ix) {
     w += *pa + *pb++;
     *pa++ = ACCUM(w);
     w = CARRYOUT(w);
@@ -3346,8 +3543,17 @@ mp_err   s_mp_sub(mp_int *a, mp_int *b)        /* magnitude subtract      */
    */
   pa = DIGITS(a);
   pb = DIGITS(b);
+  ix = 0;
+#if MP_X86_64
+  if(used >= MP_LIMB_DIGITS && s_mpx_ok()) {
+    ix = used - used % MP_LIMB_DIGITS;
+    w = s_mpx_sub_n(pa, pa, pb, ix / MP_LIMB_DIGITS);
+    pa += ix;
+    pb += ix;
+  }
+#endif
 
-  for(ix = 0; ix < used; ++ix) {
+  for(; ix < used; ++ix) {
     w = (RADIX + *pa) - w - *pb++;
     *pa++ = ACCUM(w);
     w = CARRYOUT(w) ? 0 : 1;
@@ -3389,6 +3595,11 @@ mp_err   s_mp_mul(mp_int *a, mp_int *b)
   mp_size   ix, jx, ua = USED(a), ub = USED(b);
   mp_digit *pa, *pb, *pt, *pbt;
 
+#if MP_X86_64
+  if(ua >= MP_LIMB_DIGITS && ub >= MP_LIMB_DIGITS && s_mpx_ok())
+    return s_mpx_mul(a, b);
+#endif
+
   if((res = mp_init_size(&tmp, ua + ub)) != MP_OKAY)
     return res;
 
@@ -3429,6 +3640,311 @@ mp_err   s_mp_mul(mp_int *a, mp_int *b)
 
 /* }}} */
 
+/* {{{ x86-64 word kernels */
+
+#if MP_X86_64
+
+/* {{{ s_mpx_ok() */
+
+/*
+  Report whether the word kernels below can be used, that is, whether
+  the processor has BMI2 and ADX.  The first caller does the check;
+  if several threads race to do it, they all store the same answer.
+ */
+int      s_mpx_ok(void)
+{
+  if(s_mpx_cpu < 0) {
+    unsigned int  eax, ebx, ecx, edx;
+
+    if(__get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      s_mpx_cpu = (ebx & bit_BMI2) && (ebx & bit_ADX);
+    } else {
+      s_mpx_cpu = 0;
+    }
+  }
+
+  return s_mpx_cpu;
+
+} /* end s_mpx_ok() */
+
+/* }}} */
+
+/* {{{ s_mpx_add_n(r, a, b, n) */
+
+/*
+  Compute r = a + b over n > 0 words, and return the carry out.  r may
+  be the same as a or b.  The loop counter is kept with dec, which
+  leaves the carry flag alone, so that adc can carry it round.
+ */
+mp_limb  s_mpx_add_n(mp_digit *r, mp_digit *a, mp_digit *b, mp_size n)
+{
+  mp_limb  c, t, cnt = n;
+
+  __asm__ __volatile__ (
+    "xorl   %k[c], %k[c]\n\t"
+    "1:\n\t"
+    "movq   (%[a]), %[t]\n\t"
+    "adcq   (%[b]), %[t]\n\t"
+    "movq   %[t], (%[r])\n\t"
+    "leaq   8(%[a]), %[a]\n\t"
+    "leaq   8(%[b]), %[b]\n\t"
+    "leaq   8(%[r]), %[r]\n\t"
+    "decq   %[n]\n\t"
+    "jnz    1b\n\t"
+    "adcq   $0, %[c]"
+    : [c] "=&r" (c), [t] "=&r" (t),
+      [r] "+r" (r), [a] "+r" (a), [b] "+r" (b), [n] "+r" (cnt)
+    :
+    : "cc", "memory");
+
+  return c;
+
+} /* end s_mpx_add_n() */
+
+/* }}} */
+
+/* {{{ s_mpx_sub_n(r, a, b, n) */
+
+/* Compute r = a - b over n > 0 words, and return the borrow out      */
+mp_limb  s_mpx_sub_n(mp_digit *r, mp_digit *a, mp_digit *b, mp_size n)
+{
+  mp_limb  c, t, cnt = n;
+
+  __asm__ __volatile__ (
+    "xorl   %k[c], %k[c]\n\t"
+    "1:\n\t"
+    "movq   (%[a]), %[t]\n\t"
+    "sbbq   (%[b]), %[t]\n\t"
+    "movq   %[t], (%[r])\n\t"
+    "leaq   8(%[a]), %[a]\n\t"
+    "leaq   8(%[b]), %[b]\n\t"
+    "leaq   8(%[r]), %[r]\n\t"
+    "decq   %[n]\n\t"
+    "jnz    1b\n\t"
+    "adcq   $0, %[c]"
+    : [c] "=&r" (c), [t] "=&r" (t),
+      [r] "+r" (r), [a] "+r" (a), [b] "+r" (b), [n] "+r" (cnt)
+    :
+    : "cc", "memory");
+
+  return c;
+
+} /* end s_mpx_sub_n() */
+
+/* }}} */
+
+/* {{{ s_mpx_mul_1(r, a, n, d) */
+
+/*
+  Compute r = a * d over n > 0 words, and return the high word of the
+  product.  mulx does not touch the flags, so the high half of each
+  product is added into the next with a single adcx chain.
+ */
+mp_limb  s_mpx_mul_1(mp_digit *r, mp_digit *a, mp_size n, mp_limb d)
+{
+  mp_limb  hi, lo, t, cnt = n;
+
+  __asm__ __volatile__ (
+    "xorl   %k[hi], %k[hi]\n\t"
+    "1:\n\t"
+    "mulxq  (%[a]), %[lo], %[t]\n\t"
+    "adcxq  %[hi], %[lo]\n\t"
+    "movq   %[lo], (%[r])\n\t"
+    "movq   %[t], %[hi]\n\t"
+    "leaq   8(%[a]), %[a]\n\t"
+    "leaq   8(%[r]), %[r]\n\t"
+    "decq   %[n]\n\t"
+    "jnz    1b\n\t"
+    "adcq   $0, %[hi]"
+    : [hi] "=&r" (hi), [lo] "=&r" (lo), [t] "=&r" (t),
+      [r] "+r" (r), [a] "+r" (a), [n] "+r" (cnt)
+    : "d" (d)
+    : "cc", "memory");
+
+  return hi;
+
+} /* end s_mpx_mul_1() */
+
+/* }}} */
+
+/* {{{ s_mpx_addmul_1(r, a, n, d) */
+
+/*
+  Compute r = r + a * d over n > 0 words, and return the word carried
+  out of the top.  This is the inner loop of multiplication, and uses
+  two carry chains at once:  adcx adds the high half of the previous
+  product in on the carry flag, and adox adds the old value of r in on
+  the overflow flag.  Neither the loop count (lea, jrcxz) nor mulx
+  disturbs either flag, so both run the length of the loop, and are
+  added into the high word at the end; that cannot overflow, since
+  a * d + r fits in n + 1 words.
+ */
+mp_limb  s_mpx_addmul_1(mp_digit *r, mp_digit *a, mp_size n, mp_limb d)
+{
+  mp_limb  hi, lo, t, z, cnt = n;
+
+  __asm__ __volatile__ (
+    "xorl   %k[z], %k[z]\n\t"
+    "movq   %[z], %[hi]\n\t"
+    "1:\n\t"
+    "mulxq  (%[a]), %[lo], %[t]\n\t"
+    "adcxq  %[hi], %[lo]\n\t"
+    "adoxq  (%[r]), %[lo]\n\t"
+    "movq   %[lo], (%[r])\n\t"
+    "movq   %[t], %[hi]\n\t"
+    "leaq   8(%[a]), %[a]\n\t"
+    "leaq   8(%[r]), %[r]\n\t"
+    "leaq   -1(%[n]), %[n]\n\t"
+    "jrcxz  2f\n\t"
+    "jmp    1b\n"
+    "2:\n\t"
+    "adcxq  %[z], %[hi]\n\t"
+    "adoxq  %[z], %[hi]"
+    : [hi] "=&r" (hi), [lo] "=&r" (lo), [t] "=&r" (t), [z] "=&r" (z),
+      [r] "+r" (r), [a] "+r" (a), [n] "+c" (cnt)
+    : "d" (d)
+    : "cc", "memory");
+
+  return hi;
+
+} /* end s_mpx_addmul_1() */
+
+/* }}} */
+
+/* {{{ s_mpx_mul(a, b) */
+
+/*
+  Compute a = |a| * |b| as s_mp_mul() does, but a word of b at a time
+  against all of a.  a is padded with zeroes to a whole number of
+  words so that the kernel can read it; the words of b are put
+  together here, so that b itself (which may be shared) is only read.
+ */
+mp_err   s_mpx_mul(mp_int *a, mp_int *b)
+{
+  mp_int    tmp;
+  mp_err    res;
+  mp_size   ix, jx, la, lb, ub = USED(b);
+  mp_digit *pb, *pt;
+  mp_limb   d, k;
+
+  la = (USED(a) + MP_LIMB_DIGITS - 1) / MP_LIMB_DIGITS;
+  lb = (ub + MP_LIMB_DIGITS - 1) / MP_LIMB_DIGITS;
+
+  if((res = s_mp_pad(a, la * MP_LIMB_DIGITS)) != MP_OKAY)
+    return res;
+
+  if((res = mp_init_size(&tmp, (la + lb) * MP_LIMB_DIGITS)) != MP_OKAY)
+    return res;
+
+  USED(&tmp) = (la + lb) * MP_LIMB_DIGITS;
+
+  pb = DIGITS(b);
+  pt = DIGITS(&tmp);
+  for(ix = 0; ix < lb; ++ix) {
+    /* The last word of b may be short */
+    d = 0;
+    for(jx = MP_LIMB_DIGITS; jx-- > 0; ) {
+      d <<= DIGIT_BIT;
+      if(ix * MP_LIMB_DIGITS + jx < ub)
+	d |= pb[ix * MP_LIMB_DIGITS + jx];
+    }
+
+    if(d == 0)
+      continue;
+
+    k = s_mpx_addmul_1(pt + ix * MP_LIMB_DIGITS, DIGITS(a), la, d);
+
+    /* Nothing has been written to the top word of this row yet */
+    for(jx = 0; jx < MP_LIMB_DIGITS; ++jx) {
+      pt[(ix + la) * MP_LIMB_DIGITS + jx] = ACCUM(k);
+      k >>= DIGIT_BIT;
+    }
+  }
+
+  s_mp_clamp(&tmp);
+  s_mp_exch(&tmp, a);
+
+  mp_clear(&tmp);
+
+  return MP_OKAY;
+
+} /* end s_mpx_mul() */
+
+/* }}} */
+
+/* {{{ s_mpx_sqr(a, tmp) */
+
+/*
+  Compute a = |a|^2 as s_mp_sqr() does, by columns, but a word at a
+  time.  The products are formed in C as double words; the low two
+  words of the accumulator are a double word too, and the third just
+  counts what carries out of them.  None of the instructions the
+  other kernels need are used, so this works on any x86-64.
+ */
+mp_err   s_mpx_sqr(mp_int *a, mp_int *tmp)
+{
+  mp_err    res;
+  mp_size   ix, jx, kx, la;
+  mp_limb   x, y, hi;
+  mp_dlimb  p, acc, carry = 0;
+  mp_digit *pa, *pt;
+
+  la = (USED(a) + MP_LIMB_DIGITS - 1) / MP_LIMB_DIGITS;
+
+  if((res = s_mp_pad(a, la * MP_LIMB_DIGITS)) != MP_OKAY)
+    return res;
+  if((res = s_mp_sqr_start(tmp, 2 * la * MP_LIMB_DIGITS)) != MP_OKAY)
+    return res;
+
+  pa = DIGITS(a);
+  pt = DIGITS(tmp);
+  for(kx = 0; kx < 2 * la - 1; ++kx) {
+    ix = (kx < la) ? 0 : kx - la + 1;
+    jx = kx - ix;
+    acc = 0;
+    hi = 0;
+    for( ; ix < jx; ++ix, --jx) {
+      memcpy(&x, pa + ix * MP_LIMB_DIGITS, sizeof(x));
+      memcpy(&y, pa + jx * MP_LIMB_DIGITS, sizeof(y));
+      p = (mp_dlimb)x * y;
+      acc += p;
+      hi += (acc < p);
+    }
+
+    hi = (hi << 1) | (mp_limb)(acc >> (2 * MP_LIMB_BIT - 1));
+    acc <<= 1;
+
+    if(ix == jx) {
+      memcpy(&x, pa + ix * MP_LIMB_DIGITS, sizeof(x));
+      p = (mp_dlimb)x * x;
+      acc += p;
+      hi += (acc < p);
+    }
+
+    acc += carry;
+    hi += (acc < carry);
+
+    x = (mp_limb)acc;
+    memcpy(pt + kx * MP_LIMB_DIGITS, &x, sizeof(x));
+    carry = (acc >> MP_LIMB_BIT) | ((mp_dlimb)hi << MP_LIMB_BIT);
+  }
+  x = (mp_limb)carry;
+  memcpy(pt + kx * MP_LIMB_DIGITS, &x, sizeof(x));
+
+  s_mp_clamp(tmp);
+  s_mp_exch(tmp, a);
+
+  return MP_OKAY;
+
+} /* end s_mpx_sqr() */
+
+/* }}} */
+
+#endif /* MP_X86_64 */
+
+/* }}} */
+
 /* {{{ s_mp_kmul(a, b, out, len) */
 
 #if 0
@@ -3459,120 +3975,117 @@ void   s_mp_kmul(mp_digit *a, mp_digit *b, mp_digit *out, mp_size len)
 
 /* }}} */
 
-/* {{{ s_mp_sqr(a) */
+/* {{{ s_mp_sqr(a, tmp) */
 
 /*
-  Computes the square of a, in place.  This can be done more
-  efficiently than a general multiplication, because many of the
-  computation steps are redundant when squaring.  The inner product
-  step is a bit more complicated, but we save a fair number of
-  iterations of the multiplication loop.
+  Computes the square of a, in place.  Squaring needs only about half
+  the digit products of a general multiplication, since a[i] a[j] and
+  a[j] a[i] are the same.  This works a column of the result at a time
+  (Comba's method):  the cross products for a column are summed, then
+  doubled all at once, and the square term and the carry from the
+  previous column added; a digit of the result comes off the bottom of
+  the three-digit accumulator this makes.
+
+  The result is built in tmp, which is then exchanged with a, so tmp
+  ends up with the old digits of a.  A caller squaring repeatedly can
+  pass the same tmp each time; once it has grown large enough it is
+  not reallocated.  If tmp is NULL, a temporary is made and freed.
  */
 #if MP_SQUARE
-mp_err   s_mp_sqr(mp_int *a)
+mp_err   s_mp_sqr(mp_int *a, mp_int *tmp)
 {
-  mp_word  w, k = 0;
-  mp_int   tmp;
-  mp_err   res;
-  mp_size  ix, jx, kx, used = USED(a);
-  mp_digit *pa1, *pa2, *pt, *pbt;
-
-  if((res = mp_init_size(&tmp, 2 * used)) != MP_OKAY)
-    return res;
-
-  /* Left-pad with zeroes */
-  USED(&tmp) = 2 * used;
-
-  /* We need the base value each time through the loop */
-  pbt = DIGITS(&tmp);
-
-  pa1 = DIGITS(a);
-  for(ix = 0; ix < used; ++ix, ++pa1) {
-    if(*pa1 == 0)
-      continue;
+  mp_int    local;
+  mp_err    res;
+  mp_word   w, lo, hi, clo = 0, chi = 0;
+  mp_size   ix, jx, kx, used = USED(a);
+  mp_digit *pa, *pt;
 
-    w = DIGIT(&tmp, ix + ix) + (*pa1 * *pa1);
+  if(tmp == NULL) {
+    if((res = mp_init_size(&local, 2 * used)) != MP_OKAY)
+      return res;
 
-    pbt[ix + ix] = ACCUM(w);
-    k = CARRYOUT(w);
+    res = s_mp_sqr(a, &local);
+    mp_clear(&local);
 
-    /*
-      The inner product is computed as:
+    return res;
+  }
 
-         (C, S) = t[i,j] + 2 a[i] a[j] + C
+#if MP_X86_64
+  if(used >= MP_LIMB_DIGITS)
+    return s_mpx_sqr(a, tmp);
+#endif
 
-      This can overflow what can be represented in an mp_word, and
-      since C arithmetic does not provide any way to check for
-      overflow, we have to check explicitly for overflow conditions
-      before they happen.
-     */
-    for(jx = ix + 1, pa2 = DIGITS(a) + jx; jx < used; ++jx, ++pa2) {
-      mp_word  u = 0, v;
-      
-      /* Store this in a temporary to avoid indirections later */
-      pt = pbt + ix + jx;
+  if((res = s_mp_sqr_start(tmp, 2 * used)) != MP_OKAY)
+    return res;
 
-      /* Compute the multiplicative step */
-      w = *pa1 * *pa2;
+  pa = DIGITS(a);
+  pt = DIGITS(tmp);
+  for(kx = 0; kx < 2 * used - 1; ++kx) {
+    /* Sum a[ix] a[jx] for ix < jx, ix + jx = kx */
+    ix = (kx < used) ? 0 : kx - used + 1;
+    jx = kx - ix;
+    lo = hi = 0;
+    for( ; ix < jx; ++ix, --jx) {
+      w = (mp_word)pa[ix] * pa[jx];
+      lo += w;
+      hi += (lo < w);
+    }
 
-      /* If w is more than half MP_WORD_MAX, the doubling will
-	 overflow, and we need to record a carry out into the next
-	 word */
-      u = (w >> (MP_WORD_BIT - 1)) & 1;
+    /* Double it */
+    hi = (hi << 1) | (lo >> (MP_WORD_BIT - 1));
+    lo <<= 1;
 
-      /* Double what we've got, overflow will be ignored as defined
-	 for C arithmetic (we've already noted if it is to occur)
-       */
-      w *= 2;
+    /* Add the square term, if this column has one */
+    if(ix == jx) {
+      w = (mp_word)pa[ix] * pa[ix];
+      lo += w;
+      hi += (lo < w);
+    }
 
-      /* Compute the additive step */
-      v = *pt + k;
+    /* And the carry from the column before */
+    lo += clo;
+    hi += (lo < clo) + chi;
 
-      /* If we do not already have an overflow carry, check to see
-	 if the addition will cause one, and set the carry out if so 
-       */
-      u |= ((MP_WORD_MAX - v) < w);
+    pt[kx] = ACCUM(lo);
+    clo = CARRYOUT(lo) | (hi << DIGIT_BIT);
+    chi = hi >> DIGIT_BIT;
+  }
+  pt[kx] = ACCUM(clo);
 
-      /* Add in the rest, again ignoring overflow */
-      w += v;
+  s_mp_clamp(tmp);
+  s_mp_exch(tmp, a);
 
-      /* Set the i,j digit of the output */
-      *pt = ACCUM(w);
+  return MP_OKAY;
 
-      /* Save carry information for the next iteration of the loop.
-	 This is why k must be an mp_word, instead of an mp_digit */
-      k = CARRYOUT(w) | (u << DIGIT_BIT);
+} /* end s_mp_sqr() */
+#endif
 
-    } /* for(jx ...) */
+/* }}} */
 
-    /* Set the last digit in the cycle and reset the carry */
-    k = DIGIT(&tmp, ix + jx) + k;
-    pbt[ix + jx] = ACCUM(k);
-    k = CARRYOUT(k);
+/* {{{ s_mp_sqr_start(tmp, len) */
 
-    /* If we are carrying out, propagate the carry to the next digit
-       in the output.  This may cascade, so we have to be somewhat
-       circumspect -- but we will have enough precision in the output
-       that we won't overflow 
-     */
-    kx = 1;
-    while(k) {
-      k = pbt[ix + jx + kx] + 1;
-      pbt[ix + jx + kx] = ACCUM(k);
-      k = CARRYOUT(k);
-      ++kx;
-    }
-  } /* for(ix ...) */
+/*
+  Make tmp ready to receive a square of 'len' digits.  Every one of
+  those digits is written, so only what lies beyond them needs to be
+  cleared, in case tmp was longer than that before.
+ */
+mp_err   s_mp_sqr_start(mp_int *tmp, mp_size len)
+{
+  mp_err   res;
 
-  s_mp_clamp(&tmp);
-  s_mp_exch(&tmp, a);
+  if(len > ALLOC(tmp)) {
+    if((res = s_mp_grow(tmp, len)) != MP_OKAY)
+      return res;
+  } else if(USED(tmp) > len) {
+    s_mp_setz(DIGITS(tmp) + len, USED(tmp) - len);
+  }
 
-  mp_clear(&tmp);
+  USED(tmp) = len;
+  SIGN(tmp) = MP_ZPOS;
 
   return MP_OKAY;
 
-} /* end s_mp_sqr() */
-#endif
+} /* end s_mp_sqr_start() */
 
 /* }}} */
 
@@ -3790,6 +4303,189 @@ mp_err   s_mp_reduce(mp_int *x, mp_int *m, mp_int *mu)
 
 /* }}} */
 
+/* {{{ s_mp_xgcd_lehmer(a, b, g, x, y) */
+
+/*
+  Compute g = (a, b) and x, y with ax + by = g, as for mp_xgcd(), by
+  Lehmer's method (Knuth 4.5.2, Algorithm L; HAC 14.57).  The leading
+  bits of u and v are run through Euclid's algorithm in a long, for as
+  long as the quotients are sure to be the same as for u and v
+  themselves; the steps taken are collected in a 2x2 matrix, which is
+  then applied to u and v all at once.  When that fails to make any
+  progress, one full division step is taken instead.
+
+  Only the cofactor of a is tracked; y is recovered at the end from
+  (g - ax) / b.
+ */
+
+mp_err   s_mp_xgcd_lehmer(mp_int *a, mp_int *b, mp_int *g, 
+			  mp_int *x, mp_int *y)
+{
+  mp_int   u, v, s1, s2, q, t1, t2, t3;
+  mp_int  *clean[8];
+  mp_sign  sa = SIGN(a), sb = SIGN(b);
+  long     uh, vh, A, B, C, D, qh, tmp;
+  mp_err   res;
+  int      last = -1;
+
+  if((res = mp_init_copy(&u, a)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &u;
+  if((res = mp_init_copy(&v, b)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &v;
+  if((res = mp_init(&s1)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &s1;
+  if((res = mp_init(&s2)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &s2;
+  if((res = mp_init(&q)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &q;
+  if((res = mp_init(&t1)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &t1;
+  if((res = mp_init(&t2)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &t2;
+  if((res = mp_init(&t3)) != MP_OKAY) goto CLEANUP;
+  clean[++last] = &t3;
+
+  /* Invariants:  u = s1 |a| (mod |b|), v = s2 |a| (mod |b|), u >= v   */
+  SIGN(&u) = MP_ZPOS;
+  SIGN(&v) = MP_ZPOS;
+  mp_set(&s1, 1);
+  if(s_mp_cmp(&u, &v) < 0) {
+    s_mp_exch(&u, &v);
+    s_mp_exch(&s1, &s2);
+  }
+
+  while(mp_cmp_z(&v) != 0) {
+    A = 1; B = 0; C = 0; D = 1;
+
+    if(USED(&u) <= USED(&v) + 1) {
+      s_mp_lehmer_top(&u, &v, &uh, &vh);
+
+      for(;;) {
+	if(vh + C <= 0 || vh + D <= 0 || uh + A < 0 || uh + B < 0)
+	  break;
+	qh = (uh + A) / (vh + C);
+	if(qh != (uh + B) / (vh + D))
+	  break;
+
+	tmp = A - qh * C;   A = C;   C = tmp;
+	tmp = B - qh * D;   B = D;   D = tmp;
+	tmp = uh - qh * vh; uh = vh; vh = tmp;
+      }
+    }
+
+    if(B == 0) {
+      /* (u, v) = (v, u mod v), (s1, s2) = (s2, s1 - q s2)             */
+      if((res = mp_div(&u, &v, &q, &t1)) != MP_OKAY) goto CLEANUP;
+      s_mp_exch(&u, &v);
+      s_mp_exch(&v, &t1);
+
+      if((res = mp_mul(&q, &s2, &t1)) != MP_OKAY) goto CLEANUP;
+      if((res = mp_sub(&s1, &t1, &s1)) != MP_OKAY) goto CLEANUP;
+      s_mp_exch(&s1, &s2);
+
+    } else {
+      if((res = s_mp_lincomb(&u, A, &v, B, &q, &t1, &t2)) != MP_OKAY ||
+	 (res = s_mp_lincomb(&u, C, &v, D, &t3, &t1, &t2)) != MP_OKAY)
+	goto CLEANUP;
+      s_mp_exch(&u, &q);
+      s_mp_exch(&v, &t3);
+
+      if((res = s_mp_lincomb(&s1, A, &s2, B, &q, &t1, &t2)) != MP_OKAY ||
+	 (res = s_mp_lincomb(&s1, C, &s2, D, &t3, &t1, &t2)) != MP_OKAY)
+	goto CLEANUP;
+      s_mp_exch(&s1, &q);
+      s_mp_exch(&s2, &t3);
+    }
+  }
+
+  /* Now u = (a, b) = s1 |a| + y |b|, so y = (u - s1 |a|) / |b|       */
+  if(y) {
+    if((res = mp_abs(a, &t1)) != MP_OKAY) goto CLEANUP;
+    if((res = mp_mul(&s1, &t1, &t1)) != MP_OKAY) goto CLEANUP;
+    if((res = mp_sub(&u, &t1, &t1)) != MP_OKAY) goto CLEANUP;
+    if((res = mp_abs(b, &t2)) != MP_OKAY) goto CLEANUP;
+    if((res = mp_div(&t1, &t2, &t1, NULL)) != MP_OKAY) goto CLEANUP;
+    if(sb == MP_NEG)
+      mp_neg(&t1, &t1);
+  }
+  if(sa == MP_NEG)
+    mp_neg(&s1, &s1);
+
+  /* a, b may be the same as g, x or y, so nothing is stored til now   */
+  if(g)
+    if((res = mp_copy(&u, g)) != MP_OKAY) goto CLEANUP;
+  if(x)
+    if((res = mp_copy(&s1, x)) != MP_OKAY) goto CLEANUP;
+  if(y)
+    if((res = mp_copy(&t1, y)) != MP_OKAY) goto CLEANUP;
+
+ CLEANUP:
+  while(last >= 0)
+    mp_clear(clean[last--]);
+
+  return res;
+
+} /* end s_mp_xgcd_lehmer() */
+
+/* }}} */
+
+/* {{{ s_mp_lehmer_top(u, v, uh, vh) */
+
+/*
+  Set uh to the leading MP_LEHMER_BITS bits of u (or all of u, if it
+  is shorter than that), and vh to the bits of v in the same places.
+  Assumes u >= v >= 0.
+ */
+
+void     s_mp_lehmer_top(mp_int *u, mp_int *v, long *uh, long *vh)
+{
+  int            nbits = mp_count_bits(u), shift, pos;
+  mp_size        ix;
+  unsigned long  hu = 0, hv = 0;
+
+  shift = (nbits > MP_LEHMER_BITS) ? nbits - MP_LEHMER_BITS : 0;
+
+  for(ix = shift / DIGIT_BIT; ix < USED(u); ix++) {
+    pos = (int)(ix * DIGIT_BIT) - shift;
+    if(pos < 0) {
+      hu |= (unsigned long)(DIGIT(u, ix) >> -pos);
+      if(ix < USED(v))
+	hv |= (unsigned long)(DIGIT(v, ix) >> -pos);
+    } else {
+      hu |= (unsigned long)DIGIT(u, ix) << pos;
+      if(ix < USED(v))
+	hv |= (unsigned long)DIGIT(v, ix) << pos;
+    }
+  }
+
+  *uh = (long)hu;
+  *vh = (long)hv;
+
+} /* end s_mp_lehmer_top() */
+
+/* }}} */
+
+/* {{{ s_mp_lincomb(a, ca, b, cb, c, t1, t2) */
+
+/* Compute c = ca a + cb b; t1 and t2 are scratch, and c must be neither */
+
+mp_err   s_mp_lincomb(mp_int *a, long ca, mp_int *b, long cb,
+		      mp_int *c, mp_int *t1, mp_int *t2)
+{
+  mp_err   res;
+
+  if((res = mp_set_int(t1, ca)) != MP_OKAY ||
+     (res = mp_mul(a, t1, c)) != MP_OKAY ||
+     (res = mp_set_int(t2, cb)) != MP_OKAY ||
+     (res = mp_mul(b, t2, t2)) != MP_OKAY)
+    return res;
+
+  return mp_add(c, t2, c);
+
+} /* end s_mp_lincomb() */
+
+/* }}} */
+
 /* }}} */
 
 /* {{{ Primitive comparisons */
@@ -3909,6 +4605,113 @@ int      s_mp_ispow2d(mp_digit d)
 
 /* {{{ Primitive I/O helpers */
 
+/* {{{ s_mp_read_bin(mp, str, len, big) */
+
+/*
+  Set mp to the unsigned value in the len bytes at str, which are most
+  significant first if big is nonzero, least significant first if not.
+ */
+mp_err   s_mp_read_bin(mp_int *mp, unsigned char *str, int len, int big)
+{
+  mp_err  res;
+#if !MP_BIN_WORDS
+  int     ix;
+#endif
+
+  mp_zero(mp);
+  if((res = s_mp_pad(mp, (len + sizeof(mp_digit) - 1) / sizeof(mp_digit)))
+     != MP_OKAY)
+    return res;
+
+#if MP_BIN_WORDS
+  if(big)
+    s_mp_revcopy((unsigned char *)DIGITS(mp), str, len);
+  else
+    memcpy(DIGITS(mp), str, len);
+#else
+  /* Byte ix of the value, counting from the least significant */
+  for(ix = 0; ix < len; ix++)
+    DIGIT(mp, ix / sizeof(mp_digit)) |=
+      (mp_digit)(big ? str[len - 1 - ix] : str[ix]) <<
+      (CHAR_BIT * (ix % sizeof(mp_digit)));
+#endif
+
+  s_mp_clamp(mp);
+
+  return MP_OKAY;
+
+} /* end s_mp_read_bin() */
+
+/* }}} */
+
+/* {{{ s_mp_write_bin(mp, str, len, big) */
+
+/*
+  Write the low len bytes of the magnitude of mp to str, in the order
+  given by big as for s_mp_read_bin(), padding with zeroes if mp is
+  shorter than that.
+ */
+void     s_mp_write_bin(mp_int *mp, unsigned char *str, int len, int big)
+{
+  int      nb = USED(mp) * sizeof(mp_digit);
+#if !MP_BIN_WORDS
+  int      ix;
+  mp_digit d;
+#endif
+
+  if(nb > len)
+    nb = len;
+
+#if MP_BIN_WORDS
+  if(big) {
+    memset(str, 0, len - nb);
+    s_mp_revcopy(str + len - nb, (unsigned char *)DIGITS(mp), nb);
+  } else {
+    memcpy(str, DIGITS(mp), nb);
+    memset(str + nb, 0, len - nb);
+  }
+#else
+  for(ix = 0; ix < len; ix++) {
+    d = 0;
+    if(ix < nb)
+      d = DIGIT(mp, ix / sizeof(mp_digit)) >> 
+	(CHAR_BIT * (ix % sizeof(mp_digit)));
+
+    str[big ? len - 1 - ix : ix] = d & UCHAR_MAX;
+  }
+#endif
+
+} /* end s_mp_write_bin() */
+
+/* }}} */
+
+/* {{{ s_mp_revcopy(dst, src, len) */
+
+/*
+  Copy len bytes from src to dst in reverse order; the two must not
+  overlap.  Where we can, this goes a 64-bit word at a time, which the
+  compiler turns into a load, a bswap and a store.
+ */
+void     s_mp_revcopy(unsigned char *dst, unsigned char *src, int len)
+{
+  int            ix = 0;
+#if MP_BIN_WORDS
+  unsigned long  w;
+
+  for(; ix + 8 <= len; ix += 8) {
+    memcpy(&w, src + len - ix - 8, 8);
+    w = __builtin_bswap64(w);
+    memcpy(dst + ix, &w, 8);
+  }
+#endif
+
+  for(; ix < len; ix++)
+    dst[ix] = src[len - 1 - ix];
+
+} /* end s_mp_revcopy() */
+
+/* }}} */
+
 /* {{{ s_mp_tovalue(ch, r) */
 
 /*
@@ -3989,7 +4792,7 @@ char     s_mp_todigit(int val, int r, int low)
  */
 int      s_mp_outlen(int bits, int r)
 {
-  return (int)((double)bits * LOG_V_2(r) + 0.5);
+  return (int)((double)bits * LOG_V_2(r) + 1); /* round up, never short */
 
 } /* end s_mp_outlen() */
 
@@ -189,6 +189,9 @@ mp_err mp_to_signed_bin(mp_int *mp, unsigned char *str);
 mp_err mp_read_unsigned_bin(mp_int *mp, unsigned char *str, int len);
 int    mp_unsigned_bin_size(mp_int *mp);
 mp_err mp_to_unsigned_bin(mp_int *mp, unsigned char *str);
+mp_err mp_read_unsigned_bin_le(mp_int *mp, unsigned char *str, int len);
+mp_err mp_to_fixlen_bin(mp_int *mp, unsigned char *str, int len);
+mp_err mp_to_fixlen_bin_le(mp_int *mp, unsigned char *str, int len);
 
 int    mp_count_bits(mp_int *mp);
 
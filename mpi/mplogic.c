@@ -11,14 +11,51 @@
 
 #include "mplogic.h"
 #include <stdlib.h>
+#include <string.h>
+
+/*
+  On x86-64 with GCC or Clang, population counts use the popcnt
+  instruction, and long vectors use AVX2, when the processor has them;
+  which to use is decided the first time it matters.  These work on
+  the bytes of the digit array, which is fine for bitwise operations
+  whatever the byte order of the machine.
+ */
+#if MP_ASM && defined(__GNUC__) && defined(__x86_64__)
+#define MPL_X86_64  1
+#include <immintrin.h>
+#else
+#define MPL_X86_64  0
+#endif
 
 /* Some things from the guts of the MPI library we make use of... */
 extern mp_err   s_mp_lshd(mp_int *mp, mp_size p);
 extern void     s_mp_rshd(mp_int *mp, mp_size p);
+extern mp_err   s_mp_pad(mp_int *mp, mp_size min);
 
 #define  s_mp_clamp(mp)\
    { while(USED(mp) > 1 && DIGIT((mp), USED(mp) - 1) == 0) USED(mp) -= 1; }
 
+/* Operations for s_mpl_bitop()     */
+#define  MPL_AND   0
+#define  MPL_OR    1
+#define  MPL_XOR   2
+
+static int  s_mpl_popcount_c(unsigned char *p, int len);
+static void s_mpl_bitop_c(mp_digit *dp, mp_digit *sp, mp_size n, int op);
+static int  s_mpl_popcount(mp_int *a);
+static void s_mpl_bitop(mp_digit *dp, mp_digit *sp, mp_size n, int op);
+static void s_mpl_trunc(mp_int *a, mp_size used);
+#if MPL_X86_64
+static void s_mpl_pick(void);
+static int  s_mpl_popcount_popcnt(unsigned char *p, int len);
+static int  s_mpl_popcount_avx2(unsigned char *p, int len);
+static void s_mpl_bitop_avx2(mp_digit *dp, mp_digit *sp, mp_size n, int op);
+
+/* Chosen by s_mpl_pick() on first use */
+static int  (*s_mpl_popfn)(unsigned char *, int) = NULL;
+static void (*s_mpl_opfn)(mp_digit *, mp_digit *, mp_size, int) = NULL;
+#endif
+
 /* {{{ Lookup table for population count */
 
 static unsigned char bitc[] = {
@@ -80,7 +117,6 @@ mp_err mpl_and(mp_int *a, mp_int *b, mp_int *c)
 {
   mp_int  *which, *other;
   mp_err   res;
-  int      ix;
 
   ARGCHK(a != NULL && b != NULL && c != NULL, MP_BADARG);
 
@@ -92,15 +128,15 @@ mp_err mpl_and(mp_int *a, mp_int *b, mp_int *c)
     other = a;
   }
 
-  if((res = mp_copy(which, c)) != MP_OKAY)
+  /* c may be either input; the operation commutes */
+  if(c == other) {
+    other = which;
+  } else if((res = mp_copy(which, c)) != MP_OKAY) {
     return res;
+  }
 
-  for(ix = 0; ix < USED(which); ix++)
-    DIGIT(c, ix) &= DIGIT(other, ix);
-
-  s_mp_clamp(c);
-
-  return MP_OKAY;
+  SIGN(c) = SIGN(which);
+  return mpl_and_in(c, other);
 
 } /* end mpl_and() */
 
@@ -112,7 +148,6 @@ mp_err mpl_or(mp_int *a, mp_int *b, mp_int *c)
 {
   mp_int  *which, *other;
   mp_err   res;
-  int      ix;
 
   ARGCHK(a != NULL && b != NULL && c != NULL, MP_BADARG);
 
@@ -124,13 +159,14 @@ mp_err mpl_or(mp_int *a, mp_int *b, mp_int *c)
     other = a;
   }
 
-  if((res = mp_copy(which, c)) != MP_OKAY)
+  if(c == other) {
+    other = which;
+  } else if((res = mp_copy(which, c)) != MP_OKAY) {
     return res;
+  }
 
-  for(ix = 0; ix < USED(which); ix++)
-    DIGIT(c, ix) |= DIGIT(other, ix);
-
-  return MP_OKAY;
+  SIGN(c) = SIGN(which);
+  return mpl_or_in(c, other);
 
 } /* end mpl_or() */
 
@@ -142,7 +178,6 @@ mp_err mpl_xor(mp_int *a, mp_int *b, mp_int *c)
 {
   mp_int  *which, *other;
   mp_err   res;
-  int      ix;
 
   ARGCHK(a != NULL && b != NULL && c != NULL, MP_BADARG);
 
@@ -154,17 +189,91 @@ mp_err mpl_xor(mp_int *a, mp_int *b, mp_int *c)
     other = a;
   }
 
-  if((res = mp_copy(which, c)) != MP_OKAY)
+  if(c == other) {
+    other = which;
+  } else if((res = mp_copy(which, c)) != MP_OKAY) {
     return res;
+  }
+
+  SIGN(c) = SIGN(which);
+  return mpl_xor_in(c, other);
+
+} /* end mpl_xor() */
+
+/* }}} */
 
-  for(ix = 0; ix < USED(which); ix++)
-    DIGIT(c, ix) ^= DIGIT(other, ix);
+/*------------------------------------------------------------------------*/
+/*
+  mpl_and_in(a, b) - compute a = a & b
+  mpl_or_in(a, b)  - compute a = a | b
+  mpl_xor_in(a, b) - compute a = a ^ b
+
+  These work on a in place, without copying anything.  The sign of a
+  is kept, unless the result is zero.
+ */
+
+/* {{{ mpl_and_in(a, b) */
+
+mp_err mpl_and_in(mp_int *a, mp_int *b)
+{
+  ARGCHK(a != NULL && b != NULL, MP_BADARG);
+
+  /* Anything past the end of b goes to zero */
+  if(USED(a) > USED(b))
+    s_mpl_trunc(a, USED(b));
+
+  s_mpl_bitop(DIGITS(a), DIGITS(b), USED(a), MPL_AND);
 
-  s_mp_clamp(c);
+  s_mp_clamp(a);
+  if(USED(a) == 1 && DIGIT(a, 0) == 0)
+    SIGN(a) = MP_ZPOS;
 
   return MP_OKAY;
 
-} /* end mpl_xor() */
+} /* end mpl_and_in() */
+
+/* }}} */
+
+/* {{{ mpl_or_in(a, b) */
+
+mp_err mpl_or_in(mp_int *a, mp_int *b)
+{
+  mp_err   res;
+
+  ARGCHK(a != NULL && b != NULL, MP_BADARG);
+
+  /* Digits of a past its end are zero, so it can just be extended */
+  if((res = s_mp_pad(a, USED(b))) != MP_OKAY)
+    return res;
+
+  s_mpl_bitop(DIGITS(a), DIGITS(b), USED(b), MPL_OR);
+
+  return MP_OKAY;
+
+} /* end mpl_or_in() */
+
+/* }}} */
+
+/* {{{ mpl_xor_in(a, b) */
+
+mp_err mpl_xor_in(mp_int *a, mp_int *b)
+{
+  mp_err   res;
+
+  ARGCHK(a != NULL && b != NULL, MP_BADARG);
+
+  if((res = s_mp_pad(a, USED(b))) != MP_OKAY)
+    return res;
+
+  s_mpl_bitop(DIGITS(a), DIGITS(b), USED(b), MPL_XOR);
+
+  s_mp_clamp(a);
+  if(USED(a) == 1 && DIGIT(a, 0) == 0)
+    SIGN(a) = MP_ZPOS;
+
+  return MP_OKAY;
+
+} /* end mpl_xor_in() */
 
 /* }}} */
 
@@ -280,24 +389,10 @@ mp_err mpl_lsh(mp_int *a, mp_int *b, mp_digit d)
 
 mp_err mpl_num_set(mp_int *a, int *num)
 {
-  int            ix, db, nset = 0;
-  mp_digit       cur;
-  unsigned char  reg;
-
   ARGCHK(a != NULL, MP_BADARG);
 
-  for(ix = 0; ix < USED(a); ix++) {
-    cur = DIGIT(a, ix);
-    
-    for(db = 0; db < sizeof(mp_digit); db++) {
-      reg = (cur >> (CHAR_BIT * db)) & UCHAR_MAX;
-
-      nset += bitc[reg];
-    }
-  }
-
   if(num)
-    *num = nset;
+    *num = s_mpl_popcount(a);
 
   return MP_OKAY;
 
@@ -309,28 +404,14 @@ mp_err mpl_num_set(mp_int *a, int *num)
 
 mp_err mpl_num_clear(mp_int *a, int *num)
 {
-  int            ix, db, nset = 0;
-  mp_digit       cur;
-  unsigned char  reg;
-
   ARGCHK(a != NULL, MP_BADARG);
 
-  for(ix = 0; ix < USED(a); ix++) {
-    cur = DIGIT(a, ix);
-    
-    for(db = 0; db < sizeof(mp_digit); db++) {
-      reg = (cur >> (CHAR_BIT * db)) & UCHAR_MAX;
-
-      nset += bitc[UCHAR_MAX - reg];
-    }
-  }
-
+  /* The clear bits of all the digits in use, as always */
   if(num)
-    *num = nset;
+    *num = USED(a) * DIGIT_BIT - s_mpl_popcount(a);
 
   return MP_OKAY;
 
-
 } /* end mpl_num_clear() */
 
 /* }}} */
@@ -348,35 +429,243 @@ mp_err mpl_num_clear(mp_int *a, int *num)
 
 mp_err mpl_parity(mp_int *a)
 {
-  int      ix, par = 0;
-  mp_digit cur;
-
   ARGCHK(a != NULL, MP_BADARG);
 
-  for(ix = 0; ix < USED(a); ix++) {
-    int   shft = (sizeof(mp_digit) * CHAR_BIT) / 2;
+  if(s_mpl_popcount(a) & 1)
+    return MP_ODD;
+  else
+    return MP_EVEN;
 
-    cur = DIGIT(a, ix);
+} /* end mpl_parity() */
 
-    /* Compute parity for current digit */
-    while(shft != 0) {
-      cur ^= (cur >> shft);
-      shft >>= 1;
-    }
-    cur &= 1;
+/* }}} */
+
+/*------------------------------------------------------------------------*/
+/* Helpers, and the kernels they choose between                           */
+
+/* {{{ s_mpl_popcount(a) */
+
+/* Count the bits set in the digits of a that are in use                  */
+static int s_mpl_popcount(mp_int *a)
+{
+  unsigned char *p = (unsigned char *)DIGITS(a);
+  int            len = USED(a) * sizeof(mp_digit);
+
+#if MPL_X86_64
+  if(s_mpl_popfn == NULL)
+    s_mpl_pick();
+
+  return (*s_mpl_popfn)(p, len);
+#else
+  return s_mpl_popcount_c(p, len);
+#endif
+
+} /* end s_mpl_popcount() */
+
+/* }}} */
+
+/* {{{ s_mpl_bitop(dp, sp, n, op) */
+
+/* dp[ix] = dp[ix] (op) sp[ix], for the first n digits                    */
+static void s_mpl_bitop(mp_digit *dp, mp_digit *sp, mp_size n, int op)
+{
+#if MPL_X86_64
+  if(s_mpl_opfn == NULL)
+    s_mpl_pick();
+
+  (*s_mpl_opfn)(dp, sp, n, op);
+#else
+  s_mpl_bitop_c(dp, sp, n, op);
+#endif
+
+} /* end s_mpl_bitop() */
+
+/* }}} */
+
+/* {{{ s_mpl_trunc(a, used) */
+
+/* Cut a down to its low 'used' digits, keeping the unused ones zero      */
+static void s_mpl_trunc(mp_int *a, mp_size used)
+{
+  memset(DIGITS(a) + used, 0, (USED(a) - used) * sizeof(mp_digit));
+  USED(a) = used;
+
+} /* end s_mpl_trunc() */
 
-    /* XOR with running parity so far   */
-    par ^= cur;
+/* }}} */
+
+/* {{{ s_mpl_popcount_c(p, len) */
+
+static int s_mpl_popcount_c(unsigned char *p, int len)
+{
+  int   ix, nset = 0;
+
+  for(ix = 0; ix < len; ix++)
+    nset += bitc[p[ix]];
+
+  return nset;
+
+} /* end s_mpl_popcount_c() */
+
+/* }}} */
+
+/* {{{ s_mpl_bitop_c(dp, sp, n, op) */
+
+static void s_mpl_bitop_c(mp_digit *dp, mp_digit *sp, mp_size n, int op)
+{
+  mp_size  ix;
+
+  switch(op) {
+  case MPL_AND:
+    for(ix = 0; ix < n; ix++)
+      dp[ix] &= sp[ix];
+    break;
+  case MPL_OR:
+    for(ix = 0; ix < n; ix++)
+      dp[ix] |= sp[ix];
+    break;
+  default:
+    for(ix = 0; ix < n; ix++)
+      dp[ix] ^= sp[ix];
+    break;
   }
 
-  if(par)
-    return MP_ODD;
-  else
-    return MP_EVEN;
+} /* end s_mpl_bitop_c() */
 
-} /* end mpl_parity() */
+/* }}} */
+
+#if MPL_X86_64
+
+/* {{{ s_mpl_pick() */
+
+/*
+  Pick the kernels for this processor.  Threads that get here at the
+  same time all pick the same ones, so there is no harm in the race.
+ */
+static void s_mpl_pick(void)
+{
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    s_mpl_popfn = s_mpl_popcount_avx2;
+    s_mpl_opfn = s_mpl_bitop_avx2;
+  } else if(__builtin_cpu_supports("popcnt")) {
+    s_mpl_popfn = s_mpl_popcount_popcnt;
+    s_mpl_opfn = s_mpl_bitop_c;
+  } else {
+    s_mpl_popfn = s_mpl_popcount_c;
+    s_mpl_opfn = s_mpl_bitop_c;
+  }
+
+} /* end s_mpl_pick() */
+
+/* }}} */
+
+/* {{{ s_mpl_popcount_popcnt(p, len) */
+
+/* Eight bytes at a time with popcnt                                      */
+__attribute__((target("popcnt")))
+static int s_mpl_popcount_popcnt(unsigned char *p, int len)
+{
+  int            ix = 0, nset = 0;
+  unsigned long  w;
+
+  for(; ix + 8 <= len; ix += 8) {
+    memcpy(&w, p + ix, 8);
+    nset += __builtin_popcountl(w);
+  }
+
+  for(; ix < len; ix++)
+    nset += bitc[p[ix]];
+
+  return nset;
+
+} /* end s_mpl_popcount_popcnt() */
 
 /* }}} */
 
+/* {{{ s_mpl_popcount_avx2(p, len) */
+
+/*
+  32 bytes at a time with AVX2:  each nibble is looked up in a table of
+  bit counts with vpshufb, and the byte counts are summed into four
+  64-bit lanes with vpsadbw.  Short values are left to popcnt.
+ */
+__attribute__((target("avx2,popcnt")))
+static int s_mpl_popcount_avx2(unsigned char *p, int len)
+{
+  int            ix = 0;
+  unsigned long  lane[4];
+  __m256i        tab, low, acc, v, lo, hi;
+
+  if(len < 128)
+    return s_mpl_popcount_popcnt(p, len);
+
+  tab = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+			 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  low = _mm256_set1_epi8(0x0f);
+  acc = _mm256_setzero_si256();
+
+  for(; ix + 32 <= len; ix += 32) {
+    v = _mm256_loadu_si256((__m256i *)(p + ix));
+    lo = _mm256_and_si256(v, low);
+    hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    v = _mm256_add_epi8(_mm256_shuffle_epi8(tab, lo),
+			_mm256_shuffle_epi8(tab, hi));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+  }
+
+  _mm256_storeu_si256((__m256i *)lane, acc);
+
+  return (int)(lane[0] + lane[1] + lane[2] + lane[3]) +
+    s_mpl_popcount_popcnt(p + ix, len - ix);
+
+} /* end s_mpl_popcount_avx2() */
+
+/* }}} */
+
+/* {{{ s_mpl_bitop_avx2(dp, sp, n, op) */
+
+/* 32 bytes at a time with AVX2, the rest digit by digit                  */
+__attribute__((target("avx2")))
+static void s_mpl_bitop_avx2(mp_digit *dp, mp_digit *sp, mp_size n, int op)
+{
+  unsigned char *d = (unsigned char *)dp, *s = (unsigned char *)sp;
+  mp_size        ix = 0, len = n * sizeof(mp_digit);
+  __m256i        x, y;
+
+  switch(op) {
+  case MPL_AND:
+    for(; ix + 32 <= len; ix += 32) {
+      x = _mm256_loadu_si256((__m256i *)(d + ix));
+      y = _mm256_loadu_si256((__m256i *)(s + ix));
+      _mm256_storeu_si256((__m256i *)(d + ix), _mm256_and_si256(x, y));
+    }
+    break;
+  case MPL_OR:
+    for(; ix + 32 <= len; ix += 32) {
+      x = _mm256_loadu_si256((__m256i *)(d + ix));
+      y = _mm256_loadu_si256((__m256i *)(s + ix));
+      _mm256_storeu_si256((__m256i *)(d + ix), _mm256_or_si256(x, y));
+    }
+    break;
+  default:
+    for(; ix + 32 <= len; ix += 32) {
+      x = _mm256_loadu_si256((__m256i *)(d + ix));
+      y = _mm256_loadu_si256((__m256i *)(s + ix));
+      _mm256_storeu_si256((__m256i *)(d + ix), _mm256_xor_si256(x, y));
+    }
+    break;
+  }
+
+  ix /= sizeof(mp_digit);
+  s_mpl_bitop_c(dp + ix, sp + ix, n - ix, op);
+
+} /* end s_mpl_bitop_avx2() */
+
+/* }}} */
+
+#endif /* MPL_X86_64 */
+
 /*------------------------------------------------------------------------*/
 /* HERE THERE BE DRAGONS                                                  */
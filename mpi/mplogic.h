@@ -33,6 +33,10 @@ mp_err mpl_and(mp_int *a, mp_int *b, mp_int *c); /* bitwise AND       */
 mp_err mpl_or(mp_int *a, mp_int *b, mp_int *c);  /* bitwise OR        */
 mp_err mpl_xor(mp_int *a, mp_int *b, mp_int *c); /* bitwise XOR       */
 
+mp_err mpl_and_in(mp_int *a, mp_int *b);         /* a &= b            */
+mp_err mpl_or_in(mp_int *a, mp_int *b);          /* a |= b            */
+mp_err mpl_xor_in(mp_int *a, mp_int *b);         /* a ^= b            */
+
 /* Shift functions                   */
 
 mp_err mpl_rsh(mp_int *a, mp_int *b, mp_digit d);   /* right shift    */
@@ -12,11 +12,35 @@
 
 #include "mpprime.h"
 #include <stdlib.h>
+#include <string.h>
+
+#if MP_THREADS
+#include <pthread.h>
+#endif
 
 #define RANDOM() rand()
 
+/*
+  Number of bytes in each window of the sieve used by mpp_make_prime().
+  Each byte covers 30 integers, and 30 times this must fit in an
+  mp_digit; 1K also stays comfortably inside the L1 cache.
+ */
+#define MPP_SIEVE_SIZE  1024
+
+/* Most threads mpp_make_prime() will start */
+#define MPP_MAX_THREADS 64
+
 #include "primes.c"  /* pull in the prime digit table */
 
+/*
+  The residues mod 30 that are prime to 30.  Bit r of byte k of a
+  sieve made by mpp_sieve() stands for base + 30k + mpp_wheel[r].
+ */
+const mp_digit mpp_wheel[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+
+#define MPP_OFFSET(IX)      (30 * ((IX) >> 3) + mpp_wheel[(IX) & 7])
+#define MPP_CROSSED(S, IX)  (((S)[(IX) >> 3] >> ((IX) & 7)) & 1)
+
 /* 
    Test if any of a given vector of digits divides a.  If not, MP_NO
    is returned; otherwise, MP_YES is returned and 'which' is set to
@@ -26,6 +50,40 @@ mp_err    s_mpp_divp(mp_int *a, mp_digit *vec, int size, int *which);
 
 extern mp_err s_mp_pad(mp_int *mp, mp_size min); /* left pad with zeroes  */
 
+/*
+  Rabin-Miller with a private random state for choosing witnesses.  If
+  'seed' is NULL, the C library's rand() is used, as by mpp_random().
+ */
+mp_err    s_mpp_pprime(mp_int *a, int nt, unsigned long *seed);
+void      s_mpp_random_r(mp_int *a, unsigned long *seed);
+
+/*
+  State shared by the threads searching one window of candidates in
+  mpp_make_prime().  Candidate ix is base + MPP_OFFSET(ix), and there
+  are nSieve of them (8 per byte of sieve); the lock protects 'next',
+  'found' and 'res'.
+ */
+typedef struct {
+  mp_int         *base;
+  unsigned char  *sieve;
+  mp_size         nSieve;
+  int             nt;
+  unsigned long   seed;     /* 0 to use rand() for witnesses     */
+  unsigned long   first;    /* number of candidates before base  */
+  mp_size         next;     /* next sieve index to hand out      */
+  mp_size         found;    /* least index found prime, or nSieve */
+  mp_err          res;      /* first error seen by any thread    */
+#if MP_THREADS
+  pthread_mutex_t lock;
+#endif
+} mpp_search;
+
+mp_err    s_mpp_search(mpp_search *sp, int nThreads);
+void     *s_mpp_search_worker(void *arg);
+mp_err    s_mpp_test_candidate(mpp_search *sp, mp_size ix, mp_int *cand);
+int       s_mpp_cancelled(mpp_search *sp, mp_size ix);
+mp_digit  s_mpp_inv30(mp_digit p);
+
 /* {{{ mpp_divis(a, b) */
 
 /*
@@ -244,13 +302,252 @@ mp_err  mpp_fermat(mp_int *a, mp_digit w)
  */
 
 mp_err  mpp_pprime(mp_int *a, int nt)
+{
+  ARGCHK(a != NULL, MP_BADARG);
+
+  return s_mpp_pprime(a, nt, NULL);
+
+} /* end mpp_pprime() */
+
+/* }}} */
+
+/* {{{ mpp_sieve(base, primes, nPrimes, sieve, nBytes) */
+
+/*
+  mpp_sieve(base, primes, nPrimes, sieve, nBytes)
+
+  Sieve the integers base, base + 1, ..., base + 30 nBytes - 1 by the
+  given primes, using a wheel of 30:  only the values prime to 30 are
+  represented, one bit each, eight to a byte (see mpp_wheel[]).  On
+  return, a bit is set if its value is divisible by one of the primes
+  (other than the value being that prime itself), and clear otherwise.
+  base must be a non-negative multiple of 30; 2, 3 and 5 in primes are
+  ignored, since the wheel already excludes their multiples.
+
+  Only one reduction of base is done per prime, rather than one per
+  prime per candidate; after that, each of the eight residue classes
+  is crossed off with a stride of p bytes.  Successive windows can be
+  had by adding 30 nBytes to base and calling this again.
+ */
+
+mp_err  mpp_sieve(mp_int *base, const mp_digit *primes, mp_size nPrimes,
+		  unsigned char *sieve, mp_size nBytes)
+{
+  mp_err         res;
+  mp_digit       rem, prime, inv;
+  mp_size        ix, jx;
+  unsigned long  kx;
+  int            small = 0;
+  mp_digit       low = 0;
+
+  ARGCHK(base != NULL && primes != NULL && sieve != NULL, MP_BADARG);
+  ARGCHK(SIGN(base) == MP_ZPOS, MP_BADARG);
+
+  if((res = mp_mod_d(base, 30, &rem)) != MP_OKAY)
+    return res;
+  if(rem != 0)
+    return MP_BADARG;
+
+  memset(sieve, 0, nBytes);
+
+  /* If base is small enough, the primes themselves may be in range */
+  if(USED(base) == 1) {
+    small = 1;
+    low = DIGIT(base, 0);
+  }
+
+  for(ix = 0; ix < nPrimes; ix++) {
+    prime = primes[ix];
+    if(prime <= 5)
+      continue;
+
+    if((res = mp_mod_d(base, prime, &rem)) != MP_OKAY)
+      return res;
+    inv = s_mpp_inv30(prime);
+
+    /* 
+       For each residue w, the first byte k with base + 30k + w = 0
+       (mod prime) is k = -(rem + w) / 30 (mod prime).
+     */
+    for(jx = 0; jx < 8; jx++) {
+      kx = (prime - (rem + mpp_wheel[jx]) % prime) % prime;
+      kx = (kx * inv) % prime;
+
+      if(small && low + 30 * kx + mpp_wheel[jx] == prime)
+	kx += prime;
+
+      for(; kx < nBytes; kx += prime)
+	sieve[kx] |= (1 << jx);
+    }
+  }
+
+  return MP_OKAY;
+
+} /* end mpp_sieve() */
+
+/* }}} */
+
+/* {{{ mpp_make_prime(start, nt, nThreads, seed, nTries) */
+
+/*
+  mpp_make_prime(start, nt, nThreads, seed, nTries)
+
+  Replace start with the least probable prime greater than or equal to
+  it.  Candidates are sieved by the small prime table a window at a
+  time (see mpp_sieve()), and the survivors get a Fermat test to the
+  base 2 and then nt rounds of Rabin-Miller.
+
+  If the library was built with MP_THREADS, up to nThreads candidates
+  from each window are tested at once; as soon as a prime is found,
+  the tests on any larger candidates are abandoned.  The answer does
+  not depend on the number of threads.
+
+  If seed is nonzero, the Rabin-Miller witnesses for each candidate are
+  derived from it, rather than from rand(), so that repeated runs do
+  exactly the same work.  If nTries is not NULL, it is set to the
+  number of odd values from start up to and including the prime.
+ */
+
+mp_err  mpp_make_prime(mp_int *start, int nt, int nThreads,
+		       unsigned long seed, unsigned long *nTries)
+{
+  mpp_search     search;
+  mp_int         base;
+  unsigned char *sieve;
+  unsigned long  skipped = 0;
+  mp_digit       skip;
+  mp_size        ix;
+  mp_err         res;
+
+  ARGCHK(start != NULL && nt > 0 && nThreads > 0, MP_BADARG);
+
+  if(SIGN(start) == MP_NEG || mp_cmp_d(start, 2) < 0)
+    mp_set(start, 2);
+  if(mp_cmp_d(start, 2) == 0) {
+    if(nTries)
+      *nTries = 1;
+    return MP_OKAY;
+  }
+  if(mp_iseven(start) && (res = mp_add_d(start, 1, start)) != MP_OKAY)
+    return res;
+
+  /* The wheel leaves out 3 and 5, so they have to be caught here */
+  if(mp_cmp_d(start, 5) <= 0) {
+    if(nTries)
+      *nTries = 1;
+    return MP_OKAY;
+  }
+
+  /* Start the windows at the multiple of 30 at or below start */
+  if((res = mp_init_copy(&base, start)) != MP_OKAY)
+    return res;
+  if((res = mp_mod_d(start, 30, &skip)) != MP_OKAY ||
+     (res = mp_sub_d(&base, skip, &base)) != MP_OKAY)
+    goto CLEANUP;
+
+  if((sieve = malloc(MPP_SIEVE_SIZE)) == NULL) {
+    res = MP_MEM;
+    goto CLEANUP;
+  }
+
+  search.base = &base;
+  search.sieve = sieve;
+  search.nSieve = 8 * MPP_SIEVE_SIZE;
+  search.nt = nt;
+  search.seed = seed;
+  search.first = 0;
+
+  for(;;) {
+    if((res = mpp_sieve(&base, prime_tab, prime_tab_size, 
+			sieve, MPP_SIEVE_SIZE)) != MP_OKAY)
+      break;
+
+    /* In the first window, cross off anything that is below start;
+       skip is kept afterwards, since nTries counts from start */
+    if(search.first == 0 && skip) {
+      for(ix = 0; ix < 8 && mpp_wheel[ix] < skip; ix++)
+	sieve[0] |= (1 << ix);
+    }
+
+    if((res = s_mpp_search(&search, nThreads)) != MP_OKAY)
+      break;
+
+    if(search.found < search.nSieve) {
+      res = mp_add_d(&base, MPP_OFFSET(search.found), start);
+      if(nTries)
+	*nTries = (skipped + MPP_OFFSET(search.found) - skip) / 2 + 1;
+      break;
+    }
+
+    /* Nothing in this window, move on to the next one */
+    search.first += search.nSieve;
+    skipped += 30 * MPP_SIEVE_SIZE;
+    if((res = mp_add_d(&base, 30 * MPP_SIEVE_SIZE, &base)) != MP_OKAY)
+      break;
+  }
+
+  free(sieve);
+
+CLEANUP:
+  mp_clear(&base);
+  return res;
+
+} /* end mpp_make_prime() */
+
+/* }}} */
+
+/*========================================================================*/
+/*------------------------------------------------------------------------*/
+/* Static functions visible only to the library internally                */
+
+/* {{{ s_mpp_divp(a, vec, size, which) */
+
+/* 
+   Test for divisibility by members of a vector of digits.  Returns
+   MP_NO if a is not divisible by any of them; returns MP_YES and sets
+   'which' to the index of the offender, if it is.  Will stop on the
+   first digit against which a is divisible.
+ */
+
+mp_err    s_mpp_divp(mp_int *a, mp_digit *vec, int size, int *which)
+{
+  mp_err    res;
+  mp_digit  rem;
+
+  int     ix;
+
+  for(ix = 0; ix < size; ix++) {
+    if((res = mp_mod_d(a, vec[ix], &rem)) != MP_OKAY) 
+      return res;
+
+    if(rem == 0) {
+      if(which)
+	*which = ix;
+      return MP_YES;
+    }
+  }
+
+  return MP_NO;
+
+} /* end s_mpp_divp() */
+
+/* }}} */
+
+/* {{{ s_mpp_pprime(a, nt, seed) */
+
+/*
+  Rabin-Miller, as for mpp_pprime(), but if seed is not NULL the
+  witnesses are drawn with s_mpp_random_r() from the state it points
+  to, so the test is reproducible and does not touch the shared state
+  of rand().
+ */
+
+mp_err    s_mpp_pprime(mp_int *a, int nt, unsigned long *seed)
 {
   mp_err   res;
   mp_int   x, amo, m, z;
   int      iter, jx, b;
 
-  ARGCHK(a != NULL, MP_BADARG);
-
   /* Initialize temporaries... */
   if((res = mp_init_copy(&amo, a)) != MP_OKAY)
     return res;
@@ -276,19 +573,27 @@ mp_err  mpp_pprime(mp_int *a, int nt)
 
     /* Choose a random value for x < a          */
     s_mp_pad(&x, USED(a));
-    mpp_random(&x);
+    if(seed)
+      s_mpp_random_r(&x, seed);
+    else
+      mpp_random(&x);
     if((res = mp_mod(&x, a, &x)) != MP_OKAY)
       goto CLEANUP;
 
+    /* 0 and 1 are useless as witnesses, and likely when a is tiny */
+    if(mp_cmp_d(&x, 1) <= 0)
+      mp_set(&x, 2);
+
     /* Compute z = (x ** m) mod a               */
     if((res = mp_exptmod(&x, &m, a, &z)) != MP_OKAY)
       goto CLEANUP;
     
     jx = 0;
     
+    /* This witness tells us nothing more; go on to the next one */
     if(mp_cmp_d(&z, 1) == 0 || mp_cmp(&z, &amo) == 0) {
       res = MP_YES;
-      goto CLEANUP;
+      continue;
     }
     
     for(;;) {
@@ -334,44 +639,247 @@ X:
   mp_clear(&amo);
   return res;
 
-} /* end mpp_pprime() */
+} /* end s_mpp_pprime() */
 
 /* }}} */
 
-/*========================================================================*/
-/*------------------------------------------------------------------------*/
-/* Static functions visible only to the library internally                */
-
-/* {{{ s_mpp_divp(a, vec, size, which) */
+/* {{{ s_mpp_random_r(a, seed) */
 
 /* 
-   Test for divisibility by members of a vector of digits.  Returns
-   MP_NO if a is not divisible by any of them; returns MP_YES and sets
-   'which' to the index of the offender, if it is.  Will stop on the
-   first digit against which a is divisible.
+   Fill the current digits of a with values from a simple linear
+   congruential generator whose state is kept in *seed.  Like
+   mpp_random(), this is only good enough for choosing witnesses.
  */
 
-mp_err    s_mpp_divp(mp_int *a, mp_digit *vec, int size, int *which)
+void      s_mpp_random_r(mp_int *a, unsigned long *seed)
 {
-  mp_err    res;
-  mp_digit  rem;
+  mp_digit  next = 0;
+  mp_size   ix;
+  size_t    jx;
 
-  int     ix;
+  for(ix = 0; ix < USED(a); ix++) {
+    for(jx = 0; jx < sizeof(mp_digit); jx++) {
+      *seed = (*seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+      next = (next << CHAR_BIT) | ((*seed >> 16) & UCHAR_MAX);
+    }
+    DIGIT(a, ix) = next;
+  }
 
-  for(ix = 0; ix < size; ix++) {
-    if((res = mp_mod_d(a, vec[ix], &rem)) != MP_OKAY) 
-      return res;
+} /* end s_mpp_random_r() */
 
-    if(rem == 0) {
-      if(which)
-	*which = ix;
-      return MP_YES;
+/* }}} */
+
+/* {{{ s_mpp_search(sp, nThreads) */
+
+/*
+  Test the unsieved candidates of one window, on nThreads threads if
+  the library was built with MP_THREADS.  On return, sp->found is the
+  index of the least probable prime in the window, or sp->nSieve if
+  there is none.
+ */
+
+mp_err    s_mpp_search(mpp_search *sp, int nThreads)
+{
+#if MP_THREADS
+  pthread_t  threads[MPP_MAX_THREADS];
+  int        ix, started = 0;
+#endif
+
+  sp->next = 0;
+  sp->found = sp->nSieve;
+  sp->res = MP_OKAY;
+
+#if MP_THREADS
+  if(nThreads > MPP_MAX_THREADS)
+    nThreads = MPP_MAX_THREADS;
+
+  if(nThreads > 1) {
+    if(pthread_mutex_init(&sp->lock, NULL) != 0)
+      return MP_MEM;
+
+    for(ix = 0; ix < nThreads; ix++) {
+      if(pthread_create(&threads[ix], NULL, s_mpp_search_worker, sp) != 0)
+	break;
+      ++started;
     }
+
+    /* If we could not start any threads, do the work here instead */
+    if(started == 0)
+      s_mpp_search_worker(sp);
+
+    for(ix = 0; ix < started; ix++)
+      pthread_join(threads[ix], NULL);
+
+    pthread_mutex_destroy(&sp->lock);
+    return sp->res;
   }
 
-  return MP_NO;
+  if(pthread_mutex_init(&sp->lock, NULL) != 0)
+    return MP_MEM;
+  s_mpp_search_worker(sp);
+  pthread_mutex_destroy(&sp->lock);
+#else
+  (void)nThreads;
+  s_mpp_search_worker(sp);
+#endif
 
-} /* end s_mpp_divp() */
+  return sp->res;
+
+} /* end s_mpp_search() */
+
+/* }}} */
+
+/* {{{ s_mpp_search_worker(arg) */
+
+/*
+  Body of each searching thread:  repeatedly take the next unsieved
+  candidate below the best prime found so far, and test it.
+ */
+
+void     *s_mpp_search_worker(void *arg)
+{
+  mpp_search  *sp = (mpp_search *)arg;
+  mp_int       cand;
+  mp_size      ix;
+  mp_err       res;
+
+  if((res = mp_init_size(&cand, USED(sp->base) + 1)) != MP_OKAY) {
+#if MP_THREADS
+    pthread_mutex_lock(&sp->lock);
+#endif
+    if(sp->res == MP_OKAY)
+      sp->res = res;
+#if MP_THREADS
+    pthread_mutex_unlock(&sp->lock);
+#endif
+    return NULL;
+  }
+
+  for(;;) {
+#if MP_THREADS
+    pthread_mutex_lock(&sp->lock);
+#endif
+    while(sp->next < sp->found && MPP_CROSSED(sp->sieve, sp->next))
+      ++sp->next;
+    if(sp->next >= sp->found || sp->res != MP_OKAY) {
+#if MP_THREADS
+      pthread_mutex_unlock(&sp->lock);
+#endif
+      break;
+    }
+    ix = sp->next++;
+#if MP_THREADS
+    pthread_mutex_unlock(&sp->lock);
+#endif
+
+    res = s_mpp_test_candidate(sp, ix, &cand);
+
+#if MP_THREADS
+    pthread_mutex_lock(&sp->lock);
+#endif
+    if(res == MP_YES) {
+      if(ix < sp->found)
+	sp->found = ix;
+    } else if(res != MP_NO && sp->res == MP_OKAY) {
+      sp->res = res;
+    }
+#if MP_THREADS
+    pthread_mutex_unlock(&sp->lock);
+#endif
+  }
+
+  mp_clear(&cand);
+  return NULL;
+
+} /* end s_mpp_search_worker() */
+
+/* }}} */
+
+/* {{{ s_mpp_test_candidate(sp, ix, cand) */
+
+/*
+  Run the Fermat and Rabin-Miller tests on candidate ix, one round at
+  a time, giving up early (with MP_NO) if another thread finds a
+  smaller prime in the meantime.
+ */
+
+mp_err    s_mpp_test_candidate(mpp_search *sp, mp_size ix, mp_int *cand)
+{
+  unsigned long  state, *seed = NULL;
+  mp_err         res;
+  int            round;
+
+  if((res = mp_copy(sp->base, cand)) != MP_OKAY ||
+     (res = mp_add_d(cand, MPP_OFFSET(ix), cand)) != MP_OKAY)
+    return res;
+
+  if(sp->seed) {
+    state = (sp->seed ^ (sp->first + ix)) & 0xFFFFFFFFUL;
+    seed = &state;
+  }
+
+  if((res = mpp_fermat(cand, 2)) != MP_YES)
+    return res;
+
+  for(round = 0; round < sp->nt; round++) {
+    if(s_mpp_cancelled(sp, ix))
+      return MP_NO;
+
+    if((res = s_mpp_pprime(cand, 1, seed)) != MP_YES)
+      return res;
+  }
+
+  return MP_YES;
+
+} /* end s_mpp_test_candidate() */
+
+/* }}} */
+
+/* {{{ s_mpp_cancelled(sp, ix) */
+
+/* Has some thread already found a prime smaller than candidate ix?  */
+
+int       s_mpp_cancelled(mpp_search *sp, mp_size ix)
+{
+  int  done;
+
+#if MP_THREADS
+  pthread_mutex_lock(&sp->lock);
+#endif
+  done = (sp->found < ix) || (sp->res != MP_OKAY);
+#if MP_THREADS
+  pthread_mutex_unlock(&sp->lock);
+#endif
+
+  return done;
+
+} /* end s_mpp_cancelled() */
+
+/* }}} */
+
+/* {{{ s_mpp_inv30(p) */
+
+/*
+  Return the inverse of 30 modulo the prime p > 5, by the extended
+  Euclidean algorithm on machine words.
+ */
+
+mp_digit  s_mpp_inv30(mp_digit p)
+{
+  long  r0 = p, r1 = 30, t0 = 0, t1 = 1, q, tmp;
+
+  while(r1 != 0) {
+    q = r0 / r1;
+    tmp = r0 - q * r1; r0 = r1; r1 = tmp;
+    tmp = t0 - q * t1; t0 = t1; t1 = tmp;
+  }
+
+  if(t0 < 0)
+    t0 += p;
+
+  return (mp_digit)t0;
+
+} /* end s_mpp_inv30() */
 
 /* }}} */
 
@@ -16,6 +16,7 @@
 #include "mpi.h"
 
 extern int prime_tab_size;   /* number of primes available */
+extern const mp_digit mpp_wheel[8]; /* residues mod 30 used by mpp_sieve() */
 
 /* Tests for divisibility    */
 mp_err  mpp_divis(mp_int *a, mp_int *b);
@@ -31,4 +32,10 @@ mp_err  mpp_divis_primes(mp_int *a, mp_digit *np);
 mp_err  mpp_fermat(mp_int *a, mp_digit w);
 mp_err  mpp_pprime(mp_int *a, int nt);
 
+/* Sieving and prime generation */
+mp_err  mpp_sieve(mp_int *base, const mp_digit *primes, mp_size nPrimes,
+		  unsigned char *sieve, mp_size nBytes);
+mp_err  mpp_make_prime(mp_int *start, int nt, int nThreads,
+		       unsigned long seed, unsigned long *nTries);
+
 #endif /* end _H_MP_PRIME_ */
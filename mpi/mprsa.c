@@ -12,9 +12,17 @@
  */
 
 #include "mprsa.h"
+#include "mpprime.h"
 #include <stdlib.h>
 #include <string.h>
 
+mp_err   s_rsa_gen_prime(mp_int *p, int bits, mp_int *e, 
+			 int nt, rnd_f rand);
+mp_err   s_rsa_crt_expt(mp_int *in, mp_rsa_key *key, mp_int *out);
+void     s_rsa_key_parts(mp_rsa_key *key, mp_int *parts[]);
+
+#define  RSA_KEY_PARTS  8   /* number of mp_int values in a mp_rsa_key */
+
 /* {{{ mp_i2osp(x, out, len) */
 
 mp_err   mp_i2osp(mp_int *x, char *out, int len)
@@ -27,7 +35,7 @@ mp_err   mp_i2osp(mp_int *x, char *out, int len)
     return MP_RANGE;
   }
 
-  xlen -= len;
+  xlen = len - xlen;
   if(xlen > 0)
     memset(out, 0, xlen);
 
@@ -123,6 +131,164 @@ mp_err   mp_rsavp(mp_int *sig, mp_int *e, mp_int *modulus, mp_int *msg)
 
 /* }}} */
 
+/* {{{ mp_rsa_key_init(key) */
+
+mp_err   mp_rsa_key_init(mp_rsa_key *key)
+{
+  mp_int  *parts[RSA_KEY_PARTS];
+  mp_err   res;
+  int      ix;
+
+  ARGCHK(key != NULL, MP_BADARG);
+
+  s_rsa_key_parts(key, parts);
+  for(ix = 0; ix < RSA_KEY_PARTS; ix++) {
+    if((res = mp_init(parts[ix])) != MP_OKAY) {
+      while(--ix >= 0)
+	mp_clear(parts[ix]);
+      return res;
+    }
+  }
+
+  return MP_OKAY;
+
+} /* end mp_rsa_key_init() */
+
+/* }}} */
+
+/* {{{ mp_rsa_key_clear(key) */
+
+void     mp_rsa_key_clear(mp_rsa_key *key)
+{
+  mp_int  *parts[RSA_KEY_PARTS];
+  int      ix;
+
+  if(key == NULL)
+    return;
+
+  s_rsa_key_parts(key, parts);
+  for(ix = 0; ix < RSA_KEY_PARTS; ix++)
+    mp_clear(parts[ix]);
+
+} /* end mp_rsa_key_clear() */
+
+/* }}} */
+
+/* {{{ mp_rsa_key_crt(key) */
+
+mp_err   mp_rsa_key_crt(mp_rsa_key *key)
+{
+  mp_int  pmo, qmo, phi;
+  mp_err  res;
+
+  ARGCHK(key != NULL, MP_BADARG);
+
+  /* The recombination in s_rsa_crt_expt() wants p > q */
+  if(mp_cmp(&key->p, &key->q) < 0)
+    mp_exch(&key->p, &key->q);
+
+  if((res = mp_init(&pmo)) != MP_OKAY)
+    return res;
+  if((res = mp_init(&qmo)) != MP_OKAY)
+    goto QMO;
+  if((res = mp_init(&phi)) != MP_OKAY)
+    goto PHI;
+
+  if((res = mp_sub_d(&key->p, 1, &pmo)) != MP_OKAY ||
+     (res = mp_sub_d(&key->q, 1, &qmo)) != MP_OKAY ||
+     (res = mp_mul(&pmo, &qmo, &phi)) != MP_OKAY)
+    goto CLEANUP;
+
+  if((res = mp_mul(&key->p, &key->q, &key->modulus)) != MP_OKAY)
+    goto CLEANUP;
+
+  /* d = e^-1 (mod (p - 1)(q - 1)); MP_UNDEF if there is none */
+  if((res = mp_invmod(&key->e, &phi, &key->d)) != MP_OKAY)
+    goto CLEANUP;
+
+  if((res = mp_mod(&key->d, &pmo, &key->dP)) != MP_OKAY ||
+     (res = mp_mod(&key->d, &qmo, &key->dQ)) != MP_OKAY)
+    goto CLEANUP;
+
+  res = mp_invmod(&key->q, &key->p, &key->qInv);
+
+ CLEANUP:
+  mp_clear(&phi);
+ PHI:
+  mp_clear(&qmo);
+ QMO:
+  mp_clear(&pmo);
+
+  return res;
+
+} /* end mp_rsa_key_crt() */
+
+/* }}} */
+
+/* {{{ mp_rsa_keygen(key, bits, e, nt, rand) */
+
+mp_err   mp_rsa_keygen(mp_rsa_key *key, int bits, mp_int *e, 
+		       int nt, rnd_f rand)
+{
+  mp_err  res;
+
+  ARGCHK(key != NULL && e != NULL && rand != NULL && 
+	 bits >= 32 && (bits % 2) == 0 && nt > 0, MP_BADARG);
+
+  if(mp_iseven(e) || mp_cmp_d(e, 1) <= 0)
+    return MP_BADARG;
+
+  if((res = mp_copy(e, &key->e)) != MP_OKAY)
+    return res;
+
+  do {
+    if((res = s_rsa_gen_prime(&key->p, bits / 2, e, nt, rand)) != MP_OKAY)
+      return res;
+    if((res = s_rsa_gen_prime(&key->q, bits / 2, e, nt, rand)) != MP_OKAY)
+      return res;
+  } while(mp_cmp(&key->p, &key->q) == 0);
+
+  return mp_rsa_key_crt(key);
+
+} /* end mp_rsa_keygen() */
+
+/* }}} */
+
+/* {{{ mp_rsadp_crt(cipher, key, msg) */
+
+mp_err   mp_rsadp_crt(mp_int *cipher, mp_rsa_key *key, mp_int *msg)
+{
+  ARGCHK(cipher != NULL && key != NULL && msg != NULL, MP_BADARG);
+
+  /* Insure that ciphertext representative is in range of modulus */
+  if((mp_cmp_z(cipher) < 0) || 
+     (mp_cmp(cipher, &key->modulus) >= 0)) {
+    return MP_RANGE;
+  }
+
+  return s_rsa_crt_expt(cipher, key, msg);
+
+} /* end mp_rsadp_crt() */
+
+/* }}} */
+
+/* {{{ mp_rsasp_crt(msg, key, sig) */
+
+mp_err   mp_rsasp_crt(mp_int *msg, mp_rsa_key *key, mp_int *sig)
+{
+  ARGCHK(msg != NULL && key != NULL && sig != NULL, MP_BADARG);
+
+  if((mp_cmp_z(msg) < 0) ||
+     (mp_cmp(msg, &key->modulus) >= 0)) {
+    return MP_RANGE;
+  }
+
+  return s_rsa_crt_expt(msg, key, sig);
+
+} /* end mp_rsasp_crt() */
+
+/* }}} */
+
 /* {{{ mp_pkcs1v15_encode(msg, mlen, emsg, emlen, rand) */
 
 mp_err   mp_pkcs1v15_encode(char *msg, int mlen, 
@@ -301,6 +467,58 @@ mp_err   mp_pkcs1v15_decrypt(char *msg, int mlen,
 
 /* }}} */
 
+/* {{{ mp_pkcs1v15_decrypt_crt(msg, mlen, key, out, olen) */
+
+mp_err   mp_pkcs1v15_decrypt_crt(char *msg, int mlen,
+				 mp_rsa_key *key,
+				 char **out, int *olen)
+{
+  int     k;
+  char   *buf;
+  mp_err  res;
+  mp_int  mrep;
+
+  ARGCHK(msg != NULL && key != NULL &&
+	 out != NULL && olen != NULL, MP_BADARG);
+
+  k = mp_unsigned_bin_size(&key->modulus);  /* size of modulus, in bytes */
+  if(mlen != k)
+    return MP_UNDEF;
+  if((buf = malloc(k)) == NULL)
+    return MP_MEM;
+
+  /* Convert ciphertext to integer representative */
+  if((res = mp_init(&mrep)) != MP_OKAY) {
+    free(buf);
+    return res;
+  }
+
+  if((res = mp_os2ip(&mrep, msg, mlen)) != MP_OKAY) 
+    goto CLEANUP;
+
+  /* Decrypt ... */
+  if((res = mp_rsadp_crt(&mrep, key, &mrep)) != MP_OKAY)
+    goto CLEANUP;
+
+  if((res = mp_i2osp(&mrep, buf, k)) != MP_OKAY)
+    goto CLEANUP;
+
+  if((res = mp_pkcs1v15_decode(buf, k, buf, olen)) == MP_OKAY) {
+    mp_clear(&mrep);
+    *out = buf;
+    return MP_OKAY;
+  } 
+
+ CLEANUP:
+  memset(buf, 0, k);
+  free(buf);
+  mp_clear(&mrep);
+  return res;
+    
+} /* end mp_pkcs1v15_decrypt_crt() */
+
+/* }}} */
+
 /* {{{ mp_pkcs1v15_maxlen(modulus) */
 
 int      mp_pkcs1v15_maxlen(mp_int *modulus)
@@ -316,5 +534,154 @@ int      mp_pkcs1v15_maxlen(mp_int *modulus)
 
 /* }}} */
 
+/*------------------------------------------------------------------------*/
+/* Static functions visible only to the library internally                */
+
+/* {{{ s_rsa_gen_prime(p, bits, e, nt, rand) */
+
+/*
+  Find a probable prime p of exactly 'bits' bits, with its two high
+  order bits set, for which (e, p - 1) = 1.  Candidates are screened
+  by trial division against the small prime table, then a Fermat test
+  to the base 2, then 'nt' rounds of Rabin-Miller.
+ */
+mp_err   s_rsa_gen_prime(mp_int *p, int bits, mp_int *e, 
+			 int nt, rnd_f rand)
+{
+  int            nbytes = (bits + CHAR_BIT - 1) / CHAR_BIT;
+  unsigned char *raw;
+  mp_digit       np;
+  mp_int         top, g;
+  mp_err         res;
+
+  if((raw = malloc(nbytes)) == NULL)
+    return MP_MEM;
+  if((res = mp_init(&top)) != MP_OKAY)
+    goto TOP;
+  if((res = mp_init(&g)) != MP_OKAY)
+    goto G;
+
+  /* top = 2^(bits - 1) + 2^(bits - 2) */
+  if((res = mp_2expt(&top, bits - 2)) != MP_OKAY ||
+     (res = mp_mul_d(&top, 3, &top)) != MP_OKAY)
+    goto CLEANUP;
+
+ RESTART:
+  (rand)((char *)raw, nbytes);
+  if((res = mp_read_unsigned_bin(p, raw, nbytes)) != MP_OKAY ||
+     (res = mp_div_2d(p, bits - 2, NULL, p)) != MP_OKAY ||
+     (res = mp_add(p, &top, p)) != MP_OKAY)
+    goto CLEANUP;
+
+  if(mp_iseven(p))
+    mp_add_d(p, 1, p);
+
+  for(;;) {
+    /* Ran off the top of the range; start over somewhere else */
+    if(mp_count_bits(p) > bits)
+      goto RESTART;
+
+    np = prime_tab_size;
+    if((res = mpp_divis_primes(p, &np)) == MP_NO) {
+      if((res = mpp_fermat(p, 2)) == MP_YES &&
+	 (res = mpp_pprime(p, nt)) == MP_YES) {
+
+	/* e must be invertible modulo p - 1 */
+	mp_sub_d(p, 1, &g);
+	if((res = mp_gcd(e, &g, &g)) != MP_OKAY)
+	  goto CLEANUP;
+	if(mp_cmp_d(&g, 1) == 0)
+	  break;
+      }
+    }
+
+    if(res != MP_YES && res != MP_NO)
+      goto CLEANUP;
+
+    if((res = mp_add_d(p, 2, p)) != MP_OKAY)
+      goto CLEANUP;
+  }
+
+  res = MP_OKAY;
+
+ CLEANUP:
+  mp_clear(&g);
+ G:
+  mp_clear(&top);
+ TOP:
+  memset(raw, 0, nbytes);
+  free(raw);
+
+  return res;
+
+} /* end s_rsa_gen_prime() */
+
+/* }}} */
+
+/* {{{ s_rsa_key_parts(key, parts) */
+
+void     s_rsa_key_parts(mp_rsa_key *key, mp_int *parts[])
+{
+  parts[0] = &key->modulus;
+  parts[1] = &key->e;
+  parts[2] = &key->d;
+  parts[3] = &key->p;
+  parts[4] = &key->q;
+  parts[5] = &key->dP;
+  parts[6] = &key->dQ;
+  parts[7] = &key->qInv;
+
+} /* end s_rsa_key_parts() */
+
+/* }}} */
+
+/* {{{ s_rsa_crt_expt(in, key, out) */
+
+/*
+  Compute out = in^d (mod n) by Garner's recombination:
+
+     m1  = in^dP (mod p)
+     m2  = in^dQ (mod q)
+     h   = qInv (m1 - m2) (mod p)
+     out = m2 + hq
+
+  The caller has checked that 0 <= in < n.
+ */
+mp_err   s_rsa_crt_expt(mp_int *in, mp_rsa_key *key, mp_int *out)
+{
+  mp_int  m1, m2;
+  mp_err  res;
+
+  if((res = mp_init(&m1)) != MP_OKAY)
+    return res;
+  if((res = mp_init(&m2)) != MP_OKAY)
+    goto M2;
+
+  if((res = mp_mod(in, &key->p, &m1)) != MP_OKAY ||
+     (res = mp_exptmod(&m1, &key->dP, &key->p, &m1)) != MP_OKAY)
+    goto CLEANUP;
+
+  if((res = mp_mod(in, &key->q, &m2)) != MP_OKAY ||
+     (res = mp_exptmod(&m2, &key->dQ, &key->q, &m2)) != MP_OKAY)
+    goto CLEANUP;
+
+  if((res = mp_submod(&m1, &m2, &key->p, &m1)) != MP_OKAY ||
+     (res = mp_mulmod(&m1, &key->qInv, &key->p, &m1)) != MP_OKAY ||
+     (res = mp_mul(&m1, &key->q, &m1)) != MP_OKAY)
+    goto CLEANUP;
+
+  res = mp_add(&m2, &m1, out);
+
+ CLEANUP:
+  mp_clear(&m2);
+ M2:
+  mp_clear(&m1);
+
+  return res;
+
+} /* end s_rsa_crt_expt() */
+
+/* }}} */
+
 /*------------------------------------------------------------------------*/
 /* HERE THERE BE DRAGONS                                                  */
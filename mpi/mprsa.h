@@ -47,6 +47,64 @@ mp_err   mp_rsasp(mp_int *msg, mp_int *d, mp_int *modulus, mp_int *sig);
 /* Basic RSA verification operation */
 mp_err   mp_rsavp(mp_int *sig, mp_int *e, mp_int *modulus, mp_int *msg);
 
+/* RSA private key, including the Chinese Remainder Theorem values
+   described in PKCS #1 v2.1.  The private operations below use the
+   CRT form, which works on half-size exponents and moduli and so is
+   roughly four times faster than exponentiating by d mod n.
+
+   modulus   - n = p * q
+   e         - public (encryption) exponent
+   d         - private (decryption) exponent
+   p, q      - prime factors of the modulus, p > q
+   dP, dQ    - d mod (p - 1), d mod (q - 1)
+   qInv      - q^-1 mod p
+ */
+typedef struct {
+  mp_int   modulus;
+  mp_int   e;
+  mp_int   d;
+  mp_int   p;
+  mp_int   q;
+  mp_int   dP;
+  mp_int   dQ;
+  mp_int   qInv;
+} mp_rsa_key;
+
+/* Initialize and release the storage for a private key */
+mp_err   mp_rsa_key_init(mp_rsa_key *key);
+void     mp_rsa_key_clear(mp_rsa_key *key);
+
+/* Complete a private key from its primes and public exponent
+   key->p, key->q and key->e must be set on input.  The modulus, the
+   private exponent and the CRT values are computed from them (and p
+   and q are exchanged, if necessary, so that p > q).
+
+   Returns MP_UNDEF if e is not invertible modulo (p - 1)(q - 1).
+ */
+mp_err   mp_rsa_key_crt(mp_rsa_key *key);
+
+/* Generate a new private key
+   key       - initialized key structure to fill
+   bits      - size of the modulus, in bits (at least 32, even)
+   e         - public exponent to use, odd and > 1
+   nt        - number of Rabin-Miller rounds to run on each prime
+   rand      - function to generate random nonzero bytes for the
+               initial prime candidates
+
+   The primes are found using the facilities in mpprime.c; each is
+   exactly bits/2 bits long with its two high-order bits set, so
+   that the modulus is exactly 'bits' bits long.
+ */
+mp_err   mp_rsa_keygen(mp_rsa_key *key, int bits, mp_int *e, 
+		       int nt, rnd_f rand);
+
+/* RSA decryption and signing using the CRT form of the private key.
+   These give the same results as mp_rsadp() and mp_rsasp() with
+   key->d and key->modulus.  The output may be the same as the input.
+ */
+mp_err   mp_rsadp_crt(mp_int *cipher, mp_rsa_key *key, mp_int *msg);
+mp_err   mp_rsasp_crt(mp_int *msg, mp_rsa_key *key, mp_int *sig);
+
 /* PKCS#1 v.1.5 message padding and encoding
    msg       - input message
    mlen      - length of input message, in bytes
@@ -98,6 +156,14 @@ mp_err   mp_pkcs1v15_decrypt(char *msg, int mlen,
 			     mp_int *d, mp_int *modulus,
 			     char **out, int *olen);
 
+/* Decrypt a message using RSA and PKCS#1 v.1.5 padding, with the
+   CRT form of the private key.  Arguments and results are as for
+   mp_pkcs1v15_decrypt(), with the exponent and modulus taken from key.
+ */
+mp_err   mp_pkcs1v15_decrypt_crt(char *msg, int mlen,
+				 mp_rsa_key *key,
+				 char **out, int *olen);
+
 /* Return the maximum length a message can be using the given modulus
    under the PKCS#1 v.1.5 encoding scheme
  */
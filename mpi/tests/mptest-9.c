@@ -49,6 +49,21 @@ int main(int argc, char *argv[])
   mpl_xor(&a, &b, &c);
   printf("a ^ b = "); mp_print(&c, stdout); fputc('\n', stdout);
 
+  /* In place, and with the output the same as an input */
+  mp_copy(&a, &c); mpl_and_in(&c, &b);
+  printf("a &= b: "); mp_print(&c, stdout); fputc('\n', stdout);
+  mp_copy(&a, &c); mpl_or_in(&c, &b);
+  printf("a |= b: "); mp_print(&c, stdout); fputc('\n', stdout);
+  mp_copy(&a, &c); mpl_xor_in(&c, &b);
+  printf("a ^= b: "); mp_print(&c, stdout); fputc('\n', stdout);
+
+  mp_copy(&b, &c); mpl_and(&a, &c, &c);
+  printf("b & a = "); mp_print(&c, stdout); fputc('\n', stdout);
+  mp_copy(&b, &c); mpl_or(&a, &c, &c);
+  printf("b | a = "); mp_print(&c, stdout); fputc('\n', stdout);
+  mp_copy(&b, &c); mpl_xor(&a, &c, &c);
+  printf("b ^ a = "); mp_print(&c, stdout); fputc('\n', stdout);
+
   mpl_rsh(&a, &c, 1);
   printf("a >> 1 = "); mp_print(&c, stdout); fputc('\n', stdout);
   mpl_rsh(&a, &c, 5);
@@ -68,6 +83,9 @@ int main(int argc, char *argv[])
   mpl_num_set(&b, &pco);
   printf("#1(b) = %d\n", pco);
 
+  mpl_num_clear(&a, &pco);
+  printf("#0(a) = %d\n", pco);
+
   res = mpl_parity(&a);
   if(res == MP_EVEN)
     printf("a has even parity\n");
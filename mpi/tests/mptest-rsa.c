@@ -7,6 +7,7 @@
 
 #include "mpi.h"
 #include "mprsa.h"
+#include "mpprime.h"
 
 char *g_message = "You can't keep a secret for the life of you.";
 char *g_modulus = 
@@ -87,12 +88,88 @@ int main(int argc, char *argv[])
 
   free(out);
 
+  /* Now generate a fresh key, and check that the CRT private key
+     operations agree with the plain ones */
+  {
+    mp_rsa_key  key;
+    mp_int      mrep, r1, r2;
+    clock_t     start, end;
+    int         ix, ntests = 20;
+
+    mp_rsa_key_init(&key);
+    mp_init(&mrep);
+    mp_init(&r1);
+    mp_init(&r2);
+
+    printf("\nGenerating a 512-bit key ... \n");
+    res = mp_rsa_keygen(&key, 512, &e, 10, myrand);
+    printf("Result:  %s\n", mp_strerror(res));
+    if(res != MP_OKAY)
+      goto KEY_CLEANUP;
+
+    for(ix = 0; ix < ntests; ix++) {
+      mpp_random_size(&mrep, USED(&key.modulus));
+      mp_mod(&mrep, &key.modulus, &mrep);
+
+      mp_rsasp(&mrep, &key.d, &key.modulus, &r1);
+      mp_rsasp_crt(&mrep, &key, &r2);
+      if(mp_cmp(&r1, &r2) != 0) {
+	printf("CRT signature %d does not match!\n", ix);
+	res = MP_UNDEF;
+	goto KEY_CLEANUP;
+      }
+      mp_rsavp(&r2, &key.e, &key.modulus, &r1);
+      if(mp_cmp(&r1, &mrep) != 0) {
+	printf("CRT signature %d does not verify!\n", ix);
+	res = MP_UNDEF;
+	goto KEY_CLEANUP;
+      }
+    }
+    printf("%d CRT signatures match and verify\n", ntests);
+
+    start = clock();
+    for(ix = 0; ix < ntests; ix++)
+      mp_rsadp(&mrep, &key.d, &key.modulus, &r1);
+    end = clock();
+    printf("Plain decryption: %.4f seconds each\n",
+	   ((double)(end - start) / CLOCKS_PER_SEC) / ntests);
+
+    start = clock();
+    for(ix = 0; ix < ntests; ix++)
+      mp_rsadp_crt(&mrep, &key, &r2);
+    end = clock();
+    printf("CRT decryption:   %.4f seconds each\n",
+	   ((double)(end - start) / CLOCKS_PER_SEC) / ntests);
+
+    printf("\nEncrypting and decrypting with the new key ... \n");
+    res = mp_pkcs1v15_encrypt(g_message, strlen(g_message),
+			      &key.e, &key.modulus, &out, &olen, myrand);
+    if(res == MP_OKAY) {
+      res = mp_pkcs1v15_decrypt_crt(out, olen, &key, &ptx, &olen);
+      free(out);
+    }
+    printf("Result:  %s\n", mp_strerror(res));
+    if(res == MP_OKAY) {
+      if(olen != strlen(g_message) || memcmp(ptx, g_message, olen) != 0) {
+	printf("Decrypted message does not match!\n");
+	res = MP_UNDEF;
+      }
+      free(ptx);
+    }
+
+  KEY_CLEANUP:
+    mp_clear(&r2);
+    mp_clear(&r1);
+    mp_clear(&mrep);
+    mp_rsa_key_clear(&key);
+  }
+
  CLEANUP:
   mp_clear(&d);
   mp_clear(&e);
   mp_clear(&modulus);
 
-  return 0;
+  return (res == MP_OKAY) ? 0 : 1;
 }
 
 void myrand(char *out, int len)
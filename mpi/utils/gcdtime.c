@@ -0,0 +1,306 @@
+/*
+   gcdtime.c
+
+   GCD and modular inverse timing test
+
+   Times mp_gcd(), mp_xgcd() and mp_invmod() against the plain binary
+   (Stein) versions the library used to have, which are kept below for
+   comparison, and checks that both give the same answers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "mpi.h"
+#include "mpprime.h"
+
+/* Internal helpers from mpi.c, used as the old code used them */
+extern void   s_mp_div_2(mp_int *mp);
+extern mp_err s_mp_mul_2(mp_int *mp);
+extern mp_err s_mp_2expt(mp_int *a, mp_digit k);
+
+mp_err old_gcd(mp_int *a, mp_int *b, mp_int *c);
+mp_err old_xgcd(mp_int *a, mp_int *b, mp_int *g, mp_int *x, mp_int *y);
+double clk_to_sec(clock_t start, clock_t stop);
+
+int main(int argc, char *argv[])
+{
+  int          ix, num, prec = 32, bad = 0;
+  unsigned int seed;
+  clock_t      start, stop;
+  double       t_old[3], t_new[3];
+
+  mp_int      *a, *m, g1, g2, x1, x2;
+
+  if(getenv("SEED") != NULL)
+    seed = abs(atoi(getenv("SEED")));
+  else
+    seed = (unsigned int)time(NULL);
+
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s <num-tests> [<nbits>]\n", argv[0]);
+    return 1;
+  }
+
+  if((num = atoi(argv[1])) < 0)
+    num = -num;
+
+  if(!num) {
+    fprintf(stderr, "%s: must perform at least 1 test\n", argv[0]);
+    return 1;
+  }
+
+  if(argc > 2) {
+    if((prec = atoi(argv[2])) <= 0)
+      prec = 32;
+    else
+      prec = (prec + (MP_DIGIT_BIT - 1)) / MP_DIGIT_BIT;
+  }
+
+  printf("GCD timing test\n"
+	 "Precision:  %d digits (%d bits)\n"
+	 "# of tests: %d\n\n", prec, (int)(prec * MP_DIGIT_BIT), num);
+
+  /* The same operands are used for every function, so make them now */
+  a = calloc(num, sizeof(mp_int));
+  m = calloc(num, sizeof(mp_int));
+  if(a == NULL || m == NULL) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+
+  srand(seed);
+  for(ix = 0; ix < num; ix++) {
+    mp_init_size(&a[ix], prec);
+    mp_init_size(&m[ix], prec);
+    mpp_random_size(&a[ix], prec);
+    mpp_random_size(&m[ix], prec);
+    if(mp_iseven(&m[ix]))
+      mp_add_d(&m[ix], 1, &m[ix]);
+  }
+
+  mp_init(&g1); mp_init(&g2); mp_init(&x1); mp_init(&x2);
+
+  /* mp_gcd() */
+  start = clock();
+  for(ix = 0; ix < num; ix++)
+    old_gcd(&a[ix], &m[ix], &g1);
+  stop = clock();
+  t_old[0] = clk_to_sec(start, stop);
+
+  start = clock();
+  for(ix = 0; ix < num; ix++)
+    mp_gcd(&a[ix], &m[ix], &g2);
+  stop = clock();
+  t_new[0] = clk_to_sec(start, stop);
+
+  /* mp_xgcd() */
+  start = clock();
+  for(ix = 0; ix < num; ix++)
+    old_xgcd(&a[ix], &m[ix], &g1, &x1, NULL);
+  stop = clock();
+  t_old[1] = clk_to_sec(start, stop);
+
+  start = clock();
+  for(ix = 0; ix < num; ix++)
+    mp_xgcd(&a[ix], &m[ix], &g2, &x2, NULL);
+  stop = clock();
+  t_new[1] = clk_to_sec(start, stop);
+
+  /* mp_invmod(), which is mp_xgcd() plus a reduction */
+  start = clock();
+  for(ix = 0; ix < num; ix++) {
+    if(old_xgcd(&a[ix], &m[ix], &g1, &x1, NULL) == MP_OKAY &&
+       mp_cmp_d(&g1, 1) == 0)
+      mp_mod(&x1, &m[ix], &x1);
+  }
+  stop = clock();
+  t_old[2] = clk_to_sec(start, stop);
+
+  start = clock();
+  for(ix = 0; ix < num; ix++)
+    mp_invmod(&a[ix], &m[ix], &x2);
+  stop = clock();
+  t_new[2] = clk_to_sec(start, stop);
+
+  /* Make sure the answers agree */
+  for(ix = 0; ix < num; ix++) {
+    old_gcd(&a[ix], &m[ix], &g1);
+    mp_gcd(&a[ix], &m[ix], &g2);
+    if(mp_cmp(&g1, &g2) != 0)
+      ++bad;
+
+    if(mp_cmp_d(&g1, 1) == 0) {
+      old_xgcd(&a[ix], &m[ix], NULL, &x1, NULL);
+      mp_mod(&x1, &m[ix], &x1);
+      mp_invmod(&a[ix], &m[ix], &x2);
+      if(mp_cmp(&x1, &x2) != 0)
+	++bad;
+    }
+  }
+
+  printf("              old        new    speedup\n");
+  printf("gcd      %8.3fs  %8.3fs  %8.2fx\n",
+	 t_old[0], t_new[0], t_new[0] > 0 ? t_old[0] / t_new[0] : 0.0);
+  printf("xgcd     %8.3fs  %8.3fs  %8.2fx\n",
+	 t_old[1], t_new[1], t_new[1] > 0 ? t_old[1] / t_new[1] : 0.0);
+  printf("invmod   %8.3fs  %8.3fs  %8.2fx\n",
+	 t_old[2], t_new[2], t_new[2] > 0 ? t_old[2] / t_new[2] : 0.0);
+
+  if(bad)
+    printf("\n%d results did not match!\n", bad);
+
+  mp_clear(&g1); mp_clear(&g2); mp_clear(&x1); mp_clear(&x2);
+  for(ix = 0; ix < num; ix++) {
+    mp_clear(&a[ix]);
+    mp_clear(&m[ix]);
+  }
+  free(a);
+  free(m);
+
+  return bad ? 1 : 0;
+}
+
+double clk_to_sec(clock_t start, clock_t stop)
+{
+  return (double)(stop - start) / CLOCKS_PER_SEC;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* The binary GCD, one bit and one full subtraction at a time           */
+mp_err old_gcd(mp_int *a, mp_int *b, mp_int *c)
+{
+  mp_err   res;
+  mp_int   u, v, t;
+  mp_size  k = 0;
+
+  if(mp_cmp_z(a) == 0)
+    return mp_abs(b, c);
+  if(mp_cmp_z(b) == 0)
+    return mp_abs(a, c);
+
+  if((res = mp_init(&t)) != MP_OKAY)
+    return res;
+  if((res = mp_init_copy(&u, a)) != MP_OKAY)
+    goto U;
+  if((res = mp_init_copy(&v, b)) != MP_OKAY)
+    goto V;
+
+  mp_abs(&u, &u);
+  mp_abs(&v, &v);
+
+  while(mp_iseven(&u) && mp_iseven(&v)) {
+    s_mp_div_2(&u);
+    s_mp_div_2(&v);
+    ++k;
+  }
+
+  if(mp_isodd(&u)) {
+    if((res = mp_neg(&v, &t)) != MP_OKAY)
+      goto CLEANUP;
+  } else {
+    if((res = mp_copy(&u, &t)) != MP_OKAY)
+      goto CLEANUP;
+  }
+
+  for(;;) {
+    while(mp_iseven(&t))
+      s_mp_div_2(&t);
+
+    if(mp_cmp_z(&t) > 0) {
+      if((res = mp_copy(&t, &u)) != MP_OKAY)
+	goto CLEANUP;
+    } else {
+      if((res = mp_neg(&t, &v)) != MP_OKAY)
+	goto CLEANUP;
+    }
+
+    if((res = mp_sub(&u, &v, &t)) != MP_OKAY)
+      goto CLEANUP;
+
+    if(mp_cmp_z(&t) == 0)
+      break;
+  }
+
+  s_mp_2expt(&v, k);
+  res = mp_mul(&u, &v, c);
+
+ CLEANUP:
+  mp_clear(&v);
+ V:
+  mp_clear(&u);
+ U:
+  mp_clear(&t);
+
+  return res;
+}
+
+/* The extended binary GCD, for non-negative a and positive b          */
+mp_err old_xgcd(mp_int *a, mp_int *b, mp_int *g, mp_int *x, mp_int *y)
+{
+  mp_int   gx, xc, yc, u, v, A, B, C, D;
+  mp_err   res = MP_OKAY;
+
+  mp_init(&u); mp_init(&v); mp_init(&gx);
+  mp_init(&A); mp_init(&B); mp_init(&C); mp_init(&D);
+  mp_init_copy(&xc, a); mp_init_copy(&yc, b);
+
+  mp_set(&gx, 1);
+  while(mp_iseven(&xc) && mp_iseven(&yc)) {
+    s_mp_div_2(&xc);
+    s_mp_div_2(&yc);
+    s_mp_mul_2(&gx);
+  }
+
+  mp_copy(&xc, &u);
+  mp_copy(&yc, &v);
+  mp_set(&A, 1); mp_set(&D, 1);
+
+  for(;;) {
+    while(mp_iseven(&u)) {
+      s_mp_div_2(&u);
+      if(mp_iseven(&A) && mp_iseven(&B)) {
+	s_mp_div_2(&A); s_mp_div_2(&B);
+      } else {
+	mp_add(&A, &yc, &A); s_mp_div_2(&A);
+	mp_sub(&B, &xc, &B); s_mp_div_2(&B);
+      }
+    }
+
+    while(mp_iseven(&v)) {
+      s_mp_div_2(&v);
+      if(mp_iseven(&C) && mp_iseven(&D)) {
+	s_mp_div_2(&C); s_mp_div_2(&D);
+      } else {
+	mp_add(&C, &yc, &C); s_mp_div_2(&C);
+	mp_sub(&D, &xc, &D); s_mp_div_2(&D);
+      }
+    }
+
+    if(mp_cmp(&u, &v) >= 0) {
+      mp_sub(&u, &v, &u); mp_sub(&A, &C, &A); mp_sub(&B, &D, &B);
+    } else {
+      mp_sub(&v, &u, &v); mp_sub(&C, &A, &C); mp_sub(&D, &B, &D);
+    }
+
+    if(mp_cmp_z(&u) == 0) {
+      if(x) mp_copy(&C, x);
+      if(y) mp_copy(&D, y);
+      if(g) mp_mul(&gx, &v, g);
+      break;
+    }
+  }
+
+  mp_clear(&u); mp_clear(&v); mp_clear(&gx);
+  mp_clear(&A); mp_clear(&B); mp_clear(&C); mp_clear(&D);
+  mp_clear(&xc); mp_clear(&yc);
+
+  return res;
+}
+
+/*------------------------------------------------------------------------*/
+/* HERE THERE BE DRAGONS                                                  */
@@ -4,7 +4,12 @@
   A simple prime generator function (and test driver).  Prints out the
   first prime it finds greater than or equal to the starting value.
   
-  Usage: makeprime <start>
+  Usage: makeprime <start> [strong]
+
+  If the THREADS environment variable is set, up to that many
+  candidates are tested at once (if the library was built with
+  MP_THREADS).  If SEED is set, the Rabin-Miller witnesses are derived
+  from it, so that runs are repeatable.
 
   by Michael J. Fromberger <sting@linguist.dartmouth.edu>
   Copyright (C) 2000 Michael J. Fromberger, All Rights Reserved
@@ -37,12 +42,16 @@
 mp_err   is_prime(mp_int *p, int nr);
 mp_err   make_prime(mp_int *p, int nr, int strong);
 
+int            g_threads = 1;
+unsigned long  g_seed = 0;
+
 /* The main() is not required -- it's just a test driver */
 int main(int argc, char *argv[])
 {
   mp_int    start;
   mp_err    res;
   int       strong = 0;
+  char     *env;
 
   if(argc < 2) {
     fprintf(stderr, "Usage: %s <start-value> [strong]\n", argv[0]);
@@ -61,6 +70,11 @@ int main(int argc, char *argv[])
     strong = 1;
   }
 
+  if((env = getenv("THREADS")) != NULL && atoi(env) > 0)
+    g_threads = atoi(env);
+  if((env = getenv("SEED")) != NULL)
+    g_seed = strtoul(env, NULL, 10);
+
   if((res = make_prime(&start, 5, strong)) != MP_OKAY) {
     fprintf(stderr, "%s: error: %s\n", argv[0], mp_strerror(res));
     mp_clear(&start);
@@ -106,37 +120,34 @@ mp_err   make_prime(mp_int *p, int nr, int strong)
 {
   mp_err  res;
 
-  if(mp_iseven(p)) {
-    mp_add_d(p, 1, p);
-  }
+  for(;;) {
+    /* The sieving and the first round of testing are shared out among
+       the threads by the library */
+    if((res = mpp_make_prime(p, nr, g_threads, g_seed, NULL)) != MP_OKAY)
+      return res;
+
+    if(strong) {
+      mp_int  p2;
 
-  do {
-    if((res = is_prime(p, nr)) == MP_YES) {
-      if(strong) {
-	mp_int  p2;
-
-	if((res = mp_init_copy(&p2, p)) != MP_OKAY)
-	  return res;
-
-	mp_sub_d(&p2, 1, &p2);
-	mp_div_2(&p2, &p2);
-
-	res = is_prime(&p2, nr);
-	mp_clear(&p2);
-	if(res == MP_YES)
-	  break;
-	else if(res != MP_NO)
-	  return res;
-	
-      } else
+      if((res = mp_init_copy(&p2, p)) != MP_OKAY)
+	return res;
+
+      mp_sub_d(&p2, 1, &p2);
+      mp_div_2(&p2, &p2);
+
+      res = is_prime(&p2, nr);
+      mp_clear(&p2);
+      if(res == MP_YES)
 	return MP_OKAY;
-    } else if(res != MP_NO) {
-      return res;
-    }
- 
-  } while((res = mp_add_d(p, 2, p)) == MP_OKAY);
+      else if(res != MP_NO)
+	return res;
 
-  return res;
+    } else
+      return MP_OKAY;
+
+    if((res = mp_add_d(p, 2, p)) != MP_OKAY)
+      return res;
+  }
 
 } /* end make_prime() */
 
@@ -14,9 +14,16 @@
      <bits>   - number of significant bits each prime should have
      <num>    - number of primes to generate
 
+  If the SEED environment variable is set, it seeds rand() and the
+  Rabin-Miller witnesses, so that repeated runs do the same work (the
+  'time_tests' script relies on this).  If THREADS is set, up to that
+  many candidates are tested at once.  Timings are wall-clock times.
+
   $Id: primegen.c,v 1.1 2004/02/08 04:28:32 sting Exp $
  */
  
+#define _POSIX_C_SOURCE 199309L  /* for clock_gettime() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +43,8 @@
 
 int    g_strong = 0;
 
+double now(void);
+
 int main(int argc, char *argv[])
 {
   unsigned char *raw, *out;
@@ -43,7 +52,9 @@ int main(int argc, char *argv[])
   mp_int	testval, q, ntries;
   mp_err	res;
   mp_digit      np;
-  clock_t	start, end;
+  double	start, end;
+  int		nthreads = 1;
+  unsigned long seed = 0, tries;
 
 #ifdef MACOS
   argc = ccommand(&argv);
@@ -55,7 +66,13 @@ int main(int argc, char *argv[])
   if((out = (unsigned char *)getenv("SEED")) == NULL) {
     srand((unsigned int)time(NULL));
   } else {
-    srand((unsigned int)atoi((char *)out));
+    seed = strtoul((char *)out, NULL, 10);
+    srand((unsigned int)seed);
+  }
+
+  if((out = (unsigned char *)getenv("THREADS")) != NULL && 
+     atoi((char *)out) > 0) {
+    nthreads = atoi((char *)out);
   }
 
   if(argc < 2) {
@@ -139,7 +156,18 @@ int main(int argc, char *argv[])
     mp_zero(&ntries);
     mp_add_d(&ntries, 1, &ntries);
 
-    start = clock(); /* time generation for this prime */
+    start = now(); /* time generation for this prime */
+
+    /* Plain primes are found by the library's sieving search, which
+       spreads the candidates over the threads */
+    if(!g_strong) {
+      res = mpp_make_prime(&testval, NUM_TESTS, nthreads, seed, &tries);
+      if(res != MP_OKAY)
+	goto CLEANUP;
+      mp_set_int(&ntries, (long)tries);
+      goto FOUND;
+    }
+
     for(;;) {
       /*
 	Test for divisibility by small primes (of which there is a table 
@@ -243,7 +271,8 @@ int main(int argc, char *argv[])
 	mp_add_d(&testval, 2, &testval);
       mp_add_d(&ntries, 1, &ntries);
     } /* end of loop to generate a single prime */
-    end = clock();
+  FOUND:
+    end = now();
     
     printf("After %d tests, the following value is still probably prime:\n",
 	   NUM_TESTS);
@@ -263,7 +292,7 @@ int main(int argc, char *argv[])
     free(out);
 
     printf("This computation took %ld clock ticks (%.2f seconds)\n",
-	   (end - start), ((double)(end - start) / CLOCKS_PER_SEC));
+	   (long)((end - start) * CLOCKS_PER_SEC), (end - start));
     
     fputc('\n', stdout);
   } /* end of loop to generate all requested primes */
@@ -277,3 +306,13 @@ int main(int argc, char *argv[])
   
   return 0;
 }
+
+/* Wall-clock time, in seconds */
+double now(void)
+{
+  struct timespec  ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -6,22 +6,19 @@
 
   Finds prime numbers using the Sieve of Eratosthenes
 
-  This implementation uses a bitmap to represent all odd integers in a
-  given range.  We iterate over this bitmap, crossing off the
-  multiples of each prime we find.  At the end, all the remaining set
-  bits correspond to prime integers.
-
-  Here, we make two passes -- once we have generated a sieve-ful of
-  primes, we copy them out, reset the sieve using the highest
-  generated prime from the first pass as a base.  Then we cross out
-  all the multiples of all the primes we found the first time through,
-  and re-sieve.  In this way, we get double use of the memory we
-  allocated for the sieve the first time though.  Since we also
-  implicitly ignore multiples of 2, this amounts to 4 times the
-  values.
-
-  This could (and probably will) be generalized to re-use the sieve a
-  few more times.
+  This implementation uses a wheel of 30:  only the integers prime to
+  30 are represented in the bitmap, eight of them (1, 7, 11, 13, 17,
+  19, 23 and 29 mod 30) to each byte, so each byte covers 30 values
+  and the multiples of 2, 3 and 5 are never looked at.
+
+  The range is sieved one segment at a time, where a segment is small
+  enough to stay in the cache.  First we find the primes up to the
+  square root of the limit with a simple sieve; then for each of
+  those, and each of the eight residue classes, we keep track of the
+  next byte in which that prime has a multiple in that class.  Every
+  segment is crossed off with a stride of p bytes from those offsets,
+  which are carried forward into the next segment, so no division is
+  done after setup.
  */
 
 #include <stdio.h>
@@ -31,206 +28,192 @@
 
 typedef unsigned char  byte;
 
+/* Bytes per segment; 32K (983,040 integers) fits most L1 caches   */
+#define SEG_SIZE  32768
+
+static const int wheel[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+
 typedef struct {
-  int   size;
-  byte *bits;
-  long  base;
-  int   next;
-  int   nbits;
-} sieve;
-
-void sieve_init(sieve *sp, long base, int nbits);
-void sieve_grow(sieve *sp, int nbits);
-long sieve_next(sieve *sp);
-void sieve_reset(sieve *sp, long base);
-void sieve_cross(sieve *sp, long val);
-void sieve_clear(sieve *sp);
-
-#define S_ISSET(S, B)  (((S)->bits[(B)/CHAR_BIT]>>((B)%CHAR_BIT))&1)
-#define S_SET(S, B)    ((S)->bits[(B)/CHAR_BIT]|=(1<<((B)%CHAR_BIT)))
-#define S_CLR(S, B)    ((S)->bits[(B)/CHAR_BIT]&=~(1<<((B)%CHAR_BIT)))
-#define S_VAL(S, B)    ((S)->base+(2*(B)))
-#define S_BIT(S, V)    (((V)-((S)->base))/2)
+  long   prime;
+  long   next[8];     /* next byte with a multiple, for each residue */
+} sprime;
+
+long   small_primes(long limit, sprime **out);
+long   inverse_30(long p);
+void   seed_prime(sprime *sp);
+void   cross_segment(byte *seg, long lo, long hi, sprime *sp, long np);
 
 int main(int argc, char *argv[])
 {
-  sieve   s;
-  long    *p;
-  int     c, ix, cur = 0;
+  sprime  *sp = NULL;
+  byte    *seg;
+  long     limit, nbytes, np, lo, hi, val, count = 0;
+  int      ix, jx;
 
   if(argc < 2) {
-    fprintf(stderr, "Usage: %s <width>\n", argv[0]);
+    fprintf(stderr, "Usage: %s <limit>\n", argv[0]);
     return 1;
   }
 
-  c = atoi(argv[1]);
-  if(c < 0) c = -c;
-
-  fprintf(stderr, "%s: sieving to %d positions\n", argv[0], c);
-
-  sieve_init(&s, 3, c);
-
-  c = 0;
-  while(sieve_next(&s) > 0) {
-    ++c;
-  }
-
-  p = calloc(c, sizeof(long));
-  if(!p) {
-    fprintf(stderr, "%s: out of memory after first half\n", argv[0]);
-    sieve_clear(&s);
-    exit(1);
-  }
+  limit = atol(argv[1]);
+  if(limit < 0) limit = -limit;
 
-  fprintf(stderr, "%s: half done ... \n", argv[0]);
+  fprintf(stderr, "%s: sieving primes up to %ld\n", argv[0], limit);
 
-  for(ix = 0; ix < s.nbits; ix++) {
-    if(S_ISSET(&s, ix)) {
-      p[cur] = S_VAL(&s, ix);
-      printf("%ld\n", p[cur]);
-      ++cur;
+  /* The wheel has no room for 2, 3 and 5, so they go out by hand   */
+  for(ix = 0; ix < 3; ix++) {
+    val = (ix == 0) ? 2 : (ix == 1) ? 3 : 5;
+    if(val <= limit) {
+      printf("%ld\n", val);
+      ++count;
     }
   }
 
-  sieve_reset(&s, p[cur - 1]);
-  fprintf(stderr, "%s: crossing off %d found primes ... \n", argv[0], cur);
-  for(ix = 0; ix < cur; ix++) {
-    sieve_cross(&s, p[ix]);
-    if(!(ix % 1000))
-      fputc('.', stderr);
+  if((np = small_primes(limit, &sp)) < 0) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
   }
-  fputc('\n', stderr);
 
-  free(p);
-
-  fprintf(stderr, "%s: sieving again from %ld ... \n", argv[0], p[cur - 1]);
-  c = 0;
-  while(sieve_next(&s) > 0) {
-    ++c;
+  if((seg = malloc(SEG_SIZE)) == NULL) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    free(sp);
+    return 1;
   }
-  
-  fprintf(stderr, "%s: done!\n", argv[0]);
-  for(ix = 0; ix < s.nbits; ix++) {
-    if(S_ISSET(&s, ix)) {
-      printf("%ld\n", S_VAL(&s, ix));
+
+  nbytes = limit / 30 + 1;
+  for(lo = 0; lo < nbytes; lo += SEG_SIZE) {
+    hi = lo + SEG_SIZE;
+    if(hi > nbytes)
+      hi = nbytes;
+
+    memset(seg, UCHAR_MAX, hi - lo);
+    if(lo == 0)
+      seg[0] &= ~1;   /* 1 is not prime */
+
+    cross_segment(seg, lo, hi, sp, np);
+
+    for(ix = 0; ix < hi - lo; ix++) {
+      if(!seg[ix])
+	continue;
+
+      for(jx = 0; jx < 8; jx++) {
+	if((seg[ix] >> jx) & 1) {
+	  val = 30 * (lo + ix) + wheel[jx];
+	  if(val > limit)
+	    break;
+	  printf("%ld\n", val);
+	  ++count;
+	}
+      }
     }
   }
 
-  sieve_clear(&s);
+  fprintf(stderr, "%s: done, %ld primes\n", argv[0], count);
 
-  return 0;
-}
+  free(seg);
+  free(sp);
 
-void sieve_init(sieve *sp, long base, int nbits)
-{
-  sp->size = (nbits / CHAR_BIT);
-
-  if(nbits % CHAR_BIT)
-    ++sp->size;
-
-  sp->bits = calloc(sp->size, sizeof(byte));
-  memset(sp->bits, UCHAR_MAX, sp->size);
-  if(!(base & 1))
-    ++base;
-  sp->base = base;
-  
-  sp->next = 0;
-  sp->nbits = sp->size * CHAR_BIT;
+  return 0;
 }
 
-void sieve_grow(sieve *sp, int nbits)
+/*
+  Find the primes from 7 up to the square root of limit, with a plain
+  byte-per-odd sieve, and set up their crossing-off state.  Returns
+  the number found, or -1 if memory runs out.
+ */
+long small_primes(long limit, sprime **out)
 {
-  int  ns = (nbits / CHAR_BIT);
+  byte   *odd;
+  long    root = 1, size, ix, jx, np = 0;
 
-  if(nbits % CHAR_BIT)
-    ++ns;
+  while((root + 1) * (root + 1) <= limit)
+    ++root;
 
-  if(ns > sp->size) {
-    byte   *tmp;
-    int     ix;
-
-    tmp = calloc(ns, sizeof(byte));
-    if(tmp == NULL) {
-      fprintf(stderr, "Error: out of memory in sieve_grow\n");
-      return;
-    }
-
-    memcpy(tmp, sp->bits, sp->size);
-    for(ix = sp->size; ix < ns; ix++) {
-      tmp[ix] = UCHAR_MAX;
-    }
-
-    free(sp->bits);
-    sp->bits = tmp;
-    sp->size = ns;
+  size = root / 2 + 1;          /* odd[ix] stands for 2ix + 1       */
+  if((odd = calloc(size, sizeof(byte))) == NULL)
+    return -1;
 
-    sp->nbits = sp->size * CHAR_BIT;
+  for(ix = 1; ix < size; ix++) {
+    if(odd[ix])
+      continue;
+    for(jx = 2 * ix * (ix + 1); jx < size; jx += 2 * ix + 1)
+      odd[jx] = 1;
   }
-}
 
-long sieve_next(sieve *sp)
-{
-  long out;
-  int  ix = 0;
-  long val;
+  for(ix = 3; ix < size; ix++)
+    if(!odd[ix])
+      ++np;
 
-  if(sp->next > sp->nbits)
+  if((*out = calloc(np ? np : 1, sizeof(sprime))) == NULL) {
+    free(odd);
     return -1;
+  }
 
-  out = S_VAL(sp, sp->next);
-#ifdef DEBUG
-  fprintf(stderr, "Sieving %ld\n", out);
-#endif
-
-  /* Sieve out all multiples of the current prime */
-  val = out;
-  while(ix < sp->nbits) {
-    val += out;
-    ix = S_BIT(sp, val);
-    if((val & 1) && ix < sp->nbits) { /* && S_ISSET(sp, ix)) { */
-      S_CLR(sp, ix);
-#ifdef DEBUG
-      fprintf(stderr, "Crossing out %ld (bit %d)\n", val, ix);
-#endif
+  np = 0;
+  for(ix = 3; ix < size; ix++) {
+    if(!odd[ix]) {
+      (*out)[np].prime = 2 * ix + 1;
+      seed_prime(&(*out)[np]);
+      ++np;
     }
   }
 
-  /* Scan ahead to the next prime */
-  ++sp->next;
-  while(sp->next < sp->nbits && !S_ISSET(sp, sp->next))
-    ++sp->next;
-
-  return out;
+  free(odd);
+  return np;
 }
 
-void sieve_cross(sieve *sp, long val)
+/* Compute the inverse of 30 modulo the prime p > 5                 */
+long inverse_30(long p)
 {
-  int  ix = 0;
-  long cur = val;
-
-  while(cur < sp->base)
-    cur += val;
-
-  ix = S_BIT(sp, cur);
-  while(ix < sp->nbits) {
-    if(cur & 1) 
-      S_CLR(sp, ix);
-    cur += val;
-    ix = S_BIT(sp, cur);
+  long  r0 = p, r1 = 30, t0 = 0, t1 = 1, q, tmp;
+
+  while(r1 != 0) {
+    q = r0 / r1;
+    tmp = r0 - q * r1; r0 = r1; r1 = tmp;
+    tmp = t0 - q * t1; t0 = t1; t1 = tmp;
   }
+
+  return (t0 < 0) ? t0 + p : t0;
 }
 
-void sieve_reset(sieve *sp, long base)
+/*
+  For each residue w, find the first byte k such that 30k + w is a
+  multiple of p no smaller than p^2 (anything smaller has a smaller
+  prime factor, and p itself must not be crossed off).
+ */
+void seed_prime(sprime *sp)
 {
-  memset(sp->bits, UCHAR_MAX, sp->size);
-  sp->base = base;
-  sp->next = 0;
+  long  p = sp->prime, inv = inverse_30(p), kx, first;
+  int   ix;
+
+  first = (p * p) / 30;
+  for(ix = 0; ix < 8; ix++) {
+    kx = ((p - wheel[ix] % p) % p) * inv % p;
+    if(kx < first)
+      kx += ((first - kx + p - 1) / p) * p;
+    while(30 * kx + wheel[ix] < p * p)
+      kx += p;
+    sp->next[ix] = kx;
+  }
 }
 
-void sieve_clear(sieve *sp)
+/* Cross off bytes [lo, hi) of the range; seg[0] is byte lo          */
+void cross_segment(byte *seg, long lo, long hi, sprime *sp, long np)
 {
-  if(sp->bits) 
-    free(sp->bits);
-
-  sp->bits = NULL;
+  long  px, kx, p;
+  int   ix;
+  byte  mask;
+
+  for(px = 0; px < np; px++) {
+    p = sp[px].prime;
+    if(p * p >= 30 * hi)
+      break;
+
+    for(ix = 0; ix < 8; ix++) {
+      mask = ~(1 << ix);
+      for(kx = sp[px].next[ix]; kx < hi; kx += p)
+	seg[kx - lo] &= mask;
+      sp[px].next[ix] = kx;
+    }
+  }
 }
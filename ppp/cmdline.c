@@ -54,9 +54,15 @@ int fPasscode = 0;
 int fPasscodeCurr = 0;
 int fVerbose = 0;
 int fUseVersion = 0;
+int fImport = 0;
+int fExport = 0;
+int fStore = 0;
+int fStats = 0;
 int numCards = 0;
 static char passphrase[1024] = "";
 static char passcode[1024] = "";
+static char store[128] = PPP_STORE_PATH;
+static char stats[128] = PPP_STATS_PATH;
 static char hname[40] = "";
 static char *pn = NULL;
 
@@ -138,6 +144,15 @@ void usage() {
 		"                     **DANGER** To avoid DoS attacks use requisite instead\n"
 		"  --showPasscode     Used with --key to specify that on authentication, system\n"
 		"                     will display passcode as it is typed.\n"
+		"  --import           Copy the key and counters from ~/.pppauth into the\n"
+		"                     system-wide store.\n"
+		"  --export           Copy the key and counters from the system-wide store\n"
+		"                     into ~/.pppauth.\n"
+		"  --store <path>     The store used by --import and --export\n"
+		"                     (default " PPP_STORE_PATH ").\n"
+		"  --stats[=<path>]   Show how logins have fared getting the lock, and how\n"
+		"                     long they took, from the statistics kept by pam_ppp\n"
+		"                     (default " PPP_STATS_PATH ").\n"
 		"  -v, --verbose      Display more information about what is happening.\n"
 		/* -u, --useVersion <N>              UNDOCUMENT feature used only for testing */
 		, progname()
@@ -253,6 +268,10 @@ void processCommandLine(int argc, char *argv[]) {
 		{"showPasscode",	no_argument,		&fShowPasscode, 1},
 		{"verbose",		no_argument, 		0, 'v'},
 		{"useVersion",		required_argument,	0, 'u'},
+		{"import",		no_argument,		&fImport, 1},
+		{"export",		no_argument,		&fExport, 1},
+		{"store",		required_argument,	&fStore, 1},
+		{"stats",		optional_argument,	&fStats, 1},
 		{0, 0, 0, 0}
 	};
 
@@ -271,6 +290,14 @@ void processCommandLine(int argc, char *argv[]) {
 					strncpy(passphrase, optarg, 1023);
 					passphrase[1023] = '\x00';
 				}
+				if (strcmp(long_options[option_index].name, "store") == 0) {
+					strncpy(store, optarg, 127);
+					store[127] = '\x00';
+				}
+				if (strcmp(long_options[option_index].name, "stats") == 0 && optarg) {
+					strncpy(stats, optarg, 127);
+					stats[127] = '\x00';
+				}
 				if (strcmp(long_options[option_index].name, "next") == 0) {
 					/* fNext is already set, so do nothing */
 				}
@@ -397,10 +424,26 @@ void processCommandLine(int argc, char *argv[]) {
 	fTime = 0;
 	
 	/* validate the command line options */
-	if ( ! (fKey | fSkip | fHtml | fLatex | fText | fTime) ) {
+	if ( ! (fKey | fSkip | fHtml | fLatex | fText | fTime | fImport | fExport | fStats) ) {
 		errorExitWithUsage("nothing to do!");
 	}
 
+	if ((fImport || fExport) && (fKey | fSkip | fHtml | fLatex | fText | fPassphrase)) {
+		errorExitWithUsage("`--import' and `--export' must be used on their own");
+	}
+
+	if (fStats && (fKey | fSkip | fHtml | fLatex | fText | fPassphrase | fImport | fExport)) {
+		errorExitWithUsage("`--stats' must be used on its own");
+	}
+
+	if (fStore && !(fImport || fExport)) {
+		errorExitWithUsage("`--store' is only used with `--import' or `--export'");
+	}
+
+	if (fImport && fExport) {
+		errorExitWithUsage("cannot specify `--import' and `--export' together");
+	}
+
 	if (fPasscode && fCard) {
 		errorExitWithUsage("cannot specify `--passcode' and `--card' together");
 	} 
@@ -421,7 +464,7 @@ void processCommandLine(int argc, char *argv[]) {
 		errorExitWithUsage("must specify which card(s) to generate with `--next' or `--card'");
 	}
 	
-	if ( ! (keyfileExists() || fKey || fPassphrase) ) {
+	if ( ! (keyfileExists() || fKey || fPassphrase || fExport) ) {
 		errorExitWithUsage("must create a sequence key with `--key' or use a `--passphrase'");
 	}
 
@@ -462,6 +505,14 @@ char *getPassphrase() {
 	return passphrase;
 }
 
+char *getStorePath() {
+	return store;
+}
+
+char *getStatsPath() {
+	return stats;
+}
+
 void clCleanup() {
 	mp_clear(&cardNum);
 }
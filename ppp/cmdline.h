@@ -50,6 +50,10 @@ extern int fPasscode;
 extern int fPasscodeCurr;
 extern int fVerbose;
 extern int fUseVersion;
+extern int fImport;
+extern int fExport;
+extern int fStore;
+extern int fStats;
 extern int numCards;
 
 extern mp_int cardNum;
@@ -65,6 +69,8 @@ void errorExitWithUsage(char *msg);
 void errorExit(char *msg);
 void errorMessage(char *msg);
 char *getPassphrase();
+char *getStorePath();
+char *getStatsPath();
 void usage();
 
 #endif
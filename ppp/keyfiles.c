@@ -26,6 +26,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* F_OFD_SETLK and friends */
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,8 +36,15 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <pwd.h>
 #include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 #include "ppp.h"
 
@@ -42,16 +52,345 @@
 #include "cmdline.h"
 
 #include "keyfiles.h"
-
-static const char *private_key_file_name = "/private_key";
-static const char *private_count_file_name = "/private_cnt";
-static const char *private_generated_file_name = "/private_gen";
-static const char *private_lock_file_name = "/lock";
-static const char *private_key_dir = "/.pppauth";
+#include "trace.h"
+
+static const char *private_key_file_name = "private_key";
+static const char *private_count_file_name = "private_cnt";
+static const char *private_generated_file_name = "private_gen";
+static const char *private_lock_file_name = "lock";
+static const char *private_state_file_name = "private_state";
+static const char *private_journal_file_name = "private_journal";
+static const char *private_old_journal_file_name = "private_journal.old";
+static const char *private_key_dir = ".pppauth";
 static char userhome[128] = "";
+
+/* ~/.pppauth, once opened; see _key_dir() */
+static int key_dir_fd = -1;
+static uid_t key_dir_uid;
+static gid_t key_dir_gid;
 static int lock_fd = -1;
 int lockingFailed = 0;
 
+/* Binary state file (data format 3).
+ *
+ * One fixed-size record holds everything the three legacy files
+ * (private_key, private_cnt and private_gen) do.  Integers are
+ * little-endian; the numbers are unsigned little-endian magnitudes.
+ * The file holds two copies of the record, at 0 and STATE_SIZE, as a
+ * slot in the store does: a write goes over the older copy with the
+ * next epoch, so the file can be updated in place through the locked
+ * descriptor and a crash still leaves one good copy.
+ *
+ *   0   magic "PPPS"
+ *   4   data format (16 bits)
+ *   6   key version (16 bits)
+ *   8   flags (32 bits)
+ *  12   state bits (32 bits)
+ *  16   sequence key (48 bytes)
+ *  64   current passcode number (24 bytes)
+ *  88   last card generated (24 bytes)
+ * 112   journal epoch (32 bits)
+ * 116   reserved, zero
+ * 124   CRC-32 of bytes 0 to 123
+ */
+#define STATE_FORMAT		3
+#define STATE_SIZE			PPP_STATE_SIZE
+#define STATE_OFF_FORMAT	4
+#define STATE_OFF_VERSION	6
+#define STATE_OFF_FLAGS		8
+#define STATE_OFF_BITS		12
+#define STATE_OFF_KEY		PPP_STATE_OFF_KEY
+#define STATE_OFF_CNT		64
+#define STATE_OFF_GEN		88
+#define STATE_OFF_EPOCH		112
+#define STATE_OFF_CRC		124
+#define STATE_KEY_SIZE		PPP_STATE_KEY_SIZE
+#define STATE_NUM_SIZE		24
+
+/* state bits */
+#define STATE_GEN_NEGATIVE	0x0001	/* no card printed yet (-1) */
+
+/* Counter journal.
+ *
+ * Rather than replace the state file each time a counter changes,
+ * writeStateEvent() appends a fixed-size record holding the new
+ * counters to private_journal; readKeyFile() takes the counters from
+ * the last good record.  Records are only honoured if their epoch
+ * matches the state file's, so a journal left over from before the
+ * last compaction or a new key is ignored.  Once the journal holds
+ * JOURNAL_COMPACT records, the counters are written to the state file
+ * under a new epoch, and the journal becomes private_journal.old,
+ * which keeps the previous stretch of the audit trail.
+ *
+ *   0   magic "PPPJ"
+ *   4   event (16 bits), JOURNAL_NOTE set if the counters are
+ *       for information only
+ *   6   state bits (16 bits)
+ *   8   time (64 bits)
+ *  16   epoch (32 bits)
+ *  20   current passcode number (20 bytes); for a note, the
+ *       passcode number the event concerns, which the counter
+ *       read back is always taken past
+ *  40   last card generated (20 bytes)
+ *  60   CRC-32 of bytes 0 to 59
+ */
+#define JOURNAL_SIZE		64
+#define JOURNAL_OFF_EVENT	4
+#define JOURNAL_OFF_BITS	6
+#define JOURNAL_OFF_TIME	8
+#define JOURNAL_OFF_EPOCH	16
+#define JOURNAL_OFF_CNT		20
+#define JOURNAL_OFF_GEN		40
+#define JOURNAL_OFF_CRC		60
+#define JOURNAL_NUM_SIZE	20
+#define JOURNAL_NOTE		0x8000
+#define JOURNAL_COMPACT		128
+
+/* The record as last read or written; writeState() updates the
+ * counters in it and writes it back, leaving the key alone. */
+static unsigned char state_rec[STATE_SIZE];
+static int state_valid = 0;
+static int state_from_legacy = 0;
+
+/* How hard to try to get the state onto disk; see setDurability() */
+static int durability = PPP_SYNC_FULL;
+
+/* Locking.
+ *
+ * The lock is an open file description lock on the state file (or on
+ * the user's slot in the store), so that it is neither shared by the
+ * threads of a process nor lost when some other descriptor for the
+ * file is closed.  A lock that is held is tried again after pauses
+ * that double from LOCK_PAUSE_MIN to LOCK_PAUSE_MAX microseconds, for
+ * up to lock_timeout milliseconds.  Without OFD locks, the classic
+ * per-process locks are used instead.
+ */
+#ifdef F_OFD_SETLK
+#define LOCK_NOWAIT		F_OFD_SETLK
+#define LOCK_WAIT		F_OFD_SETLKW
+#else
+#define LOCK_NOWAIT		F_SETLK
+#define LOCK_WAIT		F_SETLKW
+#endif
+#define LOCK_PAUSE_MIN		50
+#define LOCK_PAUSE_MAX		5000
+
+static long lock_timeout = PPP_LOCK_TIMEOUT;
+static int lock_required = 0;
+
+/* Optimistic updates; see setOptimistic().  The version of the state
+ * as read is the epoch of the record together with the journal applied
+ * on top of it, by inode and length: the journal only grows within an
+ * epoch, and a new epoch starts a new one.  The inode matters because
+ * compaction writes the new epoch before it sets the old journal
+ * aside, so a read in between pairs the new epoch with the old file. */
+static int optimistic = 0;
+static unsigned long read_epoch = 0;
+static off_t read_journal = 0;
+static ino_t read_journal_ino = 0;
+
+/* Lock statistics.
+ *
+ * With setLockStats(), every lock taken is counted in a small file
+ * shared through memory, for the administrator to read with
+ * pppauth --stats.  The file holds STATS_COUNTERS 64-bit counters
+ * after a 16-byte header (magic "PPPT", format (16 bits) at 4), in
+ * the order of struct ppp_lock_stats.  Format 3 adds the login
+ * timings (see setTiming()): for each phase, in the order of the
+ * PPP_PHASE_ numbers, a struct ppp_phase_stats.  Format 2 files are
+ * grown into format 3 in place; their counters stay where they are.
+ */
+#define STATS_FORMAT		3
+#define STATS_HDR_SIZE		16
+#define STATS_COUNTERS		7
+#define STATS_COUNTERS_SIZE	(STATS_HDR_SIZE + STATS_COUNTERS * 8)
+#define STATS_PHASE_WORDS	(3 + PPP_TIMING_BUCKETS)
+#define STATS_SIZE		(STATS_COUNTERS_SIZE + PPP_PHASES * STATS_PHASE_WORDS * 8)
+#define STATS_ACQUIRED		0
+#define STATS_CONTENDED		1
+#define STATS_TIMEOUTS		2
+#define STATS_ERRORS		3
+#define STATS_WAIT_US		4
+#define STATS_MAX_WAIT_US	5
+#define STATS_CONFLICTS		6
+
+static char stats_path[128] = "";
+static uint64_t *stats_map = NULL;
+
+/* Login timings: the time of the last timingPhase(), the lock waits
+ * since then, and the time spent so far in each phase */
+static int timing = 0;
+static struct timespec timing_mark;
+static uint64_t timing_lock_us = 0;
+static uint64_t timing_us[PPP_PHASES];
+static unsigned int timing_seen = 0;
+
+/* System-wide store.
+ *
+ * With setStore(), the state lives in one file shared by all users
+ * instead of ~/.pppauth, so that logins need not touch home
+ * directories at all.  The file is mapped into memory; after a header
+ * comes a fixed table of slots, found by hashing the uid and probing
+ * linearly.  A slot holds two copies of the usual state record; an
+ * update overwrites the older copy with a higher epoch, so a crash
+ * part way through leaves the other copy intact.  Logins lock just
+ * their own slot, and slots are only ever added, under a lock on the
+ * header.
+ *
+ * Header:
+ *   0   magic "PPPD"
+ *   4   store format (16 bits)
+ *   8   number of slots (32 bits)
+ *  12   slot size (32 bits)
+ *  60   CRC-32 of bytes 0 to 59
+ *
+ * Slot:
+ *   0   uid (32 bits)
+ *   4   in use (32 bits)
+ *   8   user name (56 bytes, for the administrator's benefit)
+ *  64   state record, first copy
+ * 192   state record, second copy
+ */
+#define STORE_FORMAT		1
+#define STORE_HDR_SIZE		64
+#define STORE_OFF_SLOTS		8
+#define STORE_OFF_SLOTSIZE	12
+#define STORE_OFF_CRC		60
+#define STORE_SLOT_SIZE		320
+#define STORE_SLOT_USED		4
+#define STORE_SLOT_NAME		8
+#define STORE_NAME_SIZE		56
+#define STORE_SLOT_COPY		64
+#define STORE_SLOTS		4096
+
+static char store_path[128] = "";
+static char store_user[STORE_NAME_SIZE] = "";
+static int store_fd = -1;
+static unsigned char *store_map = NULL;
+static size_t store_len = 0;
+static unsigned long store_nslots = 0;
+static unsigned char *store_slot = NULL;
+
+/* Reservation table.
+ *
+ * With setReserveTable(), concurrent logins get their passcode numbers
+ * from a small table shared through memory instead of reserving them
+ * under the lock with a write of the state.  Each account has a slot,
+ * tagged with a hash of its uid and key (so a new key gets a new slot),
+ * whose next number is handed out with an atomic compare-and-swap; the
+ * state only needs to catch up, under the lock, once a passcode has
+ * been accepted.  The table is lost on reboot, so each passcode handed
+ * out is also recorded once it has been tried: a failure as a note in
+ * the journal (or, with the store, as an update of the state), which
+ * reading the state takes into account.
+ *
+ * Header (64 bytes): magic "PPPR", format (16 bits) at 4, number of
+ * slots (32 bits) at 8.  Slot (32 bytes): tag, next number to hand
+ * out, highest number known to be in the state, all 64 bits.
+ */
+#define RESV_FORMAT		1
+#define RESV_HDR_SIZE		64
+#define RESV_SLOTS		1024
+#define RESV_PROBES		16
+
+struct resv_slot {
+	uint64_t tag;
+	uint64_t next;
+	uint64_t persisted;
+	uint64_t unused;
+};
+
+static char resv_path[128] = "";
+static unsigned char *resv_map = NULL;
+static struct resv_slot *resv_slot = NULL;
+
+/* User lookups.
+ *
+ * Users are looked up with getpwnam_r().  With setUserCache(), the
+ * answers are also kept for a while, in the process and in a table
+ * shared through memory, so that most logins needn't ask NSS (which
+ * may be LDAP or sssd) at all.  Users that don't exist are kept too,
+ * so that guessing at user names costs next to nothing.  The table is
+ * an array of slots indexed by a hash of the name; a slot being
+ * written has an odd sequence number, and a reader that sees it
+ * change ignores what it read.
+ *
+ * Header (64 bytes): magic "PPPU", format (16 bits) at 4, number of
+ * slots (32 bits) at 8.  Slot (128 bytes): sequence (32 bits), uid (32
+ * bits), expiry time (64 bits), whether the user exists (32 bits), 4
+ * bytes unused, name (40 bytes), home directory (64 bytes); both
+ * NUL-terminated, so longer ones aren't kept.
+ */
+#define USERS_FORMAT		1
+#define USERS_HDR_SIZE		64
+#define USERS_SLOTS		1024
+#define USERS_NAME_SIZE		40
+#define USERS_HOME_SIZE		64
+#define USERS_LOCAL		16
+
+struct user_entry {
+	uint32_t seq;
+	uint32_t uid;
+	uint64_t expires;
+	uint32_t known;
+	uint32_t unused;
+	char name[USERS_NAME_SIZE];
+	char home[USERS_HOME_SIZE];
+};
+
+static int users_cache = 0;
+static char users_path[128] = "";
+static long users_ttl = PPP_USER_CACHE_TTL;
+static struct user_entry *users_map = NULL;
+static struct user_entry users_local[USERS_LOCAL];
+static int users_next = 0;
+
+/* Rate limits.
+ *
+ * With setRateLimit(), each uid has a budget of failed logins, kept in
+ * a table shared through memory: a token bucket holding limit_burst
+ * tries, with one coming back every limit_interval seconds.  A login
+ * takes a token before it reads anything of the user's, and gives it
+ * back unless it fails, so that once an account's budget is spent
+ * guessing at it costs neither disk writes nor printed passcodes.  A
+ * bucket is kept as the time at which it will be full again, so that
+ * taking and giving back are each a single compare-and-swap.
+ *
+ * Header (64 bytes): magic "PPPL", format (16 bits) at 4, number of
+ * slots (32 bits) at 8.  Slot (16 bytes): uid + 1, or 0 if free; time
+ * the bucket is full again, in milliseconds since the epoch; both 64
+ * bits.
+ */
+#define LIMIT_FORMAT		1
+#define LIMIT_HDR_SIZE		64
+#define LIMIT_SLOTS		4096
+#define LIMIT_PROBES		16
+
+struct limit_slot {
+	uint64_t key;
+	uint64_t full;
+};
+
+static char limit_path[128] = "";
+static unsigned char *limit_map = NULL;
+static struct limit_slot *limit_taken = NULL;
+static int limit_burst = PPP_RATELIMIT_BURST;
+static long limit_interval = PPP_RATELIMIT_INTERVAL;
+
+/* The user given to setUser() */
+static int user_known = 0;
+static uid_t user_uid;
+
+/* State daemon; see setDaemon() and pppstated.c */
+static char daemon_path[108] = "";
+static int daemon_fd = -1;
+static int daemon_locked = 0;
+
+#ifdef OS_IS_MACOSX
+/* No fdatasync() here; fsync() does at least as much */
+#define fdatasync(fd) fsync(fd)
+#endif
+
 static char *_home_dir() {
 	static struct passwd *pwdata = NULL;
 	const char *env;
@@ -75,417 +414,2125 @@ static char *_home_dir() {
 	}
 
 
-	return NULL;
+	return NULL;
+}
+
+static char *_key_file_dir() {
+	static char fname[128];
+
+	/* Not kept, as the user may change */
+	snprintf(fname, sizeof(fname), "%s/%s", _home_dir(), private_key_dir);
+	return fname;
+}
+
+/* Open ~/.pppauth, creating it if asked.  Everything in it is then
+ * reached relative to the one descriptor, so the path is looked up
+ * once and the directory can't be swapped for a link between one
+ * access and the next.  Its owner and mode are checked here, once: the
+ * directory must belong to the user (or whoever runs this) and is made
+ * private if it isn't already.  Returns the descriptor, or -1. */
+static int _key_dir(int create) {
+	struct stat hst, st;
+	char *home;
+	int hfd, fd;
+
+	if (key_dir_fd >= 0)
+		return key_dir_fd;
+
+	home = _home_dir();
+	if (home == NULL)
+		return -1;
+	hfd = open(home, O_RDONLY | O_DIRECTORY);
+	if (hfd < 0)
+		return -1;
+
+	fd = openat(hfd, private_key_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0 && errno == ENOENT && create) {
+		if (mkdirat(hfd, private_key_dir, S_IRWXU) == 0 || errno == EEXIST)
+			fd = openat(hfd, private_key_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	}
+
+	if (fd < 0 || fstat(hfd, &hst) < 0 || fstat(fd, &st) < 0
+	    || (st.st_uid != hst.st_uid && st.st_uid != geteuid())) {
+		if (fd >= 0)
+			close(fd);
+		close(hfd);
+		return -1;
+	}
+	close(hfd);
+
+	if ((st.st_mode & 0777) != S_IRWXU)
+		fchmod(fd, S_IRWXU);
+
+	key_dir_uid = st.st_uid;
+	key_dir_gid = st.st_gid;
+	key_dir_fd = fd;
+	return fd;
+}
+
+/* Whether a file in ~/.pppauth exists and is a regular file; with
+ * nonempty, whether it also holds something */
+static int _member_exists(const char *name, int nonempty) {
+	struct stat st;
+
+	if (_key_dir(0) < 0 || fstatat(key_dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return 0;
+	return S_ISREG(st.st_mode) && ( ! nonempty || st.st_size > 0);
+}
+
+/* Open a file in ~/.pppauth; it must be a regular file, and is made
+ * private if it isn't already */
+static int _member_open(const char *name, int flags) {
+	struct stat st;
+	int fd;
+
+	if (_key_dir(flags & O_CREAT) < 0)
+		return -1;
+
+	fd = openat(key_dir_fd, name, flags | O_NOFOLLOW, S_IRUSR|S_IWUSR);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if ((st.st_mode & 0777) != (S_IRUSR|S_IWUSR))
+		fchmod(fd, S_IRUSR|S_IWUSR);
+	return fd;
+}
+
+/* A file in ~/.pppauth must belong to the user.  One that root has
+ * only just created on the user's behalf is given to them; anything
+ * else that isn't theirs is refused, in case root is running this in
+ * a directory the user controls.  Returns 0 if the file can't be used. */
+static int _member_owned(int fd, const struct stat *st) {
+	if (st->st_uid == key_dir_uid)
+		return 1;
+	return st->st_size == 0 && geteuid() == 0
+	    && fchown(fd, key_dir_uid, key_dir_gid) == 0;
+}
+
+static FILE *_member_fopen(const char *name) {
+	FILE *fp;
+	int fd;
+
+	fd = _member_open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	fp = fdopen(fd, "r");
+	if (fp == NULL)
+		close(fd);
+	return fp;
+}
+
+/* Make a change in ~/.pppauth durable, if the durability asks for it */
+static void _key_dir_sync() {
+	if (durability >= PPP_SYNC_FULL && key_dir_fd >= 0)
+		fsync(key_dir_fd);
+}
+
+static int _ppp_version(char *buf) {
+	int ver = -1;
+
+	if (buf[0] != ' ')
+		return 1;
+
+	buf[4] = '\x00';
+	if (strncmp(buf, " PPP", 4) != 0) {
+		/* not a PPP file, so exit */
+		return -1;
+	}
+
+	buf[9] = '\x00';
+	if (sscanf(buf+5, "%04d", &ver) != 1)
+		return -1;
+
+	return ver;
+}
+
+static int _data_format(char *buf) {
+	int fmt = -1;
+
+	if (buf[0] != ' ') {
+		/* not a versioned file */
+		return 0;
+	}
+
+	buf[14] = '\x00';
+	if (sscanf(buf+10, "%04d", &fmt) != 1)
+		return -1;
+
+	return fmt;
+}
+
+static int _ppp_flags(char *buf) {
+	int flags = 0;
+
+	if (buf[0] != ' ') {
+		/* not a versioned file */
+		goto error;
+	}
+
+	if (strlen(buf+15) < 5) {
+		/* is not long enough to check for flags */
+		goto error;
+	}
+
+	if (buf[19] != ' ') {
+		/* file does not contain flags */
+		goto error;
+	}
+
+	buf[19] = '\x00';
+	if (sscanf(buf+15, "%04x", &flags) != 1)
+		goto error;
+
+	pppSetFlags(PPP_FLAGS_PRESENT);
+	return flags;
+
+error:
+	pppClearFlags(0xffff);
+	return 0;
+}
+
+/* Data formats 0 to 2 are the legacy text files, which are only read
+ * now; format 3 is the binary state file (see _read_state()). */
+static int _read_data(char *buf, mp_int *mp) {
+	mp_err ret;
+	switch (_data_format(buf)) {
+	case 0:
+		/* unversioned file, mpi radix 64 format */
+		mp_read_radix(mp, (unsigned char *)buf, 64);
+		return 1;
+	case 1:
+		/* versioned file, mpi radix 64 format */
+		/* Note:  This version should not be used.  The MPI
+		 *        library has a bug when using radix 64
+		 *        where it writes 63 as + and then assumes
+		 *        the plus is a sign indicator on read.
+		 */
+		if (pppCheckFlags(PPP_FLAGS_PRESENT))
+			ret = mp_read_radix(mp, (unsigned char *)(buf+20), 64);
+		else
+			ret = mp_read_radix(mp, (unsigned char *)(buf+15), 64);
+		break;
+	case 2:
+		/* versioned file, mpi radix 62 format */
+		if (pppCheckFlags(PPP_FLAGS_PRESENT))
+			ret = mp_read_radix(mp, (unsigned char *)(buf+20), 62);
+		else
+			ret = mp_read_radix(mp, (unsigned char *)(buf+15), 62);
+		break;
+	default:
+		/* Error while determining format */
+		return 0;
+	}
+
+	if (ret == MP_OKAY)
+		return 1;
+	else
+		return 0;
+}
+
+static unsigned long _crc32(const unsigned char *buf, int len) {
+	unsigned long crc = 0xffffffffUL;
+	int i, k;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320UL & (0 - (crc & 1)));
+	}
+	return crc ^ 0xffffffffUL;
+}
+
+static void _put_le(unsigned char *p, unsigned long v, int n) {
+	int i;
+
+	for (i = 0; i < n; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static unsigned long _get_le(const unsigned char *p, int n) {
+	unsigned long v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+/* Store the counters in state_rec and bring its CRC up to date */
+static int _state_set_counters(mp_int *cnt, mp_int *gen) {
+	unsigned long bits;
+	mp_int mag;
+
+	if (mp_to_fixlen_bin_le(cnt, state_rec + STATE_OFF_CNT, STATE_NUM_SIZE) != MP_OKAY)
+		return 0;
+
+	mp_init(&mag);
+	mp_abs(gen, &mag);
+	if (mp_to_fixlen_bin_le(&mag, state_rec + STATE_OFF_GEN, STATE_NUM_SIZE) != MP_OKAY) {
+		mp_clear(&mag);
+		return 0;
+	}
+	mp_clear(&mag);
+
+	bits = _get_le(state_rec + STATE_OFF_BITS, 4) & ~STATE_GEN_NEGATIVE;
+	if (mp_cmp_z(gen) < 0)
+		bits |= STATE_GEN_NEGATIVE;
+	_put_le(state_rec + STATE_OFF_BITS, bits, 4);
+
+	_put_le(state_rec + STATE_OFF_CRC, _crc32(state_rec, STATE_OFF_CRC), 4);
+	return 1;
+}
+
+/* Build a complete record in state_rec from the current PPP state */
+static int _state_build() {
+	memset(state_rec, 0, STATE_SIZE);
+	memcpy(state_rec, "PPPS", 4);
+	_put_le(state_rec + STATE_OFF_FORMAT, STATE_FORMAT, 2);
+	_put_le(state_rec + STATE_OFF_VERSION, keyVersion(), 2);
+	_put_le(state_rec + STATE_OFF_FLAGS, pppCheckFlags(0xffff) | PPP_FLAGS_PRESENT, 4);
+	_put_le(state_rec + STATE_OFF_EPOCH, time(NULL), 4);
+
+	if (mp_to_fixlen_bin_le(seqKey(), state_rec + STATE_OFF_KEY, STATE_KEY_SIZE) != MP_OKAY
+	    || ! _state_set_counters(currPasscodeNum(), lastCardGenerated())) {
+		memset(state_rec, 0, STATE_SIZE);
+		state_valid = 0;
+		return 0;
+	}
+
+	state_valid = 1;
+	return 1;
+}
+
+/* Open the lock statistics, creating them if need be */
+static int _stats_open() {
+	unsigned char hdr[STATS_HDR_SIZE];
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (stats_map)
+		return 1;
+
+	fd = open(stats_path, O_RDWR | O_CREAT | O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0)
+		return 0;
+
+	/* Readable by all, but only ever written by whoever made it */
+	if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode) || st.st_uid != geteuid()
+	    || (st.st_mode & (S_IWGRP|S_IWOTH)) != 0) {
+		close(fd);
+		return 0;
+	}
+
+	/* An older version's file just gets longer, so that logins
+	 * still using it carry on counting */
+	if (st.st_size == 0 || st.st_size == STATS_COUNTERS_SIZE) {
+		memset(hdr, 0, STATS_HDR_SIZE);
+		if (st.st_size == 0 || pread(fd, hdr, STATS_HDR_SIZE, 0) != STATS_HDR_SIZE)
+			memcpy(hdr, "PPPT", 4);
+		_put_le(hdr + 4, STATS_FORMAT, 2);
+		if (ftruncate(fd, STATS_SIZE) != 0 || pwrite(fd, hdr, 8, 0) != 8) {
+			close(fd);
+			return 0;
+		}
+	} else if (st.st_size != STATS_SIZE) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, STATS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	if (memcmp(map, "PPPT", 4) != 0 || _get_le((unsigned char *)map + 4, 2) != STATS_FORMAT) {
+		munmap(map, STATS_SIZE);
+		return 0;
+	}
+
+	stats_map = (uint64_t *)((unsigned char *)map + STATS_HDR_SIZE);
+	return 1;
+}
+
+/* Count a lock taken, or not; waited is how long it was waited for */
+static void _stats_count(int counter, uint64_t waited) {
+	uint64_t max;
+
+	if (strlen(stats_path) == 0 || ! _stats_open())
+		return;
+
+	__atomic_add_fetch(&stats_map[counter], 1, __ATOMIC_RELAXED);
+	if (waited == 0)
+		return;
+
+	__atomic_add_fetch(&stats_map[STATS_CONTENDED], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats_map[STATS_WAIT_US], waited, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&stats_map[STATS_MAX_WAIT_US], __ATOMIC_RELAXED);
+	while (max < waited && ! __atomic_compare_exchange_n(&stats_map[STATS_MAX_WAIT_US],
+	    &max, waited, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Histogram bucket for a time: four to each power of two, so that
+ * a bucket is never more than a quarter wider than its start */
+static int _timing_bucket(uint64_t us) {
+	int b = 0;
+
+	if (us < 4)
+		return us;
+	while ((us >> b) >= 8)
+		b++;
+	if (b >= PPP_TIMING_BUCKETS / 4 - 1)
+		return PPP_TIMING_BUCKETS - 1;
+	return 4 * (b + 1) + (int)((us >> b) & 3);
+}
+
+/* The shortest time in a bucket */
+static uint64_t _timing_bucket_start(int bucket) {
+	if (bucket < 4)
+		return bucket;
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static void _stats_time(int phase, uint64_t us) {
+	uint64_t *p, max;
+
+	if (strlen(stats_path) == 0 || ! _stats_open())
+		return;
+
+	p = stats_map + STATS_COUNTERS + phase * STATS_PHASE_WORDS;
+	__atomic_add_fetch(&p[0], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p[1], us, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&p[2], __ATOMIC_RELAXED);
+	while (max < us && ! __atomic_compare_exchange_n(&p[2], &max, us, 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	__atomic_add_fetch(&p[3 + _timing_bucket(us)], 1, __ATOMIC_RELAXED);
+}
+
+/* Take a write lock on part of a file, waiting for it up to
+ * lock_timeout; returns 1 if it was taken.  The wait is a series of
+ * tries with growing pauses in between, rather than a blocking
+ * fcntl() broken off by a timer, since signals and interval timers
+ * belong to the process hosting the module, and are shared by all of
+ * its threads. */
+static int _lock_range(int fd, off_t start, off_t len) {
+	struct flock fl;
+	struct timespec t0, t1, pause;
+	uint64_t waited = 0, limit, delay = LOCK_PAUSE_MIN;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+
+	PPP_TRACE1(lock_attempt, userUid());
+	if (fcntl(fd, LOCK_NOWAIT, &fl) == 0) {
+		_stats_count(STATS_ACQUIRED, 0);
+		PPP_TRACE2(lock_acquire, userUid(), 0);
+		return 1;
+	}
+	if (errno != EAGAIN && errno != EACCES) {
+		_stats_count(STATS_ERRORS, 0);
+		return 0;
+	}
+	if (lock_timeout <= 0) {
+		_stats_count(STATS_TIMEOUTS, 0);
+		PPP_TRACE2(lock_timeout, userUid(), 0);
+		return 0;
+	}
+
+	limit = (uint64_t)lock_timeout * 1000;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (;;) {
+		if (delay > limit - waited)
+			delay = limit - waited;
+		pause.tv_sec = delay / 1000000;
+		pause.tv_nsec = (delay % 1000000) * 1000;
+		nanosleep(&pause, NULL);
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		waited = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+		if (waited == 0)
+			waited = 1;
+
+		if (fcntl(fd, LOCK_NOWAIT, &fl) == 0) {
+			timing_lock_us += waited;
+			_stats_count(STATS_ACQUIRED, waited);
+			PPP_TRACE2(lock_acquire, userUid(), waited);
+			return 1;
+		}
+		if (errno != EAGAIN && errno != EACCES) {
+			timing_lock_us += waited;
+			_stats_count(STATS_ERRORS, waited);
+			return 0;
+		}
+		if (waited >= limit)
+			break;
+		if (delay < LOCK_PAUSE_MAX)
+			delay *= 2;
+	}
+
+	timing_lock_us += waited;
+	_stats_count(STATS_TIMEOUTS, waited);
+	PPP_TRACE2(lock_timeout, userUid(), waited);
+	errno = EAGAIN;
+	return 0;
+}
+
+/* Open the state file for reading and writing, creating it empty if
+ * need be.  Refuses a file that isn't the user's own. */
+static int _state_open() {
+	struct stat st;
+	int fd;
+
+	if (_key_dir(0) < 0)
+		return -1;
+
+	fd = _member_open(private_state_file_name, O_RDWR | O_CREAT);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_nlink != 1 || ! _member_owned(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* The newer of two consecutive copies of a state record that pass
+ * their checks, or NULL if neither does */
+static unsigned char *_state_copy(unsigned char *copies) {
+	unsigned char *c[2];
+	int i, ok[2];
+
+	for (i = 0; i < 2; i++) {
+		c[i] = copies + i * STATE_SIZE;
+		ok[i] = memcmp(c[i], "PPPS", 4) == 0
+		    && _get_le(c[i] + STATE_OFF_CRC, 4) == _crc32(c[i], STATE_OFF_CRC);
+	}
+
+	if (ok[0] && ok[1])
+		return (long)(int)(_get_le(c[1] + STATE_OFF_EPOCH, 4)
+		    - _get_le(c[0] + STATE_OFF_EPOCH, 4)) > 0 ? c[1] : c[0];
+	return ok[0] ? c[0] : ok[1] ? c[1] : NULL;
+}
+
+/* Write state_rec to the state file, over the older of its two copies
+ * and with the next epoch.  The locked descriptor is used if there is
+ * one; otherwise the file is locked for the write, though the write
+ * goes ahead regardless, as only pppauth and --export get here without
+ * the lock.  How much is synced depends on the durability. */
+static int _state_write() {
+	unsigned char buf[2 * STATE_SIZE], *cur;
+	off_t off = 0;
+	ssize_t n;
+	int fd, ok;
+
+	if (lock_fd >= 0 && lock_fd != store_fd)
+		fd = lock_fd;
+	else {
+		fd = _state_open();
+		if (fd < 0)
+			return 0;
+		_lock_range(fd, 0, 0);
+	}
+
+	memset(buf, 0, sizeof(buf));
+	n = pread(fd, buf, sizeof(buf), 0);
+	cur = n >= STATE_SIZE ? _state_copy(buf) : NULL;
+	if (cur) {
+		_put_le(state_rec + STATE_OFF_EPOCH, _get_le(cur + STATE_OFF_EPOCH, 4) + 1, 4);
+		if (cur == buf)
+			off = STATE_SIZE;
+	}
+	_put_le(state_rec + STATE_OFF_CRC, _crc32(state_rec, STATE_OFF_CRC), 4);
+	memset(buf, 0, sizeof(buf));
+
+	ok = pwrite(fd, state_rec, STATE_SIZE, off) == STATE_SIZE
+	    && (durability < PPP_SYNC_DATA || fdatasync(fd) == 0);
+
+	/* A new file is only durable once its directory entry is */
+	if (ok && n <= 0)
+		_key_dir_sync();
+
+	/* Closing our own descriptor drops its lock */
+	if (fd != lock_fd)
+		close(fd);
+	return ok;
+}
+
+/* Once the state file is written, the legacy files are stale; remove
+ * them so that an older pppauth can't pick up an old counter.  The
+ * lock file went the same way, as the state file is locked now. */
+static void _remove_legacy_files() {
+	if (_key_dir(0) < 0)
+		return;
+	unlinkat(key_dir_fd, private_key_file_name, 0);
+	unlinkat(key_dir_fd, private_count_file_name, 0);
+	unlinkat(key_dir_fd, private_generated_file_name, 0);
+	unlinkat(key_dir_fd, private_lock_file_name, 0);
+}
+
+/* Remove both journals, once a new state leaves them behind */
+static void _remove_journals() {
+	if (_key_dir(0) < 0)
+		return;
+	unlinkat(key_dir_fd, private_journal_file_name, 0);
+	unlinkat(key_dir_fd, private_old_journal_file_name, 0);
+}
+
+/* Fill in a journal record for the given event and numbers */
+static int _journal_record(unsigned char *rec, int event, mp_int *cnt, mp_int *gen) {
+	mp_int mag;
+	int ok;
+
+	memset(rec, 0, JOURNAL_SIZE);
+	memcpy(rec, "PPPJ", 4);
+	_put_le(rec + JOURNAL_OFF_EVENT, event, 2);
+	_put_le(rec + JOURNAL_OFF_BITS, mp_cmp_z(gen) < 0 ? STATE_GEN_NEGATIVE : 0, 2);
+	_put_le(rec + JOURNAL_OFF_TIME, time(NULL), 8);
+	memcpy(rec + JOURNAL_OFF_EPOCH, state_rec + STATE_OFF_EPOCH, 4);
+
+	mp_init(&mag);
+	mp_abs(gen, &mag);
+	ok = mp_to_fixlen_bin_le(cnt, rec + JOURNAL_OFF_CNT, JOURNAL_NUM_SIZE) == MP_OKAY
+	    && mp_to_fixlen_bin_le(&mag, rec + JOURNAL_OFF_GEN, JOURNAL_NUM_SIZE) == MP_OKAY;
+	mp_clear(&mag);
+
+	_put_le(rec + JOURNAL_OFF_CRC, _crc32(rec, JOURNAL_OFF_CRC), 4);
+	return ok;
+}
+
+/* Append a record to the journal; returns the number of records it
+ * now holds, or 0 on failure. */
+static int _journal_append(const unsigned char *rec) {
+	struct stat st;
+	int fd, n;
+
+	fd = _member_open(private_journal_file_name, O_WRONLY | O_APPEND | O_CREAT);
+	if (fd < 0)
+		return 0;
+
+	/* Drop a record torn by a crash, so that this one lines up.  A
+	 * journal created by root is given to the user, or their own
+	 * pppauth couldn't read it back. */
+	if (fstat(fd, &st) < 0 || st.st_nlink != 1 || ! _member_owned(fd, &st)
+	    || (st.st_size % JOURNAL_SIZE != 0
+	        && ftruncate(fd, st.st_size -= st.st_size % JOURNAL_SIZE) != 0)
+	    || write(fd, rec, JOURNAL_SIZE) != JOURNAL_SIZE
+	    || (durability >= PPP_SYNC_DATA && fdatasync(fd) != 0)) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	/* A new journal is only durable once its directory entry is */
+	if (st.st_size == 0)
+		_key_dir_sync();
+
+	n = st.st_size / JOURNAL_SIZE + 1;
+	return n;
+}
+
+/* Fold the counters into the state file under a new epoch, and set the
+ * journal aside; its records no longer apply. */
+static int _journal_compact() {
+	if ( ! _state_write())
+		return 0;
+
+	renameat(key_dir_fd, private_journal_file_name, key_dir_fd, private_old_journal_file_name);
+	return 1;
+}
+
+/* Apply the counters from the last good record of the current epoch
+ * in the journal, if there is one.  Returns 0 if there is a journal
+ * but it can't be read: the state file alone may then be behind, and
+ * must not be used, let alone written back. */
+static int _journal_replay() {
+	unsigned char *buf, *rec;
+	struct stat st;
+	off_t len;
+	mp_int num, past;
+	int fd, changed = 0;
+
+	read_journal = 0;
+	read_journal_ino = 0;
+	fd = _member_open(private_journal_file_name, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT;
+
+	/* Only the tail matters; a torn record at the very end is
+	 * skipped along with any of the wrong epoch */
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return 0;
+	}
+	read_journal_ino = st.st_ino;
+	if (st.st_size < JOURNAL_SIZE) {
+		close(fd);
+		return 1;
+	}
+	len = st.st_size - st.st_size % JOURNAL_SIZE;
+	read_journal = len;
+	if (len > 2 * JOURNAL_COMPACT * JOURNAL_SIZE)
+		len = 2 * JOURNAL_COMPACT * JOURNAL_SIZE;
+
+	buf = malloc(len);
+	if (buf == NULL || pread(fd, buf, len, st.st_size - st.st_size % JOURNAL_SIZE - len) != len) {
+		free(buf);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	/* A passcode named in a note since the last update has been
+	 * offered or used, so the counter must be past it */
+	mp_init(&num);
+	mp_init(&past);
+	for (rec = buf + len - JOURNAL_SIZE; rec >= buf; rec -= JOURNAL_SIZE) {
+		if (memcmp(rec, "PPPJ", 4) != 0
+		    || _get_le(rec + JOURNAL_OFF_CRC, 4) != _crc32(rec, JOURNAL_OFF_CRC)
+		    || memcmp(rec + JOURNAL_OFF_EPOCH, state_rec + STATE_OFF_EPOCH, 4) != 0)
+			continue;
+
+		mp_read_unsigned_bin_le(&num, rec + JOURNAL_OFF_CNT, JOURNAL_NUM_SIZE);
+		if (_get_le(rec + JOURNAL_OFF_EVENT, 2) & JOURNAL_NOTE) {
+			mp_add_d(&num, 1, &num);
+			if (mp_cmp(&num, &past) > 0)
+				mp_copy(&num, &past);
+			continue;
+		}
+
+		setCurrPasscodeNum(&num);
+		mp_read_unsigned_bin_le(&num, rec + JOURNAL_OFF_GEN, JOURNAL_NUM_SIZE);
+		if (_get_le(rec + JOURNAL_OFF_BITS, 2) & STATE_GEN_NEGATIVE)
+			mp_neg(&num, &num);
+		setLastCardGenerated(&num);
+		changed = 1;
+		break;
+	}
+
+	if (mp_cmp(currPasscodeNum(), &past) < 0) {
+		setCurrPasscodeNum(&past);
+		changed = 1;
+	}
+	if (changed)
+		_state_set_counters(currPasscodeNum(), lastCardGenerated());
+	mp_clear(&num);
+	mp_clear(&past);
+
+	memset(buf, 0, len);
+	free(buf);
+	return 1;
+}
+
+/* Check the record in state_rec and load it into the PPP state */
+static int _state_load() {
+	mp_int num;
+
+	if (memcmp(state_rec, "PPPS", 4) != 0
+	    || _get_le(state_rec + STATE_OFF_FORMAT, 2) != STATE_FORMAT
+	    || _get_le(state_rec + STATE_OFF_CRC, 4) != _crc32(state_rec, STATE_OFF_CRC)) {
+		memset(state_rec, 0, STATE_SIZE);
+		state_valid = 0;
+		return 0;
+	}
+
+	pppClearFlags(0xffff);
+	pppSetFlags(_get_le(state_rec + STATE_OFF_FLAGS, 4) | PPP_FLAGS_PRESENT);
+
+	mp_init(&num);
+	mp_read_unsigned_bin_le(&num, state_rec + STATE_OFF_KEY, STATE_KEY_SIZE);
+	setSeqKey(&num);
+
+	mp_read_unsigned_bin_le(&num, state_rec + STATE_OFF_CNT, STATE_NUM_SIZE);
+	setCurrPasscodeNum(&num);
+
+	mp_read_unsigned_bin_le(&num, state_rec + STATE_OFF_GEN, STATE_NUM_SIZE);
+	if (_get_le(state_rec + STATE_OFF_BITS, 4) & STATE_GEN_NEGATIVE)
+		mp_neg(&num, &num);
+	setLastCardGenerated(&num);
+	mp_clear(&num);
+
+	setKeyVersion(_get_le(state_rec + STATE_OFF_VERSION, 2));
+	read_epoch = _get_le(state_rec + STATE_OFF_EPOCH, 4);
+	state_valid = 1;
+	return 1;
+}
+
+/* Returns 1 if the state was loaded, 0 if there is no state file (the
+ * legacy files should be tried), and -1 if it exists but is bad.  With
+ * lock, the file is locked first and read through the locked
+ * descriptor, so the record can't change between the two. */
+static int _read_state(int lock) {
+	unsigned char buf[2 * STATE_SIZE], *cur;
+	ssize_t n;
+	int fd;
+
+	if (lock && doLocking())
+		fd = lock_fd;
+	else if (lock && lockingFailed && lock_required)
+		return -1;
+	else {
+		fd = _member_open(private_state_file_name, O_RDONLY);
+		if (fd < 0)
+			return _member_exists(private_state_file_name, 0) ? -1 : 0;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	n = pread(fd, buf, sizeof(buf), 0);
+	if (fd != lock_fd)
+		close(fd);
+
+	/* Empty if only just created to be locked */
+	if (n == 0)
+		return 0;
+
+	cur = n >= STATE_SIZE ? _state_copy(buf) : NULL;
+	if (cur == NULL) {
+		memset(buf, 0, sizeof(buf));
+		memset(state_rec, 0, STATE_SIZE);
+		state_valid = 0;
+		return -1;
+	}
+	memcpy(state_rec, cur, STATE_SIZE);
+	memset(buf, 0, sizeof(buf));
+
+	if ( ! _state_load())
+		return -1;
+
+	if ( ! _journal_replay()) {
+		memset(state_rec, 0, STATE_SIZE);
+		state_valid = 0;
+		return -1;
+	}
+	return 1;
+}
+
+/* Compare the counters of two records holding the same key; returns
+ * less than, equal to or greater than zero as a's passcode number is
+ * behind, level with or ahead of b's.  Records with different keys
+ * compare equal, as their counters have nothing to do with each other. */
+static int _state_cmp(const unsigned char *a, const unsigned char *b) {
+	int i;
+
+	if (memcmp(a + STATE_OFF_KEY, b + STATE_OFF_KEY, STATE_KEY_SIZE) != 0)
+		return 0;
+
+	for (i = STATE_NUM_SIZE - 1; i >= 0; i--) {
+		if (a[STATE_OFF_CNT + i] != b[STATE_OFF_CNT + i])
+			return a[STATE_OFF_CNT + i] - b[STATE_OFF_CNT + i];
+	}
+	return 0;
+}
+
+/* The uid whose record is wanted: the user given to setUser(), or
+ * else whoever owns the home directory in use */
+static long _store_uid(char *name) {
+	struct passwd *pw;
+	struct stat st;
+
+	if (strlen(store_user) > 0) {
+		if ( ! user_known)
+			return -1;
+		snprintf(name, STORE_NAME_SIZE, "%s", store_user);
+		return user_uid;
+	}
+
+	if (stat(_home_dir(), &st) != 0)
+		return -1;
+	pw = getpwuid(st.st_uid);
+	if (pw)
+		snprintf(name, STORE_NAME_SIZE, "%s", pw->pw_name);
+	return st.st_uid;
+}
+
+/* Take or release a write lock on part of the store; wait is only
+ * used for the header, which is never held for long */
+static int _store_lock(off_t start, off_t len, int type, int wait) {
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+
+	return fcntl(store_fd, wait ? LOCK_WAIT : LOCK_NOWAIT, &fl) == 0;
+}
+
+/* Create an empty store */
+static int _store_create() {
+	unsigned char hdr[STORE_HDR_SIZE];
+	char dir[128], *p;
+	int fd;
+
+	strncpy(dir, store_path, 127);
+	dir[127] = '\0';
+	p = strrchr(dir, '/');
+	if (p && p != dir) {
+		*p = '\0';
+		mkdir(dir, S_IRWXU);
+	}
+
+	fd = open(store_path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR|S_IWUSR);
+	if (fd < 0)
+		return errno == EEXIST;
+
+	memset(hdr, 0, STORE_HDR_SIZE);
+	memcpy(hdr, "PPPD", 4);
+	_put_le(hdr + 4, STORE_FORMAT, 2);
+	_put_le(hdr + STORE_OFF_SLOTS, STORE_SLOTS, 4);
+	_put_le(hdr + STORE_OFF_SLOTSIZE, STORE_SLOT_SIZE, 4);
+	_put_le(hdr + STORE_OFF_CRC, _crc32(hdr, STORE_OFF_CRC), 4);
+
+	/* The slots are zero, which marks them free */
+	if (ftruncate(fd, STORE_HDR_SIZE + (off_t)STORE_SLOTS * STORE_SLOT_SIZE) != 0
+	    || pwrite(fd, hdr, STORE_HDR_SIZE, 0) != STORE_HDR_SIZE
+	    || fsync(fd) != 0) {
+		close(fd);
+		unlink(store_path);
+		return 0;
+	}
+	close(fd);
+	return 1;
+}
+
+/* Map the store, creating it first if asked to.  The mapping is kept
+ * for later calls from the same process. */
+static int _store_open(int create) {
+	struct stat st;
+	unsigned long nslots;
+
+	if (store_map)
+		return 1;
+
+	if (create && ! _store_create())
+		return 0;
+
+	store_fd = open(store_path, O_RDWR);
+	if (store_fd < 0)
+		return 0;
+
+	if (fstat(store_fd, &st) < 0 || ! S_ISREG(st.st_mode) || st.st_size < STORE_HDR_SIZE)
+		goto error;
+
+	store_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+	if (store_map == MAP_FAILED) {
+		store_map = NULL;
+		goto error;
+	}
+	store_len = st.st_size;
+
+	nslots = _get_le(store_map + STORE_OFF_SLOTS, 4);
+	if (memcmp(store_map, "PPPD", 4) != 0
+	    || _get_le(store_map + 4, 2) != STORE_FORMAT
+	    || _get_le(store_map + STORE_OFF_SLOTSIZE, 4) != STORE_SLOT_SIZE
+	    || _get_le(store_map + STORE_OFF_CRC, 4) != _crc32(store_map, STORE_OFF_CRC)
+	    || nslots == 0
+	    || nslots > (store_len - STORE_HDR_SIZE) / STORE_SLOT_SIZE)
+		goto error;
+	store_nslots = nslots;
+
+	return 1;
+
+error:
+	if (store_map)
+		munmap(store_map, store_len);
+	store_map = NULL;
+	close(store_fd), store_fd = -1;
+	return 0;
+}
+
+/* Find the slot for a uid; with claim, take the first free slot on
+ * the way if the uid has none.  The caller holds the header lock when
+ * claiming. */
+static unsigned char *_store_find(unsigned long uid, int claim) {
+	unsigned char *slot;
+	unsigned long i, h;
+
+	h = (uid * 2654435761UL) % store_nslots;
+	for (i = 0; i < store_nslots; i++) {
+		slot = store_map + STORE_HDR_SIZE + ((h + i) % store_nslots) * STORE_SLOT_SIZE;
+		if ( ! _get_le(slot + STORE_SLOT_USED, 4)) {
+			if ( ! claim)
+				return NULL;
+			memset(slot, 0, STORE_SLOT_SIZE);
+			_put_le(slot, uid, 4);
+			return slot;
+		}
+		if (_get_le(slot, 4) == uid)
+			return slot;
+	}
+	return NULL;
+}
+
+/* The newer good copy of the record in a slot, or NULL if neither is */
+static unsigned char *_store_copy(unsigned char *slot) {
+	return _state_copy(slot + STORE_SLOT_COPY);
+}
+
+/* Flush the part of the mapping holding a slot */
+static void _store_sync(unsigned char *slot) {
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned char *start;
+
+	if (durability < PPP_SYNC_DATA)
+		return;
+
+	start = store_map + ((slot - store_map) / page) * page;
+	msync(start, slot + STORE_SLOT_SIZE - start, MS_SYNC);
+}
+
+/* Put state_rec in the slot, over the older copy */
+static void _store_put(unsigned char *slot) {
+	unsigned char *cur, *next;
+
+	cur = _store_copy(slot);
+	next = slot + STORE_SLOT_COPY;
+	if (cur == next)
+		next += STATE_SIZE;
+
+	if (cur)
+		_put_le(state_rec + STATE_OFF_EPOCH, _get_le(cur + STATE_OFF_EPOCH, 4) + 1, 4);
+	_put_le(state_rec + STATE_OFF_CRC, _crc32(state_rec, STATE_OFF_CRC), 4);
+
+	memcpy(next, state_rec, STATE_SIZE);
+	_store_sync(slot);
+}
+
+/* Read the user's record from the store; 1 if loaded, 0 if not */
+static int _store_read(int lock) {
+	char name[STORE_NAME_SIZE] = "";
+	unsigned char *rec;
+	long uid;
+
+	uid = _store_uid(name);
+	if (uid < 0 || ! _store_open(0))
+		return 0;
+
+	store_slot = _store_find(uid, 0);
+	if (store_slot == NULL)
+		return 0;
+
+	/* Lock before reading, so that the record can't change under us */
+	if (lock && ! doLocking() && lock_required)
+		goto error;
+
+	rec = _store_copy(store_slot);
+	if (rec == NULL)
+		goto error;
+	memcpy(state_rec, rec, STATE_SIZE);
+
+	if ( ! _state_load())
+		goto error;
+	return 1;
+
+error:
+	if (lock)
+		doUnlocking();
+	store_slot = NULL;
+	return 0;
+}
+
+/* Write state_rec to the user's slot, adding one if need be */
+static int _store_add() {
+	char name[STORE_NAME_SIZE] = "";
+	unsigned char *slot, *cur;
+	long uid;
+
+	uid = _store_uid(name);
+	if (uid < 0 || ! _store_open(1))
+		return 0;
+
+	if ( ! _store_lock(0, STORE_HDR_SIZE, F_WRLCK, 1))
+		return 0;
+
+	slot = _store_find(uid, 1);
+	if (slot == NULL) {
+		_store_lock(0, STORE_HDR_SIZE, F_UNLCK, 0);
+		fprintf(stderr, "%s: the store is full\n", store_path);
+		return 0;
+	}
+
+	cur = _store_copy(slot);
+	if (cur && _state_cmp(cur, state_rec) > 0) {
+		_store_lock(0, STORE_HDR_SIZE, F_UNLCK, 0);
+		fprintf(stderr, "%s holds a later passcode for this key; export it first\n", store_path);
+		return 0;
+	}
+
+	memset(slot + STORE_SLOT_NAME, 0, STORE_NAME_SIZE);
+	snprintf((char *)slot + STORE_SLOT_NAME, STORE_NAME_SIZE, "%s", name);
+	_store_put(slot);
+
+	/* Only now can a login find the slot */
+	_put_le(slot + STORE_SLOT_USED, 1, 4);
+	_store_sync(slot);
+
+	_store_lock(0, STORE_HDR_SIZE, F_UNLCK, 0);
+	return 1;
+}
+
+/* Send a request to the daemon and, unless it is an unlock, wait for
+ * the answer in the same buffer.  Returns 1 if it succeeded, 0 if the
+ * daemon doesn't know the user, and -1 if the daemon failed or can't
+ * be reached, in which case the connection is closed. */
+static int _daemon_call(unsigned char *msg) {
+	int op = msg[PPP_MSG_OFF_OP];
+	ssize_t n, got;
+
+	if (send(daemon_fd, msg, PPP_MSG_SIZE, MSG_NOSIGNAL) != PPP_MSG_SIZE)
+		goto error;
+	if (op == PPP_OP_UNLOCK)
+		return 1;
+
+	for (got = 0; got < PPP_MSG_SIZE; got += n) {
+		n = recv(daemon_fd, msg + got, PPP_MSG_SIZE - got, 0);
+		if (n <= 0)
+			goto error;
+	}
+	if (msg[PPP_MSG_OFF_OP] == PPP_STATUS_OK)
+		return 1;
+	if (msg[PPP_MSG_OFF_OP] == PPP_STATUS_NOUSER)
+		return 0;
+
+error:
+	close(daemon_fd), daemon_fd = -1;
+	daemon_locked = 0;
+	return -1;
+}
+
+/* Returns 1 if the daemon gave us the state, 0 if it doesn't know the
+ * user, and -1 if it can't be reached, so the files should be used. */
+static int _daemon_read(int lock) {
+	unsigned char msg[PPP_MSG_SIZE];
+	struct sockaddr_un sa;
+	struct timeval tv;
+	int ret;
+
+	if (daemon_fd >= 0)
+		close(daemon_fd), daemon_fd = -1;
+	daemon_locked = 0;
+
+	if (strlen(store_user) == 0 || strlen(store_user) >= PPP_MSG_NAME_SIZE)
+		return -1;
+
+	daemon_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (daemon_fd < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", daemon_path);
+	if (connect(daemon_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(daemon_fd), daemon_fd = -1;
+		return -1;
+	}
+
+	/* A daemon that stops answering shouldn't hang the login */
+	tv.tv_sec = 10;
+	tv.tv_usec = 0;
+	setsockopt(daemon_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(msg, 0, PPP_MSG_SIZE);
+	msg[PPP_MSG_OFF_OP] = PPP_OP_LOAD;
+	msg[PPP_MSG_OFF_FLAGS] = lock ? PPP_MSG_LOCK : 0;
+	strcpy((char *)msg + PPP_MSG_OFF_NAME, store_user);
+
+	ret = _daemon_call(msg);
+	if (ret != 1) {
+		memset(msg, 0, PPP_MSG_SIZE);
+		if (daemon_fd >= 0)
+			close(daemon_fd), daemon_fd = -1;
+		return ret;
+	}
+
+	memcpy(state_rec, msg + PPP_MSG_OFF_REC, STATE_SIZE);
+	memset(msg, 0, PPP_MSG_SIZE);
+	if ( ! _state_load()) {
+		close(daemon_fd), daemon_fd = -1;
+		return 0;
+	}
+
+	if (lock)
+		daemon_locked = 1;
+	return 1;
+}
+
+/* Hand the counters in state_rec to the daemon */
+static int _daemon_write() {
+	unsigned char msg[PPP_MSG_SIZE];
+
+	memset(msg, 0, PPP_MSG_SIZE);
+	msg[PPP_MSG_OFF_OP] = PPP_OP_STORE;
+	strcpy((char *)msg + PPP_MSG_OFF_NAME, store_user);
+	memcpy(msg + PPP_MSG_OFF_REC, state_rec, STATE_SIZE);
+
+	return _daemon_call(msg) == 1;
+}
+
+/* Map one of the tables shared through memory (the reservation table,
+ * the user cache and the rate limits), creating it if need be.  All
+ * have a 64-byte header: magic, format (16 bits) at 4 and number of
+ * slots (32 bits) at 8. */
+static void *_table_open(const char *path, const char *magic, unsigned int format,
+    unsigned long nslots, size_t slot_size) {
+	unsigned char hdr[64];
+	struct stat st;
+	size_t len = sizeof(hdr) + nslots * slot_size;
+	void *map;
+	int fd;
+
+	if (strlen(path) == 0)
+		return NULL;
+
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, S_IRUSR|S_IWUSR);
+	if (fd < 0)
+		return NULL;
+
+	/* Anyone else able to write it could steer every login */
+	if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode) || st.st_uid != geteuid()
+	    || (st.st_mode & 0077) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Whoever gets here first sets it up; doing it twice does no
+	 * harm, as the header comes out the same and the slots zero */
+	if (st.st_size == 0) {
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, magic, 4);
+		_put_le(hdr + 4, format, 2);
+		_put_le(hdr + 8, nslots, 4);
+		if (ftruncate(fd, len) != 0 || pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			close(fd);
+			return NULL;
+		}
+	} else if ((size_t)st.st_size != len) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (memcmp(map, magic, 4) != 0 || _get_le((unsigned char *)map + 4, 2) != format
+	    || _get_le((unsigned char *)map + 8, 4) != nslots) {
+		munmap(map, len);
+		return NULL;
+	}
+	return map;
+}
+
+static int _resv_open() {
+	if (resv_map == NULL)
+		resv_map = _table_open(resv_path, "PPPR", RESV_FORMAT, RESV_SLOTS,
+		    sizeof(struct resv_slot));
+	return resv_map != NULL;
+}
+
+static int _limit_open() {
+	if (limit_map == NULL)
+		limit_map = _table_open(limit_path, "PPPL", LIMIT_FORMAT, LIMIT_SLOTS,
+		    sizeof(struct limit_slot));
+	return limit_map != NULL;
+}
+
+static uint64_t _now_ms() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Find or claim the slot for a uid.  A full bucket is no different
+ * from none, so its slot can go to another uid when the table fills. */
+static struct limit_slot *_limit_find(uid_t uid, uint64_t now) {
+	struct limit_slot *slots = (struct limit_slot *)(limit_map + LIMIT_HDR_SIZE);
+	struct limit_slot *spare = NULL;
+	uint64_t key = (uint64_t)uid + 1, k;
+	int i;
+
+	for (i = 0; i < LIMIT_PROBES; i++) {
+		struct limit_slot *slot = &slots[(key * 2654435761UL + i) % LIMIT_SLOTS];
+
+		k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if (k == key)
+			return slot;
+		if (k == 0) {
+			if (__atomic_compare_exchange_n(&slot->key, &k, key, 0,
+			    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || k == key)
+				return slot;
+		} else if (spare == NULL && __atomic_load_n(&slot->full, __ATOMIC_RELAXED) <= now) {
+			spare = slot;
+		}
+	}
+
+	if (spare) {
+		k = __atomic_load_n(&spare->key, __ATOMIC_ACQUIRE);
+		if (__atomic_compare_exchange_n(&spare->key, &k, key, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return spare;
+	}
+	return NULL;
+}
+
+/* Find or claim the slot for the account and key in state_rec */
+static struct resv_slot *_resv_find() {
+	struct resv_slot *slots = (struct resv_slot *)(resv_map + RESV_HDR_SIZE);
+	uint64_t tag = 14695981039346656037ULL, uid, t;
+	int i;
+
+	uid = userUid();
+	for (i = 0; i < 4; i++)
+		tag = (tag ^ ((uid >> (8 * i)) & 0xff)) * 1099511628211ULL;
+	for (i = 0; i < STATE_KEY_SIZE; i++)
+		tag = (tag ^ state_rec[STATE_OFF_KEY + i]) * 1099511628211ULL;
+	tag |= 1;
+
+	for (i = 0; i < RESV_PROBES; i++) {
+		struct resv_slot *slot = &slots[(tag + i) % RESV_SLOTS];
+
+		t = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+		if (t == 0) {
+			if (__atomic_compare_exchange_n(&slot->tag, &t, tag, 0,
+			    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return slot;
+		}
+		if (t == tag)
+			return slot;
+	}
+	return NULL;
+}
+
+static int _mp_to_u64(mp_int *mp, uint64_t *v) {
+	unsigned char buf[8];
+	int i;
+
+	if (mp_to_fixlen_bin_le(mp, buf, 8) != MP_OKAY)
+		return 0;
+	for (*v = 0, i = 7; i >= 0; i--)
+		*v = (*v << 8) | buf[i];
+	return 1;
+}
+
+static void _u64_to_mp(uint64_t v, mp_int *mp) {
+	unsigned char buf[8];
+	int i;
+
+	for (i = 0; i < 8; i++, v >>= 8)
+		buf[i] = v & 0xff;
+	mp_read_unsigned_bin_le(mp, buf, 8);
+}
+
+/* With the lock held, whether the state is still the version read */
+static int _state_unchanged() {
+	unsigned char buf[2 * STATE_SIZE], *cur;
+	struct stat st;
+	off_t len = 0;
+	ino_t ino = 0;
+	int same;
+
+	if (store_slot) {
+		cur = _store_copy(store_slot);
+		return cur && _get_le(cur + STATE_OFF_EPOCH, 4) == read_epoch;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	same = pread(lock_fd, buf, sizeof(buf), 0) >= STATE_SIZE
+	    && (cur = _state_copy(buf)) != NULL
+	    && _get_le(cur + STATE_OFF_EPOCH, 4) == read_epoch;
+	memset(buf, 0, sizeof(buf));
+	if ( ! same)
+		return 0;
+
+	if (fstatat(key_dir_fd, private_journal_file_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		len = st.st_size - st.st_size % JOURNAL_SIZE;
+		ino = st.st_ino;
+	}
+	return len == read_journal && ino == read_journal_ino;
+}
+
+static int _users_open() {
+	unsigned char *map;
+
+	if (users_map == NULL) {
+		map = _table_open(users_path, "PPPU", USERS_FORMAT, USERS_SLOTS,
+		    sizeof(struct user_entry));
+		if (map)
+			users_map = (struct user_entry *)(map + USERS_HDR_SIZE);
+	}
+	return users_map != NULL;
+}
+
+static struct user_entry *_users_slot(const char *name) {
+	unsigned long h = 2166136261UL;
+
+	while (*name)
+		h = ((h ^ (unsigned char)*name++) * 16777619UL) & 0xffffffffUL;
+	return &users_map[h % USERS_SLOTS];
+}
+
+/* Copy out the shared slot for a name, if it holds a current answer */
+static int _users_get(const char *name, struct user_entry *e) {
+	struct user_entry *slot = _users_slot(name);
+	uint32_t seq;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return 0;
+	memcpy(e, slot, sizeof(*e));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+		return 0;
+
+	e->name[USERS_NAME_SIZE - 1] = e->home[USERS_HOME_SIZE - 1] = '\0';
+	return strcmp(e->name, name) == 0 && e->expires > (uint64_t)time(NULL);
+}
+
+/* Put an answer in the shared slot for its name, unless someone else
+ * is writing it just now */
+static void _users_put(const struct user_entry *e) {
+	struct user_entry *slot = _users_slot(e->name);
+	uint32_t seq;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || ! __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	memcpy((char *)slot + sizeof(slot->seq), (const char *)e + sizeof(e->seq),
+	    sizeof(*e) - sizeof(e->seq));
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Look up a user; returns 1 if known, 0 if not and -1 if that couldn't
+ * be told.  home, if given, gets the home directory. */
+static int _lookup_user(const char *name, uid_t *uid, char *home, size_t homelen) {
+	struct user_entry e, *local = NULL;
+	struct passwd pwd, *pw = NULL;
+	char *buf = NULL, *nbuf;
+	long size;
+	int i, rc;
+
+	if (users_cache && strlen(name) < USERS_NAME_SIZE) {
+		for (i = 0; i < USERS_LOCAL; i++) {
+			if (strcmp(users_local[i].name, name) == 0
+			    && users_local[i].expires > (uint64_t)time(NULL)) {
+				local = &users_local[i];
+				break;
+			}
+		}
+		if (local == NULL && _users_open() && _users_get(name, &e)) {
+			local = &users_local[users_next++ % USERS_LOCAL];
+			memcpy(local, &e, sizeof(e));
+		}
+		if (local) {
+			*uid = local->uid;
+			if (home)
+				snprintf(home, homelen, "%s", local->home);
+			return local->known != 0;
+		}
+	}
+
+	size = sysconf(_SC_GETPW_R_SIZE_MAX);
+	if (size <= 0)
+		size = 1024;
+	do {
+		nbuf = realloc(buf, size);
+		if (nbuf == NULL) {
+			rc = ENOMEM;
+			break;
+		}
+		buf = nbuf;
+		rc = getpwnam_r(name, &pwd, buf, size, &pw);
+		size *= 2;
+	} while (rc == ERANGE && size <= 1024 * 1024);
+
+	/* Only a definite answer is worth keeping */
+	if (rc != 0 && pw == NULL) {
+		free(buf);
+		return -1;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.known = pw != NULL;
+	if (pw) {
+		e.uid = pw->pw_uid;
+		*uid = pw->pw_uid;
+		if (home)
+			snprintf(home, homelen, "%s", pw->pw_dir);
+	}
+
+	if (users_cache && strlen(name) < USERS_NAME_SIZE
+	    && ( ! pw || strlen(pw->pw_dir) < USERS_HOME_SIZE)) {
+		strcpy(e.name, name);
+		if (pw)
+			strcpy(e.home, pw->pw_dir);
+		e.expires = time(NULL) + users_ttl;
+		memcpy(&users_local[users_next++ % USERS_LOCAL], &e, sizeof(e));
+		if (_users_open())
+			_users_put(&e);
+	}
+
+	free(buf);
+	return e.known;
+}
+
+static int confirm(char *prompt) {
+	char buf[1024], *p;
+
+	do {
+		/* Display the prompt (on stderr because stdout might be redirected). */
+		fflush(stdout);
+		fprintf(stderr, "%s", prompt);
+		fflush(stderr);
+		/* Read line */
+		if (fgets(buf, sizeof(buf), stdin) == NULL) {
+			/* Got EOF.  Just exit. */
+			/* Print a newline (the prompt probably didn't have one). */
+			fprintf(stderr, "\n");
+			fprintf(stderr, "Aborted by user");
+			return 0;
+		}
+		p = buf + strlen(buf) - 1;
+		while (p > buf && isspace(*p))
+			*p-- = '\0';
+		p = buf;
+		while (*p && isspace(*p))
+			p++;
+		if (strcasecmp(p, "no") == 0) {
+			return 0;
+		}
+	} while (strcasecmp(p, "yes") != 0);
+
+	return 1;
+}
+
+int setUser(const char *user) {
+	/* Another user's ~/.pppauth, if one was open */
+	if (key_dir_fd >= 0)
+		close(key_dir_fd), key_dir_fd = -1;
+
+	strncpy(store_user, user, STORE_NAME_SIZE - 1);
+	user_known = _lookup_user(user, &user_uid, userhome, sizeof(userhome)) == 1;
+	if ( ! user_known)
+		strcpy(userhome, "/nonexistent"); /* nobody home */
+	return user_known;
+}
+
+unsigned long userUid() {
+	return user_known ? user_uid : geteuid();
+}
+
+void setUserCache(const char *path) {
+	users_cache = 1;
+	strncpy(users_path, path, sizeof(users_path) - 1);
+}
+
+void setUserCacheTTL(long seconds) {
+	users_ttl = seconds;
+}
+
+void setDurability(int level) {
+	durability = level;
+}
+
+void setLockTimeout(long ms) {
+	lock_timeout = ms;
+}
+
+void setLockRequired(int required) {
+	lock_required = required;
+}
+
+void setLockStats(const char *path) {
+	strncpy(stats_path, path, sizeof(stats_path) - 1);
+}
+
+int readLockStats(const char *path, struct ppp_lock_stats *st) {
+	unsigned char buf[STATS_COUNTERS_SIZE];
+	uint64_t v[STATS_COUNTERS];
+	int fd, i, format;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	format = pread(fd, buf, STATS_COUNTERS_SIZE, 0) == STATS_COUNTERS_SIZE
+	    && memcmp(buf, "PPPT", 4) == 0 ? (int)_get_le(buf + 4, 2) : 0;
+	close(fd);
+	if (format != 2 && format != STATS_FORMAT)
+		return 0;
+
+	for (i = 0; i < STATS_COUNTERS; i++)
+		memcpy(&v[i], buf + STATS_HDR_SIZE + 8 * i, 8);
+	st->acquired = v[STATS_ACQUIRED];
+	st->contended = v[STATS_CONTENDED];
+	st->timeouts = v[STATS_TIMEOUTS];
+	st->errors = v[STATS_ERRORS];
+	st->wait_us = v[STATS_WAIT_US];
+	st->max_wait_us = v[STATS_MAX_WAIT_US];
+	st->conflicts = v[STATS_CONFLICTS];
+	return 1;
+}
+
+int readTimingStats(const char *path, struct ppp_phase_stats *phases) {
+	unsigned char hdr[STATS_HDR_SIZE];
+	int fd, ok;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ok = pread(fd, hdr, STATS_HDR_SIZE, 0) == STATS_HDR_SIZE && memcmp(hdr, "PPPT", 4) == 0
+	    && _get_le(hdr + 4, 2) == STATS_FORMAT
+	    && pread(fd, phases, PPP_PHASES * sizeof(*phases), STATS_COUNTERS_SIZE)
+	       == PPP_PHASES * sizeof(*phases);
+	close(fd);
+	return ok;
+}
+
+unsigned long long timingPercentile(const struct ppp_phase_stats *phase, double q) {
+	unsigned long long want, seen = 0, end;
+	int i;
+
+	if (phase->count == 0)
+		return 0;
+	want = (unsigned long long)(q * phase->count);
+	if (want < q * phase->count || want == 0)
+		want++;
+
+	/* The end of the bucket it falls in, which is never more than a
+	 * quarter out */
+	for (i = 0; i < PPP_TIMING_BUCKETS - 1; i++) {
+		seen += phase->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	end = i < PPP_TIMING_BUCKETS - 1 ? _timing_bucket_start(i + 1) - 1 : phase->max_us;
+	return end < phase->max_us ? end : phase->max_us;
+}
+
+void setTiming(int on) {
+	timing = on;
+	if (on && strlen(stats_path) == 0)
+		setLockStats(PPP_STATS_PATH);
+}
+
+void timingStart() {
+	if ( ! timing)
+		return;
+	memset(timing_us, 0, sizeof(timing_us));
+	timing_lock_us = 0;
+	timing_seen = 0;
+	clock_gettime(CLOCK_MONOTONIC, &timing_mark);
+}
+
+void timingPhase(int phase) {
+	struct timespec now;
+	uint64_t us, lock;
+
+	if ( ! timing)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - timing_mark.tv_sec) * 1000000
+	    + (now.tv_nsec - timing_mark.tv_nsec) / 1000;
+	timing_mark = now;
+
+	/* Waiting for the lock has a phase of its own */
+	lock = timing_lock_us < us ? timing_lock_us : us;
+	timing_lock_us = 0;
+	timing_us[PPP_PHASE_LOCK] += lock;
+	timing_us[phase] += us - lock;
+	timing_seen |= 1 << phase;
+	if (phase == PPP_PHASE_READ || lock)
+		timing_seen |= 1 << PPP_PHASE_LOCK;
+}
+
+unsigned long timingEnd() {
+	int i;
+
+	if ( ! timing)
+		return 0;
+
+	/* All but the user's typing */
+	timing_us[PPP_PHASE_TOTAL] = 0;
+	for (i = 0; i < PPP_PHASE_TOTAL; i++) {
+		if (i != PPP_PHASE_INPUT)
+			timing_us[PPP_PHASE_TOTAL] += timing_us[i];
+	}
+	timing_seen |= 1 << PPP_PHASE_TOTAL;
+
+	for (i = 0; i < PPP_PHASES; i++) {
+		if (timing_seen & (1 << i))
+			_stats_time(i, timing_us[i]);
+	}
+	return timing_us[PPP_PHASE_TOTAL];
+}
+
+unsigned long timingPhaseUs(int phase) {
+	return timing_us[phase];
+}
+
+void setStore(const char *path) {
+	if (path == NULL || strcmp(path, "home") == 0) {
+		store_path[0] = '\0';
+		return;
+	}
+	strncpy(store_path, path, 127);
+}
+
+void setRateLimit(const char *path) {
+	strncpy(limit_path, path, sizeof(limit_path) - 1);
+}
+
+void setRateLimitBurst(int tries) {
+	limit_burst = tries;
+}
+
+void setRateLimitInterval(long seconds) {
+	limit_interval = seconds;
+}
+
+int rateLimitTake() {
+	uint64_t now, full, want, step, span;
+	struct limit_slot *slot;
+
+	/* Never lock everyone out for want of the table */
+	limit_taken = NULL;
+	if ( ! user_known || limit_burst <= 0 || ! _limit_open())
+		return 1;
+
+	now = _now_ms();
+	slot = _limit_find(user_uid, now);
+	if (slot == NULL)
+		return 1;
+
+	step = (uint64_t)limit_interval * 1000;
+	span = step * limit_burst;
+	full = __atomic_load_n(&slot->full, __ATOMIC_RELAXED);
+	do {
+		/* A time further off than an empty bucket means the
+		 * clock went back */
+		want = (full > now && full <= now + span) ? full : now;
+		if (want + step > now + span)
+			return 0;
+		want += step;
+	} while ( ! __atomic_compare_exchange_n(&slot->full, &full, want, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	limit_taken = slot;
+	return 1;
+}
+
+void rateLimitGive() {
+	uint64_t now, full, want, step;
+
+	if (limit_taken == NULL)
+		return;
+
+	now = _now_ms();
+	step = (uint64_t)limit_interval * 1000;
+	full = __atomic_load_n(&limit_taken->full, __ATOMIC_RELAXED);
+	do {
+		if (full <= now)
+			break;
+		want = full - step > now ? full - step : now;
+	} while ( ! __atomic_compare_exchange_n(&limit_taken->full, &full, want, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	limit_taken = NULL;
+}
+
+void setReserveTable(const char *path) {
+	strncpy(resv_path, path, sizeof(resv_path) - 1);
 }
 
-static char *_key_file_dir() {
-	static char fname[128] = "";
+int reserveFromTable(mp_int *num) {
+	uint64_t cnt, cur, want;
 
-	if (strlen(fname) == 0) {
-		strncpy(fname, _home_dir(), 128 - strlen(private_key_file_name) - strlen(private_key_dir) - 1);
-		strncat(fname, private_key_dir, strlen(private_key_dir));
-	}
-	return fname;
-}
+	resv_slot = NULL;
+	if (strlen(resv_path) == 0 || daemon_fd >= 0 || ! state_valid)
+		return 0;
 
-static char *_key_file_name() {
-	static char fname[128] = "";
+	/* Numbers beyond 64 bits take the slow path */
+	if ( ! _mp_to_u64(currPasscodeNum(), &cnt) || cnt == UINT64_MAX)
+		goto fallback;
 
-	if (strlen(fname) == 0) {
-		strncpy(fname, _key_file_dir(), 128 - strlen(private_key_file_name) - 1);
-		strncat(fname, private_key_file_name, strlen(private_key_file_name));
-	}
-	return fname;
-}
+	if ( ! _resv_open() || (resv_slot = _resv_find()) == NULL)
+		goto fallback;
 
-static char *_cnt_file_name() {
-	static char fname[128] = "";
+	/* Take the next number, or the counter in the state if that is
+	 * further on (after a reboot, or pppauth --skip) */
+	cur = __atomic_load_n(&resv_slot->next, __ATOMIC_ACQUIRE);
+	do {
+		want = cur > cnt ? cur : cnt;
+		if (want == UINT64_MAX)
+			goto fallback;
+	} while ( ! __atomic_compare_exchange_n(&resv_slot->next, &cur, want + 1, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-	if (strlen(fname) == 0) {
-		strncpy(fname, _key_file_dir(), 128 - strlen(private_count_file_name) - 1);
-		strncat(fname, private_count_file_name, strlen(private_count_file_name));
-	}
-	return fname;
+	_u64_to_mp(want, num);
+	return 1;
+
+fallback:
+	/* The state was read without the lock, counting on the table;
+	 * the usual reservation needs both */
+	resv_slot = NULL;
+	if ( ! isLocked() && ! readKeyFile(1))
+		state_valid = 0;
+	return 0;
 }
 
-static char *_lock_file_name() {
-	static char fname[128] = "";
+int persistPasscodeNum(mp_int *num, int event) {
+	uint64_t target = 0, cur;
+	mp_int want;
+	int ok = 0;
 
-	if (strlen(fname) == 0) {
-		strncpy(fname, _key_file_dir(), 128 - strlen(private_lock_file_name) - 1);
-		strncat(fname, private_lock_file_name, strlen(private_lock_file_name));
-	}
-	return fname;
-}
+	/* Someone else may already have written a later counter */
+	if (resv_slot && _mp_to_u64(num, &target)
+	    && __atomic_load_n(&resv_slot->persisted, __ATOMIC_ACQUIRE) >= target)
+		return 1;
 
-static char *_gen_file_name() {
-	static char fname[128] = "";
+	/* Read the state afresh under the lock, and only ever move the
+	 * counter forward */
+	mp_init(&want);
+	mp_copy(num, &want);
+	if (strlen(store_path) > 0) {
+		if ( ! _store_read(1))
+			goto done;
+	} else if ( ! readKeyFile(1))
+		goto unlock;
+
+	if (mp_cmp(currPasscodeNum(), &want) < 0) {
+		setCurrPasscodeNum(&want);
+		if ( ! writeStateEvent(event))
+			goto unlock;
+	}
+	ok = 1;
 
-	if (strlen(fname) == 0) {
-		strncpy(fname, _key_file_dir(), 128 - strlen(private_generated_file_name) - 1);
-		strncat(fname, private_generated_file_name, strlen(private_generated_file_name));
+	if (resv_slot && target) {
+		cur = __atomic_load_n(&resv_slot->persisted, __ATOMIC_ACQUIRE);
+		while (cur < target && ! __atomic_compare_exchange_n(&resv_slot->persisted,
+		    &cur, target, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			;
 	}
-	return fname;
+
+unlock:
+	doUnlocking();
+done:
+	mp_clear(&want);
+	return ok;
+}
+
+void setOptimistic(int on) {
+	optimistic = on;
 }
 
+int reserveOptimistic(mp_int *num) {
+	mp_int next;
 
-static void _enforce_permissions() {
-	/* On some systems there might be more users
-	 * in root group without a real root access.
-	 * Changing this group here might give them access
-	 * to our files, while changing group to root
-	 * shouldn't be really required for PAM functionality...
-	 */
-/*	chown(_key_file_dir(), -1, 0);
-	chown(_key_file_name(), -1, 0);
-	chown(_cnt_file_name(), -1, 0);
-	chown(_gen_file_name(), -1, 0);
-	// FIXME: user will be root unless we create this file with pppauth
-	chown(_lock_file_name(), -1, 0);
-
-	chmod(_key_file_dir(), S_IRWXU | S_IRWXG);
-	chmod(_key_file_name(), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-	chmod(_cnt_file_name(), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-	chmod(_gen_file_name(), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-	chmod(_lock_file_name(), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-*/
-
-	chmod(_key_file_dir(), S_IRWXU);
-	chmod(_key_file_name(), S_IRUSR|S_IWUSR);
-	chmod(_cnt_file_name(), S_IRUSR|S_IWUSR);
-	chmod(_gen_file_name(), S_IRUSR|S_IWUSR);
-	chmod(_lock_file_name(), S_IRUSR|S_IWUSR);
-}
-
-static int _file_exists(char *fname) {
-	struct stat s;
-	if (stat(fname, &s) < 0) {
-		/* does not exist */
+	if ( ! optimistic || daemon_fd >= 0 || ! state_valid || state_from_legacy || isLocked())
 		return 0;
-	} else {
-		if (s.st_mode & S_IFREG) {
-			/* exists and is a regular file */
-			_enforce_permissions();
-			return 1;
-		} else {
-			/* exists but is not a regular file */
-			// TODO: abort with an error
-			return 0;
-		}
-	}
-	return 0;
-}
 
-static int _dir_exists(char *fname) {
-	struct stat s;
-	if (stat(fname, &s) < 0) {
-		/* does not exist */
+	if ( ! doLocking()) {
+		/* Don't let the caller write without it */
+		if (lock_required)
+			state_valid = 0;
 		return 0;
-	} else {
-		if (s.st_mode & S_IFDIR) {
-			/* exists and is a folder */
-			_enforce_permissions();
-			return 1;
-		} else {
-			/* exists but is not a folder */
-			// TODO: abort with an error
+	}
+
+	/* Someone else wrote since we read; start again from what they
+	 * wrote, which can't change now */
+	if ( ! _state_unchanged()) {
+		_stats_count(STATS_CONFLICTS, 0);
+		if ( ! readKeyFile(1)) {
+			state_valid = 0;
 			return 0;
 		}
 	}
-	return 0;
-}
-
-static int _ppp_version(char *buf) {
-	int ver = -1;
 
-	if (buf[0] != ' ')
-		return 1;
+	mp_init(&next);
+	mp_copy(currPasscodeNum(), num);
+	mp_add_d(num, 1, &next);
+	setCurrPasscodeNum(&next);
+	mp_clear(&next);
 
-	buf[4] = '\x00';
-	if (strncmp(buf, " PPP", 4) != 0) {
-		/* not a PPP file, so exit */
-		return -1;
+	/* If the write fails, the caller tries the usual way, still
+	 * holding the lock */
+	if ( ! writeStateEvent(PPP_EVENT_RESERVE)) {
+		setCurrPasscodeNum(num);
+		return 0;
 	}
+	doUnlocking();
+	return 1;
+}
 
-	buf[9] = '\x00';
-	if (sscanf(buf+5, "%04d", &ver) != 1)
-		return -1;
-
-	return ver;
+void setDaemon(const char *path) {
+	strncpy(daemon_path, path, sizeof(daemon_path) - 1);
 }
 
-static int _data_format(char *buf) {
-	int fmt = -1;
+int storeLoad(const char *user, unsigned char *rec) {
+	unsigned char *slot, *cur;
+	uid_t uid;
 
-	if (buf[0] != ' ') {
-		/* not a versioned file */
+	if (_lookup_user(user, &uid, NULL, 0) != 1 || ! _store_open(0))
 		return 0;
-	}
 
-	buf[14] = '\x00';
-	if (sscanf(buf+10, "%04d", &fmt) != 1)
-		return -1;
+	slot = _store_find(uid, 0);
+	if (slot == NULL || (cur = _store_copy(slot)) == NULL)
+		return 0;
 
-	return fmt;
+	memcpy(rec, cur, STATE_SIZE);
+	return 1;
 }
 
-static int _ppp_flags(char *buf) {
-	int flags = 0;
-
-	if (buf[0] != ' ') {
-		/* not a versioned file */
-		goto error;
-	}
+/* Returns 1 if the record was saved, 0 if it has nothing to go to
+ * (the user or the record is gone, or the key has changed), and -1 if
+ * it couldn't be saved this time */
+int storeSave(const char *user, const unsigned char *rec) {
+	unsigned char *slot, *cur;
+	off_t off;
+	uid_t uid;
+	int ok = 0;
+
+	if (memcmp(rec, "PPPS", 4) != 0
+	    || _get_le(rec + STATE_OFF_CRC, 4) != _crc32(rec, STATE_OFF_CRC))
+		return 0;
 
-	if (strlen(buf+15) < 5) {
-		/* is not long enough to check for flags */
-		goto error;
+	switch (_lookup_user(user, &uid, NULL, 0)) {
+	case 0:
+		return 0;
+	case -1:
+		return -1;
 	}
+	if ( ! _store_open(0))
+		return -1;
 
-	if (buf[19] != ' ') {
-		/* file does not contain flags */
-		goto error;
-	}
+	slot = _store_find(uid, 0);
+	if (slot == NULL)
+		return 0;
 
-	buf[19] = '\x00';
-	if (sscanf(buf+15, "%04x", &flags) != 1)
-		goto error;
+	/* Wait for a login working on the file directly */
+	off = slot - store_map;
+	if ( ! _store_lock(off, STORE_SLOT_SIZE, F_WRLCK, 1))
+		return -1;
 
-	pppSetFlags(PPP_FLAGS_PRESENT);
-	return flags;
+	/* A new key imported meanwhile wins over old counters */
+	cur = _store_copy(slot);
+	if (cur == NULL || memcmp(cur + STATE_OFF_KEY, rec + STATE_OFF_KEY, STATE_KEY_SIZE) == 0) {
+		memcpy(state_rec, rec, STATE_SIZE);
+		_store_put(slot);
+		memset(state_rec, 0, STATE_SIZE);
+		ok = 1;
+	}
 
-error:
-	pppClearFlags(0xffff);
-	return 0;
+	_store_lock(off, STORE_SLOT_SIZE, F_UNLCK, 0);
+	return ok;
 }
 
-static int _read_data(char *buf, mp_int *mp) {
-	mp_err ret;
-	switch (_data_format(buf)) {
-	case 0:
-		/* unversioned file, mpi radix 64 format */
-		mp_read_radix(mp, (unsigned char *)buf, 64);
-		return 1;
-	case 1:
-		/* versioned file, mpi radix 64 format */
-		/* Note:  This version should not be used.  The MPI
-		 *        library has a bug when using radix 64
-		 *        where it writes 63 as + and then assumes
-		 *        the plus is a sign indicator on read.
-		 */
-		if (pppCheckFlags(PPP_FLAGS_PRESENT))
-			ret = mp_read_radix(mp, (unsigned char *)(buf+20), 64);
-		else
-			ret = mp_read_radix(mp, (unsigned char *)(buf+15), 64);
-		break;
-	case 2:
-		/* versioned file, mpi radix 62 format */
-		if (pppCheckFlags(PPP_FLAGS_PRESENT))
-			ret = mp_read_radix(mp, (unsigned char *)(buf+20), 62);
-		else
-			ret = mp_read_radix(mp, (unsigned char *)(buf+15), 62);
-		break;
-	default:
-		/* Error while determining format */
+int storeImport() {
+	if ( ! state_valid)
 		return 0;
-	}
 
-	if (ret == MP_OKAY)
-		return 1;
-	else
-		return 0;
+	return _store_add();
 }
 
-static void _write_data(mp_int *mp, FILE *fp) {
-	char buf[256];
-	/* write ppp identifer */
-	fwrite(" PPP ", 1, 5, fp);
+int storeExport() {
+	unsigned char rec[STATE_SIZE];
+	struct stat st;
+	int home;
 
-	/* write key version */
-	fprintf(fp, "%04d ", keyVersion());
-
-	/* Current data format is versioned file,
-	 * mpi radix 62.
-	 */
-	int current_data_format = 2;
-
-	/* write data format */
-	fprintf(fp, "%04d ", current_data_format);
-
-	/* write flags */
-	fprintf(fp, "%04x ", pppCheckFlags(0xffff));
-
-	/* IMPORTANT NOTE:
-	 *
-	 * If you change current_data_format above,
-	 * make sure you:
-	 *
-	 * 1. Update the code below that writes the data to
-	 *    reflect the data format you specified in
-	 *    current_data_format above.
-	 * 2. Add compatible read code to the switch statement
-	 * in _read_data() above.
-	 */
+	/* Keep whatever the home directory holds, to compare */
+	home = state_valid && ! state_from_legacy;
+	memcpy(rec, state_rec, STATE_SIZE);
 
-	/* mpi radix 62 is the data format du jour */
-	mp_toradix(mp, (unsigned char *)buf, 62);
-	fwrite(buf, 1, strlen(buf)+1, fp);
-}
+	if ( ! _store_read(0))
+		return 0;
 
-static int confirm(char *prompt) {
-	char buf[1024], *p;
+	if (home && _state_cmp(rec, state_rec) > 0) {
+		fprintf(stderr, "%s holds a later passcode for this key; import it first\n", _key_file_dir());
+		return 0;
+	}
 
-	do {
-		/* Display the prompt (on stderr because stdout might be redirected). */
-		fflush(stdout);
-		fprintf(stderr, "%s", prompt);
-		fflush(stderr);
-		/* Read line */
-		if (fgets(buf, sizeof(buf), stdin) == NULL) {
-			/* Got EOF.  Just exit. */
-			/* Print a newline (the prompt probably didn't have one). */
-			fprintf(stderr, "\n");
-			fprintf(stderr, "Aborted by user");
-			return 0;
-		}
-		p = buf + strlen(buf) - 1;
-		while (p > buf && isspace(*p))
-			*p-- = '\0';
-		p = buf;
-		while (*p && isspace(*p))
-			p++;
-		if (strcasecmp(p, "no") == 0) {
-			return 0;
-		}
-	} while (strcasecmp(p, "yes") != 0);
+	if (_key_dir(1) < 0)
+		return 0;
+	umask(S_IRWXG|S_IRWXO);
 
-	return 1;
-}
+	_put_le(state_rec + STATE_OFF_EPOCH, time(NULL), 4);
+	_put_le(state_rec + STATE_OFF_CRC, _crc32(state_rec, STATE_OFF_CRC), 4);
+	if ( ! _state_write())
+		return 0;
+	_remove_legacy_files();
+	_remove_journals();
 
-void setUser(const char *user) {
-#ifdef OS_IS_MACOSX
-	strncpy(userhome, "/Users/", 7);
-#endif
-#ifdef OS_IS_LINUX
-	/* FIXME - wouldn't this method work on Mac also? */
-	const struct passwd *pwent;
-	while ((pwent = getpwent()) != NULL) {
-		if (strcmp(pwent->pw_name, user) == 0) {
-			strncpy(userhome, pwent->pw_dir, 126);
-			endpwent();
-			return;
-		}
+	/* When run by root on the user's behalf, hand the files over */
+	if (geteuid() == 0 && stat(_home_dir(), &st) == 0) {
+		fchown(key_dir_fd, st.st_uid, st.st_gid);
+		fchownat(key_dir_fd, private_state_file_name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
 	}
-	endpwent();
-	strcpy(userhome, "/"); /* If user doesn't exists return something more/less sane (nobody home?) */
-#endif
-	strncat(userhome, user, 120);
+	return 1;
 }
 
 int keyfileExists() {
-	return _file_exists(_key_file_name());
+	/* An empty state file is only there to be locked */
+	return _member_exists(private_state_file_name, 1)
+	    || _member_exists(private_key_file_name, 0);
 }
 
 
 int doLocking() {
-	const char *filename = _lock_file_name();
-	struct flock fl;
-	int ret;
-	int cnt;
+	off_t start = 0, len = 0;
+	int fd;
 
-	fl.l_type = F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = fl.l_len = 0;
+	if (lock_fd >= 0)
+		return 1; /* Already ours */
+	lockingFailed = 0;
 
-	lock_fd = open(filename, O_CREAT | O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-	if (lock_fd == -1) {
-		return 0; /* Unable to create file, therefore unable to obtain lock */
+	if (store_slot) {
+		/* Lock just the user's slot in the store */
+		start = store_slot - store_map;
+		len = STORE_SLOT_SIZE;
+		fd = store_fd;
+	} else
+		fd = _state_open();
+	if (fd < 0) {
+		return 0; /* No file, and so no state to protect */
 	}
 
 	/*
-	 * Trying to lock the file 20 times.
-	 * Any working ppp-pam session shouldn't lock it for so long.
-	 *
-	 * Therefore we have to options. Fail each login if we can't get the lock
-	 * or ignore locking (we can get a race condition then) but try to
-	 * authenticate the user nevertheless.
-	 *
-	 * I'll stick to the second option for now.
-	 *
+	 * A login holds the lock only while it reads the state and
+	 * reserves a passcode, so the wait should be short.  If it runs
+	 * out, the caller either goes on without the lock (there may be
+	 * a race then, and the prompt says so) or, with setLockRequired(),
+	 * gives up.
 	 */
-	for (cnt = 0; cnt < 20; cnt++) {
-		ret = fcntl(lock_fd, F_SETLK, &fl);
-		if (ret == 0)
-			break;
-		usleep(700);
-	}
-
-	if (ret != 0) {
-		/* Unable to lock for 10 times */
-		close(lock_fd), lock_fd = -1;
+	if ( ! _lock_range(fd, start, len)) {
+		if (fd != store_fd)
+			close(fd);
+		lockingFailed = 1;
 		return 0;
 	}
 
+	lock_fd = fd;
 	return 1; /* Got lock */
 }
 
 int doUnlocking() {
+	unsigned char msg[PPP_MSG_SIZE];
 	struct flock fl;
 
+	if (daemon_locked) {
+		/* No answer comes back, so this costs no round trip */
+		memset(msg, 0, PPP_MSG_SIZE);
+		msg[PPP_MSG_OFF_OP] = PPP_OP_UNLOCK;
+		strcpy((char *)msg + PPP_MSG_OFF_NAME, store_user);
+		daemon_locked = 0;
+		return _daemon_call(msg) == 1 ? 0 : 2;
+	}
+
 	if (lock_fd < 0)
 		return 1; /* No lock to release */
 
+	memset(&fl, 0, sizeof(fl));
 	fl.l_type = F_UNLCK;
 	fl.l_whence = SEEK_SET;
 	fl.l_start = fl.l_len = 0;
 
-	if (fcntl(lock_fd, F_SETLK, &fl) != 0) {
+	/* The store stays open; closing it would drop its mapping and
+	 * every other lock held on it */
+	if (lock_fd == store_fd) {
+		fl.l_start = store_slot - store_map;
+		fl.l_len = STORE_SLOT_SIZE;
+		lock_fd = -1;
+		if (fcntl(store_fd, LOCK_NOWAIT, &fl) != 0)
+			return 2;
+		return 0;
+	}
+
+	if (fcntl(lock_fd, LOCK_NOWAIT, &fl) != 0) {
 		/* Strange error while releasing the lock */
 		close(lock_fd), lock_fd = -1;
 		return 2;
 	}
 
 	close(lock_fd), lock_fd = -1;
-
-	lockingFailed = 0;
 	return 0;
 }
 
 int isLocked() {
+	if (daemon_locked)
+		return 1;
 	if (lock_fd == -1)
 		return 0;
 	else
 		return 1;
 }
 
-int readKeyFile(int lock) {
+static int _read_key_file(int lock) {
 	FILE *fp;
 	char buf[129]; /* 128 bytes + one ensured '\0' character */
 	mp_int num;
 	int ver[3];
 
-	if ( ! _file_exists(_key_file_name()) )
-		return 0;
+	if (strlen(daemon_path) > 0) {
+		switch (_daemon_read(lock)) {
+		case 1:
+			return 1;
+		case 0:
+			return 0;
+		}
+		/* The daemon may have counters that haven't reached the
+		 * store yet; going on without it is like going on without
+		 * the lock */
+		if (lock && lock_required) {
+			lockingFailed = 1;
+			return 0;
+		}
+	}
 
-	if ( ! _file_exists(_cnt_file_name()) )
-		return 0;
+	if (strlen(store_path) > 0)
+		return _store_read(lock);
 
-	if ( ! _file_exists(_gen_file_name()) )
-		return 0;
+	switch (_read_state(lock)) {
+	case 1:
+		return 1;
+	case -1:
+		goto nokey;
+	}
+
+	/*
+	 * No state file; read the legacy key, cnt and gen files.
+	 */
+
+	if ( ! _member_exists(private_key_file_name, 0) )
+		goto nokey;
+
+	if ( ! _member_exists(private_count_file_name, 0) )
+		goto nokey;
+
+	if ( ! _member_exists(private_generated_file_name, 0) )
+		goto nokey;
 
 
 	/*
 	 * 1. Reading key file
 	 */
 
-	fp = fopen(_key_file_name(), "r");
+	/* The lock, if wanted, was taken on the state file above */
+	fp = _member_fopen(private_key_file_name);
 	if ( ! fp)
-		return 0;
-
-	/* If file is opened we can assume that there's a directory
-	 * where we can hold lock file */
-	if (lock)
-		lockingFailed = doLocking();
+		goto nokey;
 
 	/* fread can fail; then strlen used in
 	 * _ppp_flags might not work as supposed.
@@ -514,7 +2561,7 @@ int readKeyFile(int lock) {
 	/*
 	 * 2. Reading cnt file
 	 */
-	fp = fopen(_cnt_file_name(), "r");
+	fp = _member_fopen(private_count_file_name);
 	if ( ! fp)
 		goto error;
 	fread(buf, 1, sizeof(buf) - 1, fp);
@@ -532,7 +2579,7 @@ int readKeyFile(int lock) {
 	/*
 	 * 3. Reading gen file
 	 */
-	fp = fopen(_gen_file_name(), "r");
+	fp = _member_fopen(private_generated_file_name);
 	if ( ! fp)
 		goto error;
 	fread(buf, 1, sizeof(buf) - 1, fp);
@@ -558,64 +2605,146 @@ int readKeyFile(int lock) {
 
 	/* tell PPP code which version the key expects */
 	setKeyVersion(ver[0]);
+
+	/* Remember the state as read, so that the first writeState()
+	 * can move it into the state file */
+	if ( ! _state_build())
+		goto error;
+	state_from_legacy = 1;
 	return 1;
 
 error:
 	memset(buf, 0, sizeof(buf));
 	mp_clear(&num);
+nokey:
 	if (lock)
 		doUnlocking();
 	return 0;
 }
 
+int readKeyFile(int lock) {
+	ppp_trace_mark t;
+	int ret;
+
+	PPP_TRACE_MARK(t);
+	PPP_TRACE1(state_read_start, userUid());
+	ret = _read_key_file(lock);
+	PPP_TRACE3(state_read_done, userUid(), PPP_TRACE_US(t), ret);
+	return ret;
+}
+
 int writeState() {
-	FILE *fp[2];
+	return writeStateEvent(PPP_EVENT_UPDATE);
+}
+
+static int _write_state(int event) {
+	unsigned char rec[JOURNAL_SIZE];
+	int n;
 
-	if ( ! _dir_exists(_key_file_dir()) )
+	if ( ! state_valid)
 		return 0;
 
-	if ( ! pppCheckFlags(PPP_FLAGS_PRESENT)) {
-		/* Update the key file to include flags */
-		pppSetFlags(PPP_FLAGS_PRESENT);
-		fp[0] = fopen(_key_file_name(), "w");
-		if (fp[0]) {
-			_write_data(seqKey(), fp[0]);
-			fclose(fp[0]);
-		}
-	}
+	/* Only the counters change; the key and flags in the file stay
+	 * as they were read (the key in memory may be a temporary one). */
+	if ( ! _state_set_counters(currPasscodeNum(), lastCardGenerated()))
+		return 0;
 
-	fp[0] = fopen(_cnt_file_name(), "w");
-	fp[1] = fopen(_gen_file_name(), "w");
-	if (fp[0] && fp[1]) {
-		_write_data(currPasscodeNum(), fp[0]);
-		fclose(fp[0]);
+	if (daemon_fd >= 0)
+		return _daemon_write();
 
-		_write_data(lastCardGenerated(), fp[1]);
-		fclose(fp[1]);
+	/* The slot in the store is updated in place */
+	if (store_slot) {
+		_store_put(store_slot);
+		return 1;
+	}
 
+	/* The first write after reading the legacy files migrates them */
+	if (state_from_legacy) {
+		if ( ! _state_write())
+			return 0;
+		_remove_legacy_files();
+		state_from_legacy = 0;
 		return 1;
-	} else {
-		if (fp[0])
-			fclose(fp[0]);
-		if (fp[1])
-			fclose(fp[1]);
 	}
 
-	return 0;
+	if ( ! _journal_record(rec, event, currPasscodeNum(), lastCardGenerated()))
+		return 0;
+
+	n = _journal_append(rec);
+	if (n == 0) {
+		/* Can't append; fall back to replacing the state file,
+		 * which leaves the journal stale */
+		return _journal_compact();
+	}
+
+	if (n >= JOURNAL_COMPACT)
+		_journal_compact();
+
+	return 1;
+}
+
+int writeStateEvent(int event) {
+	ppp_trace_mark t;
+	int ret;
+
+	PPP_TRACE_MARK(t);
+	PPP_TRACE2(state_write_start, userUid(), event);
+	ret = _write_state(event);
+	PPP_TRACE3(state_write_done, userUid(), PPP_TRACE_US(t), ret);
+	return ret;
+}
+
+int noteEvent(int event, mp_int *passcodeNum) {
+	unsigned char rec[JOURNAL_SIZE];
+	int locked, n;
+
+	if ( ! state_valid || state_from_legacy || store_slot || daemon_fd >= 0)
+		return 0;
+
+	if ( ! _journal_record(rec, event | JOURNAL_NOTE, passcodeNum, lastCardGenerated()))
+		return 0;
+
+	/* Under the lock, or a compaction could set the journal aside
+	 * just after the note went into it.  If the lock can't be had,
+	 * the note is still better written than not. */
+	locked = isLocked();
+	if ( ! locked)
+		doLocking();
+
+	n = _journal_append(rec);
+
+	/* The state as read may be out of date; a fresh read under the
+	 * lock takes every note into account before compacting */
+	if (n >= JOURNAL_COMPACT && isLocked() && _read_state(1) == 1)
+		_journal_compact();
+
+	if ( ! locked)
+		doUnlocking();
+	return n != 0;
+}
+
+/* Forget the state as read, key and all, and hang up on the daemon,
+ * which releases its lock; pppCleanup() calls this */
+void clearState() {
+	if (daemon_fd >= 0)
+		close(daemon_fd), daemon_fd = -1;
+	daemon_locked = 0;
+	memset(state_rec, 0, STATE_SIZE);
+	state_valid = 0;
+	state_from_legacy = 0;
 }
 
 int writeKeyFile() {
-	FILE *fp[3];
-	char buf[128];
 	int proceed = 1;
 
 	/* create ~/.pppauth if necessary */
-	if ( ! _dir_exists(_key_file_dir()) ) {
-		mkdir(_key_file_dir(), S_IRWXU);
+	if (_key_dir(1) < 0) {
+		fprintf(stderr, "unable to use %s\n", _key_file_dir());
+		return 0;
 	}
 
 	/* warn about overwriting an existing key */
-	if ( _file_exists(_key_file_name()) ) {
+	if ( keyfileExists() ) {
 		proceed = 0;
 		fprintf(stderr, "\n"
 		    "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n"
@@ -636,23 +2765,11 @@ int writeKeyFile() {
 	}
 
 	if (proceed) {
-		_enforce_permissions();
-
 		umask(S_IRWXG|S_IRWXO);
-		fp[0] = fopen(_key_file_name(), "w");
-		fp[1] = fopen(_cnt_file_name(), "w");
-		fp[2] = fopen(_gen_file_name(), "w");
-		if (fp[0] && fp[1] && fp[2]) {
-			_write_data(seqKey(), fp[0]);
-			fclose(fp[0]);
-
-			_write_data(currPasscodeNum(), fp[1]);
-			fclose(fp[1]);
-
-			_write_data(lastCardGenerated(), fp[2]);
-			fclose(fp[2]);
-
-			memset(buf, 0, 128);
+		if (_state_build() && _state_write()) {
+			_remove_legacy_files();
+			_remove_journals();
+			state_from_legacy = 0;
 
 			fprintf(stderr, "\n"
 				"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n"
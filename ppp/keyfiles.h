@@ -34,11 +34,152 @@
 /* Locking failed in current approach */
 extern int lockingFailed;
 
-void setUser(const char *user);
+/* Durability of state updates.  The state file keeps two copies of
+ * the record, and each write goes over the older one, so a torn write
+ * still leaves a good copy.
+ * NONE - never sync
+ * DATA - sync each write (and each journal record) before going on
+ * FULL - also sync the directory when the state file or journal is
+ *        first created, so that it survives a crash
+ */
+#define PPP_SYNC_NONE	0
+#define PPP_SYNC_DATA	1
+#define PPP_SYNC_FULL	2
+
+/* How long to wait for the lock, in milliseconds; see setLockTimeout() */
+#define PPP_LOCK_TIMEOUT	2000
+
+/* Default location of the lock statistics; see setLockStats() */
+#define PPP_STATS_PATH		"/var/run/pppauth.stats"
+
+/* Lock statistics, as counted since the file was created */
+struct ppp_lock_stats {
+	unsigned long long acquired;	/* locks taken */
+	unsigned long long contended;	/* had to wait, whether or not it paid off */
+	unsigned long long timeouts;	/* gave up waiting */
+	unsigned long long errors;	/* failed for some other reason */
+	unsigned long long wait_us;	/* total time spent waiting */
+	unsigned long long max_wait_us;	/* longest wait */
+	unsigned long long conflicts;	/* optimistic updates that had to start again */
+};
+
+/* Default location of the user cache, and how long, in seconds, an
+ * answer stays in it; see setUserCache() */
+#define PPP_USER_CACHE_PATH	"/var/run/pppauth.users"
+#define PPP_USER_CACHE_TTL	60
+
+/* Default location of the rate limits, and the failed logins each
+ * account is allowed: a burst, then one every interval (in seconds);
+ * see setRateLimit() */
+#define PPP_RATELIMIT_PATH	"/var/run/pppauth.ratelimit"
+#define PPP_RATELIMIT_BURST	5
+#define PPP_RATELIMIT_INTERVAL	60
+
+/* Phases of a login, as timed with setTiming() */
+#define PPP_PHASE_LOOKUP	0	/* finding the user */
+#define PPP_PHASE_LOCK		1	/* waiting for locks */
+#define PPP_PHASE_READ		2	/* reading the state */
+#define PPP_PHASE_RESERVE	3	/* reserving the passcode */
+#define PPP_PHASE_PASSCODE	4	/* working out the prompt */
+#define PPP_PHASE_INPUT		5	/* the user typing */
+#define PPP_PHASE_VERIFY	6	/* checking the answer and saving */
+#define PPP_PHASE_TOTAL		7	/* all but the user typing */
+#define PPP_PHASES		8
+
+/* How long the logins took in one phase, in microseconds.  The
+ * buckets have four to each power of two; timingPercentile() reads
+ * them. */
+#define PPP_TIMING_BUCKETS	128
+struct ppp_phase_stats {
+	unsigned long long count;
+	unsigned long long total_us;
+	unsigned long long max_us;
+	unsigned long long buckets[PPP_TIMING_BUCKETS];
+};
+
+/* Default location of the system-wide store; see setStore() */
+#define PPP_STORE_PATH		"/var/lib/ppp/state.db"
+
+/* A user's state record, and where the key is in it */
+#define PPP_STATE_SIZE		128
+#define PPP_STATE_OFF_KEY	16
+#define PPP_STATE_KEY_SIZE	48
+
+/* State daemon (pppstated).  Requests and answers are both one
+ * message of PPP_MSG_SIZE bytes:
+ *   0   request, or status in an answer
+ *   1   flags
+ *   4   user name, NUL terminated
+ *  64   state record
+ * LOAD answers with the user's record, first taking the user's lock
+ * if PPP_MSG_LOCK is set; STORE takes new counters; UNLOCK releases
+ * the lock and gets no answer.  Closing the connection also releases
+ * the lock.
+ */
+#define PPP_DAEMON_SOCKET	"/var/run/pppstated.sock"
+#define PPP_MSG_SIZE		192
+#define PPP_MSG_OFF_OP		0
+#define PPP_MSG_OFF_FLAGS	1
+#define PPP_MSG_OFF_NAME	4
+#define PPP_MSG_NAME_SIZE	56
+#define PPP_MSG_OFF_REC		64
+#define PPP_OP_LOAD		1
+#define PPP_OP_STORE		2
+#define PPP_OP_UNLOCK		3
+#define PPP_MSG_LOCK		0x01
+#define PPP_STATUS_OK		0
+#define PPP_STATUS_NOUSER	1
+#define PPP_STATUS_ERROR	2
+
+/* Default location of the reservation table; see setReserveTable() */
+#define PPP_RESERVE_PATH	"/var/run/pppauth.reserve"
+
+/* Events recorded in the counter journal */
+#define PPP_EVENT_UPDATE	0	/* counters changed by pppauth */
+#define PPP_EVENT_RESERVE	1	/* passcode reserved for a login */
+#define PPP_EVENT_SUCCESS	2	/* login succeeded */
+#define PPP_EVENT_FAILURE	3	/* login failed */
+#define PPP_EVENT_RELEASE	4	/* reserved passcode given back */
+
+int setUser(const char *user);
+unsigned long userUid();
+void setUserCache(const char *path);
+void setUserCacheTTL(long seconds);
+void setDurability(int level);
+void setLockTimeout(long ms);
+void setLockRequired(int required);
+void setLockStats(const char *path);
+int readLockStats(const char *path, struct ppp_lock_stats *st);
+int readTimingStats(const char *path, struct ppp_phase_stats *phases);
+unsigned long long timingPercentile(const struct ppp_phase_stats *phase, double q);
+void setTiming(int on);
+void timingStart();
+void timingPhase(int phase);
+unsigned long timingEnd();
+unsigned long timingPhaseUs(int phase);
+void setRateLimit(const char *path);
+void setRateLimitBurst(int tries);
+void setRateLimitInterval(long seconds);
+int rateLimitTake();
+void rateLimitGive();
+void setStore(const char *path);
+void setDaemon(const char *path);
+void setReserveTable(const char *path);
+int reserveFromTable(mp_int *num);
+void setOptimistic(int on);
+int reserveOptimistic(mp_int *num);
+int persistPasscodeNum(mp_int *num, int event);
+int storeLoad(const char *user, unsigned char *rec);
+int storeSave(const char *user, const unsigned char *rec);
+int storeImport();
+int storeExport();
 int keyfileExists();
 int writeKeyFile();
 int writeState();
+int writeStateEvent(int event);
+int noteEvent(int event, mp_int *passcodeNum);
 int readKeyFile(int lock);
+void clearState();
 
 int doLocking();
 int doUnlocking();
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 
 #include "ppp.h"
 
@@ -81,6 +82,50 @@
 	#include <pam/_pam_macros.h>
 #endif	
 
+/* The status after a successful login, for pam_sm_open_session() */
+#define STATUS_DATA	"pam_ppp_status"
+
+static void _free_status(pam_handle_t *pamh, void *data, int error_status) {
+	(void)pamh;
+	(void)error_status;
+	free(data);
+}
+
+/* How a combined password and passcode may come from the stack */
+#define FIRST_PASS_NO	0	/* always ask */
+#define FIRST_PASS_TRY	1	/* ask if no module before has */
+#define FIRST_PASS_USE	2	/* never ask */
+
+/* Check the passcode at the end of a combined token, and leave the
+ * password in front of it (and of sep, if given) for the modules after
+ * this one */
+static int _authenticate_combined(pam_handle_t *pamh, const char *token, char sep) {
+	size_t len = strlen(token), pwlen;
+	char *password;
+	int ok;
+
+	if (len < PPP_PASSCODE_LEN + (sep ? 1 : 0)
+	    || (sep && token[len - PPP_PASSCODE_LEN - 1] != sep)) {
+		/* Still a wrong answer, as far as the counter goes */
+		pppAuthenticate("");
+		return 0;
+	}
+
+	pwlen = len - PPP_PASSCODE_LEN - (sep ? 1 : 0);
+	ok = pppAuthenticate(token + len - PPP_PASSCODE_LEN);
+	if (ok) {
+		password = malloc(pwlen + 1);
+		if (password == NULL)
+			return 0;
+		memcpy(password, token, pwlen);
+		password[pwlen] = '\0';
+		ok = pam_set_item(pamh, PAM_AUTHTOK, password) == PAM_SUCCESS;
+		memset(password, 0, pwlen);
+		free(password);
+	}
+	return ok;
+}
+
 /* --- authentication management functions --- */
 PAM_EXTERN
 int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
@@ -88,6 +133,7 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **ar
 	const char *user=NULL;
 
 	const char enforced_msg[] = "OTP not configured, unable to login";
+	const char ratelimit_msg[] = "Too many failed logins, try again later";
 
 	/* Required for communication with user */
 	struct pam_conv *conversation;
@@ -104,7 +150,18 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **ar
 	 * fail to login */
 	int enforced = 0;	/* Do we enforce OTP logons? */
 	int lock = 1;		/* Is locking enabled? */
+	int lockrequired = 0;	/* Fail if the lock can't be had? */
 	int secure = 0;		/* Do we allow dontSkip? */
+	int reserve = 0;	/* Reserve from the shared table? */
+	int optimistic = 0;	/* Read without the lock? */
+	int known;		/* Does the user exist? */
+	int found;		/* Has the user a key? */
+	long slowlog = 0;	/* Log logins slower than this, in ms */
+	unsigned long took;
+	int combined = 0;	/* Password and passcode in one answer? */
+	char separator = '\0';	/* What comes between them, if anything */
+	int first_pass = FIRST_PASS_NO;
+	const char *token = NULL;
 	int show = 1;		/* Shall we echo entered passcode? 
 				 * 1 - user selected
 				 * 0 - (noshow) echo disabled
@@ -115,12 +172,64 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **ar
 			enforced = 1;
 		else if (strcmp("nolock", *argv) == 0)
 			lock = 0;
+		else if (strcmp("lockrequired", *argv) == 0)
+			lockrequired = 1, setLockRequired(1);
+		else if (strncmp("locktimeout=", *argv, 12) == 0)
+			setLockTimeout(atol(*argv + 12));
+		else if (strcmp("stats", *argv) == 0)
+			setLockStats(PPP_STATS_PATH);
+		else if (strncmp("stats=", *argv, 6) == 0)
+			setLockStats(*argv + 6);
 		else if (strcmp("secure", *argv) == 0)
 			secure = 1;
 		else if (strcmp("show", *argv) == 0)
 			show = 2;
 		else if (strcmp("noshow", *argv) == 0)
 			show = 0;
+		else if (strcmp("sync=none", *argv) == 0)
+			setDurability(PPP_SYNC_NONE);
+		else if (strcmp("sync=data", *argv) == 0)
+			setDurability(PPP_SYNC_DATA);
+		else if (strcmp("sync=full", *argv) == 0)
+			setDurability(PPP_SYNC_FULL);
+		else if (strncmp("store=", *argv, 6) == 0)
+			setStore(*argv + 6);
+		else if (strcmp("optimistic", *argv) == 0)
+			optimistic = 1;
+		else if (strcmp("reserve", *argv) == 0)
+			reserve = 1, setReserveTable(PPP_RESERVE_PATH);
+		else if (strncmp("reserve=", *argv, 8) == 0)
+			reserve = 1, setReserveTable(*argv + 8);
+		else if (strcmp("daemon", *argv) == 0)
+			setDaemon(PPP_DAEMON_SOCKET);
+		else if (strncmp("daemon=", *argv, 7) == 0)
+			setDaemon(*argv + 7);
+		else if (strcmp("usercache", *argv) == 0)
+			setUserCache(PPP_USER_CACHE_PATH);
+		else if (strncmp("usercache=", *argv, 10) == 0)
+			setUserCache(*argv + 10);
+		else if (strncmp("usercachettl=", *argv, 13) == 0)
+			setUserCacheTTL(atol(*argv + 13));
+		else if (strcmp("combined", *argv) == 0)
+			combined = 1;
+		else if (strncmp("combined=", *argv, 9) == 0)
+			combined = 1, separator = (*argv)[9];
+		else if (strcmp("try_first_pass", *argv) == 0)
+			first_pass = FIRST_PASS_TRY;
+		else if (strcmp("use_first_pass", *argv) == 0)
+			first_pass = FIRST_PASS_USE;
+		else if (strcmp("timing", *argv) == 0)
+			setTiming(1);
+		else if (strncmp("slowlog=", *argv, 8) == 0)
+			slowlog = atol(*argv + 8), setTiming(1);
+		else if (strcmp("ratelimit", *argv) == 0)
+			setRateLimit(PPP_RATELIMIT_PATH);
+		else if (strncmp("ratelimit=", *argv, 10) == 0)
+			setRateLimit(*argv + 10);
+		else if (strncmp("ratelimitburst=", *argv, 15) == 0)
+			setRateLimitBurst(atoi(*argv + 15));
+		else if (strncmp("ratelimitinterval=", *argv, 18) == 0)
+			setRateLimitInterval(atol(*argv + 18));
 	}
 
 	/*
@@ -143,12 +252,40 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **ar
 
 	retval = PAM_AUTH_ERR;
 	
+	timingStart();
 	pppInit();
 	
-	setUser(user);
-	if ( ! readKeyFile(lock)) {
+	/* The reservation table makes the lock unnecessary until a
+	 * passcode has been accepted; optimistic reads only take it
+	 * to write.  A user that doesn't exist has no key to read. */
+	setOptimistic(lock && optimistic);
+	known = setUser(user);
+	timingPhase(PPP_PHASE_LOOKUP);
+
+	/* An account that has used up its failures isn't even read */
+	if (known && ! rateLimitTake()) {
+		D(("too many failed logins"));
+		retval = PAM_MAXTRIES;
+		if (!(flags & PAM_SILENT)) {
+			message.msg_style = PAM_TEXT_INFO;
+			message.msg = ratelimit_msg;
+			conversation->conv(1,
+				(const struct pam_message**)&pmessage,
+				&resp, conversation->appdata_ptr);
+			if (resp)
+				_pam_drop_reply(resp, 1);
+		}
+		goto cleanup;
+	}
+
+	found = known && readKeyFile(lock && !reserve && !optimistic);
+	timingPhase(PPP_PHASE_READ);
+	if ( ! found) {
 		/* If not enforcing - ignore, otherwise - fail */
-		if (enforced == 0)
+		if (lockrequired && lockingFailed) {
+			D(("unable to lock file, failing"));
+			retval = PAM_AUTH_ERR;
+		} else if (enforced == 0)
 			retval = PAM_IGNORE;
 		else if (!(flags & PAM_SILENT)) {
 			/* Tell why */
@@ -171,7 +308,7 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **ar
 	}
 
 	/* Lock files */
-	if (lock && !isLocked()) {
+	if (lock && !reserve && !optimistic && !isLocked()) {
 		D(("unable to lock file! Race condition possible."));
 	}
 	
@@ -181,33 +318,100 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **ar
 		reservePasscodeNum();
 	}
 
+	/* Falling back from the table may have needed the lock */
+	if (lock && lockrequired && lockingFailed) {
+		D(("unable to lock file, failing"));
+		doUnlocking();
+		goto cleanup;
+	}
+
 	/* We have reserved Passcode and saved new file data
 	 * release the locks */
 	if (lock)
 		doUnlocking();
+	timingPhase(PPP_PHASE_RESERVE);
 	
-	/* Echo on if enforced by "show" option or enabled by user
-	 * and not disabled by "noshow" option */
-	if ((show == 2) || (show == 1 && pppCheckFlags(PPP_SHOW_PASSCODE))) {
+	/* In combined mode the password and the passcode come as one
+	 * answer: from a module before this one, or from a single prompt
+	 * that is never echoed */
+	retval = PAM_AUTH_ERR;
+	if (combined) {
+		if (first_pass != FIRST_PASS_NO)
+			pam_get_item(pamh, PAM_AUTHTOK, (const void **)&token);
+		if (token) {
+			if (_authenticate_combined(pamh, token, separator))
+				retval = PAM_SUCCESS;
+			goto status;
+		}
+		if (first_pass == FIRST_PASS_USE) {
+			pppAuthenticate("");
+			goto status;
+		}
+	}
+
+	/* A password is never echoed; otherwise echo on if enforced by
+	 * "show" option or enabled by user and not disabled by "noshow"
+	 * option */
+	if (combined) {
+		message.msg_style = PAM_PROMPT_ECHO_OFF;
+		message.msg = currPromptFor("Password and passcode");
+	} else if ((show == 2) || (show == 1 && pppCheckFlags(PPP_SHOW_PASSCODE))) {
 		message.msg_style = PAM_PROMPT_ECHO_ON;
+		message.msg = currPrompt();
 	} else {
 		message.msg_style = PAM_PROMPT_ECHO_OFF;
+		message.msg = currPrompt();
 	}
-	message.msg = currPrompt();
+	
+	timingPhase(PPP_PHASE_PASSCODE);
 	
 	conversation->conv(1, (const struct pam_message **)&pmessage,
 			&resp, conversation->appdata_ptr);
+	timingPhase(PPP_PHASE_INPUT);
 	
-	retval = PAM_AUTH_ERR;
 	if (resp) {
-		if (pppAuthenticate(resp[0].resp))
+		if (combined ? _authenticate_combined(pamh, resp[0].resp, separator)
+		    : pppAuthenticate(resp[0].resp))
 			retval = PAM_SUCCESS;
 		_pam_drop_reply(resp, 1);
+	} else {
+		/* Abandoned, but the passcode has been shown, and must be
+		 * recorded as tried */
+		pppAuthenticate("");
+	}
+
+status:
+	timingPhase(PPP_PHASE_VERIFY);
+
+	/* Keep what the session's warnings need, so that it doesn't
+	 * have to read the key again */
+	if (retval == PAM_SUCCESS) {
+		struct ppp_status *st = malloc(sizeof(*st));
+
+		if (st) {
+			pppStatus(st);
+			if (pam_set_data(pamh, STATUS_DATA, st, _free_status) != PAM_SUCCESS)
+				free(st);
+		}
 	}
 
 cleanup:
+	/* Only failures count against the rate limit */
+	if (retval != PAM_AUTH_ERR)
+		rateLimitGive();
 	pppCleanup();
 
+	took = timingEnd();
+	if (slowlog > 0 && took >= (unsigned long)slowlog * 1000)
+		syslog(LOG_AUTHPRIV | LOG_NOTICE, "pam_ppp: slow login for %s: %lu.%03lu ms "
+		    "(lookup %lu, lock %lu, read %lu, reserve %lu, passcode %lu, "
+		    "verify %lu us; typing %lu ms), result %d", user,
+		    took / 1000, took % 1000,
+		    timingPhaseUs(PPP_PHASE_LOOKUP), timingPhaseUs(PPP_PHASE_LOCK),
+		    timingPhaseUs(PPP_PHASE_READ), timingPhaseUs(PPP_PHASE_RESERVE),
+		    timingPhaseUs(PPP_PHASE_PASSCODE), timingPhaseUs(PPP_PHASE_VERIFY),
+		    timingPhaseUs(PPP_PHASE_INPUT) / 1000, retval);
+
 	return retval;
 }
 
@@ -228,6 +432,9 @@ PAM_EXTERN
 int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv) {
 	int retval = PAM_IGNORE;
 	const char *user;
+	const void *data;
+	struct ppp_status st;
+	int n;
 
 	struct pam_conv *conversation;
 	struct pam_message message;
@@ -243,17 +450,25 @@ int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **ar
 	}
 
 	message.msg_style = PAM_TEXT_INFO;
-	
-	pppInit();
-	setUser((char *)user);
-	if ( ! readKeyFile(0)) {
-		user = NULL;
-		/* TODO return a more appropriate error here */
-		return PAM_USER_UNKNOWN;
+
+	/* Left by pam_sm_authenticate(); without it (another module did
+	 * the authentication) the key must be read */
+	if (pam_get_data(pamh, STATUS_DATA, &data) == PAM_SUCCESS && data) {
+		memcpy(&st, data, sizeof(st));
+	} else {
+		pppInit();
+		if ( ! setUser(user) || ! readKeyFile(0)) {
+			pppCleanup();
+			user = NULL;
+			/* TODO return a more appropriate error here */
+			return PAM_USER_UNKNOWN;
+		}
+		pppStatus(&st);
+		pppCleanup();
 	}
 	
 	char buffer[2048];
-	while (pppWarning(buffer, 2048)) {
+	for (n = 0; pppStatusWarning(&st, n, buffer, 2048); n++) {
 		if (strlen(buffer)) {
 			message.msg = buffer;
 	
@@ -266,8 +481,6 @@ int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **ar
 		}
 	}
 
-	pppCleanup();
-
 	return retval;
 }
 
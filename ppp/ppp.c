@@ -38,9 +38,15 @@
 #include <pwd.h>
 
 #include "ppp.h"
+#include "keyfiles.h"
+#include "trace.h"
 
 #define KEY_BITS (int)256
 
+/* How the passcode being asked for was reserved */
+#define RESERVED_STATE	1	/* counter advanced in the state */
+#define RESERVED_TABLE	2	/* taken from the reservation table */
+
 /* IMPORTANT NOTE
  *
  * If you update the PPP algorithm in any way, it's important
@@ -78,7 +84,7 @@ static int nRounds = 0;
 static mp_int d_seqKey;
 static mp_int d_currPasscodeNum;
 static mp_int d_reservedPasscodeNum;
-static char d_reserved;
+static char d_reserved;		/* RESERVED_STATE or RESERVED_TABLE if reserved */
 
 static mp_int d_lastCardGenerated;
 static mp_int d_maxPasscodes;
@@ -90,57 +96,21 @@ static int d_code_len = 0;
 static char *d_buf = NULL;
 static int d_buflen = 0;
 
-typedef union {
-	unsigned char bytes[4];
-	unsigned int val;
-} utype;
-
-static void _bytes_to_mp(unsigned char *bytes, mp_int *mp, int len) {
-	mp_read_unsigned_bin(mp, bytes, len);
-}
-
-static void _mp_to_bytes(mp_int *mp, unsigned char *bytes, int len) {
-	int i;
-	for (i=0; i<len; i++) {
-		bytes[i] = '\x00';
-	}
-	i = len - mp_unsigned_bin_size(mp);
-	mp_to_unsigned_bin(mp, bytes+i);
-}
-
-static void _reverse_bytes(unsigned char *buf, int len) {
-	/* We use _reverse_bytes() in here because the MPI library
-	 * stores it's numbers in opposite endianness to the PPP
-	 * sequence key specification.
-	 */
-	int i;
-	unsigned char temp;
-	for (i=0; i<len/2; i++) {
-		temp = buf[i];
-		buf[i] = buf[len-i-1];
-		buf[len-i-1] = temp;
-	}
-}
+/* The PPP specification gives the sequence key, and the AES keys and
+ * plaintext taken from it, least significant byte first; hence the
+ * _le conversions below.
+ */
 
 static void _mp_to_uint(mp_int *mp, unsigned int *i) {
-	utype tell, v;
-
-	tell.val = 0x4d494d49;
-	v.val = 0;
+	unsigned char v[sizeof(unsigned int)];
+	size_t n;
 
-	mp_to_unsigned_bin(mp, v.bytes);
+	mp_to_fixlen_bin(mp, v, sizeof(v));
 
-	/* We can't just use htonl() here because it swaps bytes
-	 * on intel (little-endian) platforms and it's motorolla
-	 * (big-endian) platforms where we want to swap bytes.
-	 */
-	if (tell.bytes[0] == 'M') {
-		_reverse_bytes(v.bytes, 4);
+	*i = 0;
+	for (n=0; n<sizeof(v); n++) {
+		*i = (*i << 8) | v[n];
 	}
-
-	*i = v.val;
-
-	v.val = 0;
 }
 
 #define _zero_bytes(_buf, _size) memset(_buf, 0, _size)
@@ -158,10 +128,7 @@ static void _locate_passcode(mp_int *passcodeNum, mp_int *cipherNum, mp_int *off
 	mp_mul_d(cipherNum, 3, cipherNum);
 }
 
-static char *_extract_passcode_from_block(mp_int *cipherBlock, int n) {
-	static unsigned char cipherdata[16*3];
-	_mp_to_bytes(cipherBlock, cipherdata, 16*3);
-
+static char *_extract_passcode_from_block(const unsigned char *cipherdata, int n) {
 	int i = n * 3;
 
 	d_passcode[0] = alphabet[(int)(cipherdata[i]&0x3f)];
@@ -170,59 +137,43 @@ static char *_extract_passcode_from_block(mp_int *cipherBlock, int n) {
 	d_passcode[3] = alphabet[(int)((cipherdata[i+2]&0xfc)>>2)];
 	d_passcode[4] = '\x00';
 
-	_zero_bytes(cipherdata, 16*3);
-
 	return d_passcode;
 }
 
-static void _setup_encrypt(mp_int *key) {
-	unsigned char k[32];
-	_mp_to_bytes(key, k, 32);
-	_reverse_bytes(k, 32);
-
-	nRounds = rijndaelSetupEncrypt(rk, k, KEY_BITS);
-
-	_zero_bytes(k, 32);
-}
-
-static void _encrypt(mp_int *plain, mp_int *cipher) {
+static void _encrypt(mp_int *plain, unsigned char *cipher) {
 	unsigned char p[16];
-	unsigned char c[16];
 
-	_mp_to_bytes(plain, p, 16);
-	_reverse_bytes(p, 16);
-	rijndaelEncrypt(rk, nRounds, p, c);
-	_bytes_to_mp(c, cipher, 16);
+	mp_to_fixlen_bin_le(plain, p, 16);
+	rijndaelEncrypt(rk, nRounds, p, cipher);
 
 	_zero_bytes(p, 16);
-	_zero_bytes(c, 16);
 }
 
 
-static void _compute_passcode_block(mp_int *cipherNum, mp_int *cipherBlock) {
+static void _compute_passcode_block(mp_int *cipherNum, unsigned char *cipherBlock) {
+	ppp_trace_mark t;
+	PPP_TRACE_MARK(t);
+
 	unsigned char seqkey[48];
-	_mp_to_bytes(&d_seqKey, seqkey, 48);
+	mp_to_fixlen_bin_le(&d_seqKey, seqkey, 48);
 
-	unsigned char *kp = seqkey;
+	/* get encryption key from sequence key (32 MSBs); version 2 keys
+	 * are only 32 bytes long
+	 */
+	unsigned char *kp = seqkey + 16;
 	if (keyVersion() == 2) {
-		kp += 16;
+		kp = seqkey;
 	}
 
-	/* get encryption key from sequence key (32 MSBs) */
-	mp_int key;
-	mp_init(&key);
-	mp_read_unsigned_bin(&key, kp, 32);
-
 	/* prepare for encryption */
-	_setup_encrypt(&key);
-	mp_clear(&key);
+	nRounds = rijndaelSetupEncrypt(rk, kp, KEY_BITS);
 
 	/* get offset from sequence key (16 LSBs) */
 	mp_int offset;
 	mp_init(&offset);
 	switch (keyVersion()) {
 	case 1:
-		mp_read_unsigned_bin(&offset, seqkey+32, 16);
+		mp_read_unsigned_bin_le(&offset, seqkey, 16);
 		break;
 	case 2:
 		/* version 2 does away with the offset */
@@ -246,27 +197,18 @@ static void _compute_passcode_block(mp_int *cipherNum, mp_int *cipherBlock) {
 	mp_mod(&plaintext, &modulus, &plaintext);
 
 	/* get ciphertext */
-	unsigned char cipherblock[16*3];
-	mp_int cipher;
-	mp_init(&cipher);
-	_encrypt(&plaintext, &cipher);
-	_mp_to_bytes(&cipher, cipherblock, 16);
+	_encrypt(&plaintext, cipherBlock);
 	mp_add_d(&plaintext, 1, &plaintext);
 	mp_mod(&plaintext, &modulus, &plaintext);
-	_encrypt(&plaintext, &cipher);
-	_mp_to_bytes(&cipher, cipherblock+16, 16);
+	_encrypt(&plaintext, cipherBlock+16);
 	mp_add_d(&plaintext, 1, &plaintext);
 	mp_mod(&plaintext, &modulus, &plaintext);
 	mp_clear(&modulus);
-	_encrypt(&plaintext, &cipher);
+	_encrypt(&plaintext, cipherBlock+32);
 	mp_clear(&plaintext);
 	_zero_rijndael_state();
-	_mp_to_bytes(&cipher, cipherblock+32, 16);
-	mp_clear(&cipher);
 
-	/* return cipherBlock */
-	_bytes_to_mp(cipherblock, cipherBlock, 16*3);
-	_zero_bytes(cipherblock, 16*3);
+	PPP_TRACE2(passcode, userUid(), PPP_TRACE_US(t));
 }
 
 
@@ -274,6 +216,7 @@ static void _compute_passcode_block(mp_int *cipherNum, mp_int *cipherBlock) {
 void pppInit() {
 	mp_init(&d_seqKey);
 	mp_init(&d_currPasscodeNum);
+	mp_init(&d_reservedPasscodeNum);
 	d_reserved = 0;
 	mp_init(&d_lastCardGenerated);
 
@@ -299,11 +242,13 @@ void pppCleanup() {
 	 */
 	mp_clear(&d_seqKey);
 	mp_clear(&d_currPasscodeNum);
+	mp_clear(&d_reservedPasscodeNum);
 	mp_clear(&d_lastCardGenerated);
 	mp_clear(&d_maxPasscodes);
 
 	_zero_bytes((unsigned char *)d_passcode, 5);
 	_zero_rijndael_state();
+	clearState();
 
 	_zero_bytes((unsigned char *)d_prompt, d_prompt_len);
 	free(d_prompt);
@@ -313,6 +258,10 @@ void pppCleanup() {
 	free(d_buf);
 	_zero_bytes((unsigned char *)alphabet, alphabetlen);
 	free(alphabet);
+
+	/* The session may start over with pppInit() in this process */
+	d_prompt = d_code = d_buf = alphabet = NULL;
+	d_prompt_len = d_code_len = d_buflen = alphabetlen = 0;
 }
 
 char *mpToDecimalString(mp_int *mp, char groupChar) {
@@ -388,37 +337,56 @@ char *currCode() {
 }
 
 char *currPrompt() {
-	int length = strlen("Passcode : ") + strlen(currCode()) + 6 + 4;
+	return currPromptFor("Passcode");
+}
+
+char *currPromptFor(const char *what) {
+	int length = strlen(what) + strlen(" : ") + strlen(currCode()) + 6 + 4;
 	/* Warn about some locking issues */
 	if (lockingFailed)
 		length += strlen("(no lock) ");
 	free(d_prompt);
 	d_prompt = (char *)malloc(length);
 	if (lockingFailed)
-		sprintf(d_prompt, "(no lock) Passcode %s: ", currCode());
+		sprintf(d_prompt, "(no lock) %s %s: ", what, currCode());
 	else
-		sprintf(d_prompt, "Passcode %s: ", currCode());
+		sprintf(d_prompt, "%s %s: ", what, currCode());
 	d_prompt_len = length;
 	return d_prompt;
 }
 
 
 int pppAuthenticate(const char *attempt) {
+	ppp_trace_mark t;
 	int rv = 0;
 
+	PPP_TRACE_MARK(t);
 	if (strcmp(getPasscode(currAuthPasscodeNum()), attempt) == 0) {
 		rv = 1;
 		if (!d_reserved) {
 			/* Increment now, wasn't incremented before */
 			incrCurrPasscodeNum();
-			writeState();
+			writeStateEvent(PPP_EVENT_SUCCESS);
+		} else if (d_reserved == RESERVED_TABLE) {
+			/* The state must move past the passcode now that it
+			 * has been used */
+			mp_add_d(&d_reservedPasscodeNum, 1, &d_currPasscodeNum);
+			persistPasscodeNum(&d_currPasscodeNum, PPP_EVENT_SUCCESS);
+		} else {
+			noteEvent(PPP_EVENT_SUCCESS, &d_reservedPasscodeNum);
 		}
 	} else {
 		if ( ! pppCheckFlags(PPP_DONT_SKIP_ON_FAILURES)) {
 			if (!d_reserved) {
 				/* Increment now */
 				incrCurrPasscodeNum();
-				writeState();
+				writeStateEvent(PPP_EVENT_FAILURE);
+			} else if ( ! noteEvent(PPP_EVENT_FAILURE, &d_reservedPasscodeNum)
+			    && d_reserved == RESERVED_TABLE) {
+				/* Nowhere to note it, and the table won't
+				 * remember it past a reboot */
+				mp_add_d(&d_reservedPasscodeNum, 1, &d_currPasscodeNum);
+				persistPasscodeNum(&d_currPasscodeNum, PPP_EVENT_FAILURE);
 			}
 		} else {
 			if (d_reserved) {
@@ -428,7 +396,7 @@ int pppAuthenticate(const char *attempt) {
 				 * UPDATE: This will never happen, as pam module doesn't reserve
 				 * passwords if dontSkip is enabled */
 				decrCurrPasscodeNum();
-				writeState();
+				writeStateEvent(PPP_EVENT_RELEASE);
 			}
 		}
 	}
@@ -436,20 +404,33 @@ int pppAuthenticate(const char *attempt) {
 
 	_zero_bytes((unsigned char *)d_passcode, 5);
 
+	PPP_TRACE3(auth, userUid(), rv, PPP_TRACE_US(t));
 	return rv;
 }
 
-int pppWarning(char *buf, int size) {
-	static int warnNum = 0;
+void pppStatus(struct ppp_status *st) {
 	mp_int mp;
 	mp_init(&mp);
 
+	/* Only the last card's worth matters to the warnings */
+	getNumPrintedCodesRemaining(&mp);
+	if (mp_cmp_z(&mp) <= 0)
+		st->remaining = 0;
+	else if (mp_cmp_d(&mp, 70) > 0)
+		st->remaining = 71;
+	else
+		st->remaining = (int)DIGIT(&mp, 0);
+	st->upgrade = pppVersion() > keyVersion() ? pppVersion() : 0;
+
+	mp_clear(&mp);
+}
+
+int pppStatusWarning(const struct ppp_status *st, int n, char *buf, int size) {
 	buf[0] = '\x00';
 
-	switch (warnNum) {
+	switch (n) {
 	case 0:
-		getNumPrintedCodesRemaining(&mp);
-		if (mp_cmp_d(&mp, 70) <= 0 && mp_cmp_d(&mp, 14) > 0) {
+		if (st->remaining <= 70 && st->remaining > 14) {
 			snprintf(buf, size, "\n"
 				"===========================================================\n"
 				"  You are on your last printed passcard. Please print\n"
@@ -459,21 +440,19 @@ int pppWarning(char *buf, int size) {
 		}
 		break;
 	case 1:
-		getNumPrintedCodesRemaining(&mp);
-		if (mp_cmp_d(&mp, 14) <= 0 && mp_cmp_d(&mp, 0) > 0) {
+		if (st->remaining <= 14 && st->remaining > 0) {
 			snprintf(buf, size, "\n"
 				"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n"
-				"  You have %s printed passcode%s remaining. Please print\n"
+				"  You have %d printed passcode%s remaining. Please print\n"
 				"  more passcodes IMMEDIATELY so you can continue to log\n"
 				"  into your account.\n"
 				"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n",
-				mpToDecimalString(&mp, 0), (mp_cmp_d(&mp, 1) ? "s":"")
+				st->remaining, (st->remaining != 1 ? "s":"")
 			);
 		}
 		break;
 	case 2:
-		getNumPrintedCodesRemaining(&mp);
-		if (mp_cmp_d(&mp, 0) <= 0) {
+		if (st->remaining <= 0) {
 			snprintf(buf, size, "\n"
 				"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n"
 				"            WARNING:  YOU ARE OUT OF PASSCODES             \n"
@@ -485,7 +464,7 @@ int pppWarning(char *buf, int size) {
 		}
 		break;
 	case 3:
-		if (pppVersion() > keyVersion()) {
+		if (st->upgrade) {
 			snprintf(buf, size, "\n"
 				"===========================================================\n"
 				"            NOTICE:  NEW PPP VERSION AVAILABLE             \n"
@@ -495,16 +474,27 @@ int pppWarning(char *buf, int size) {
 				"  It is recommended that you upgrade to the new version by\n"
 				"  generating a new random key and printing new passcodes.\n"
 				"===========================================================\n",
-				pppVersion()
+				st->upgrade
 			);
 		}
 		break;
 	default:
-		warnNum = -1;
-		break;
+		return 0;
 	}
 
-	mp_clear(&mp);
+	return 1;
+}
+
+int pppWarning(char *buf, int size) {
+	static int warnNum = 0;
+	static struct ppp_status st;
+
+	if (warnNum == 0)
+		pppStatus(&st);
+	if ( ! pppStatusWarning(&st, warnNum, buf, size)) {
+		warnNum = 0;
+		return 0;
+	}
 	return ++warnNum;
 }
 
@@ -548,14 +538,37 @@ void decrCurrPasscodeNum() {
 }
 
 
-void reservePasscodeNum(void) {
+static void _reserve_passcode_num(void) {
+	/* With a reservation table, parallel sessions get different
+	 * passcodes without touching the state at all */
+	if (reserveFromTable(&d_reservedPasscodeNum)) {
+		d_reserved = RESERVED_TABLE;
+		mp_add_d(&d_reservedPasscodeNum, 1, &d_currPasscodeNum);
+		return;
+	}
+
+	/* Or with the lock held just long enough to check that the
+	 * state hasn't moved on since it was read, and to write it */
+	if (reserveOptimistic(&d_reservedPasscodeNum)) {
+		d_reserved = RESERVED_STATE;
+		return;
+	}
+
 	mp_copy(&d_currPasscodeNum, &d_reservedPasscodeNum);
-	d_reserved = 1;
+	d_reserved = RESERVED_STATE;
 
-	/* Increment num, so parallel sessions won't reserve the same passCode */
-	/* FIXME: Races should be fixed by some lock file */
+	/* Increment num, so parallel sessions won't reserve the same passCode;
+	 * this relies on the caller holding the lock */
 	incrCurrPasscodeNum();
-	writeState();
+	writeStateEvent(PPP_EVENT_RESERVE);
+}
+
+void reservePasscodeNum(void) {
+	ppp_trace_mark t;
+
+	PPP_TRACE_MARK(t);
+	_reserve_passcode_num();
+	PPP_TRACE3(reserve, userUid(), d_reserved, PPP_TRACE_US(t));
 }
 
 mp_int *lastCardGenerated() {
@@ -596,14 +609,12 @@ void generateSequenceKeyFromPassphrase(const char *phrase) {
 	switch (keyVersion()) {
 	case 1:
 		sha384((const unsigned char *)phrase, strlen(phrase), bytes);
-		_reverse_bytes(bytes, 48);
-		_bytes_to_mp(bytes, &d_seqKey, 48);
+		mp_read_unsigned_bin_le(&d_seqKey, bytes, 48);
 		_zero_bytes(bytes, 48);
 		break;
 	case 2:
 		sha256((const unsigned char *)phrase, strlen(phrase), bytes);
-		_reverse_bytes(bytes, 32);
-		_bytes_to_mp(bytes, &d_seqKey, 32);
+		mp_read_unsigned_bin_le(&d_seqKey, bytes, 32);
 		_zero_bytes(bytes, 32);
 		break;
 	default:
@@ -672,15 +683,13 @@ void generateRandomSequenceKey() {
 	case 1:
 		sha384(entropyPool, entropyLen, bytes);
 		_zero_bytes(entropyPool, entropyLen);
-		_reverse_bytes(bytes, 48);
-		_bytes_to_mp(bytes, &d_seqKey, 48);
+		mp_read_unsigned_bin_le(&d_seqKey, bytes, 48);
 		_zero_bytes(bytes, 48);
 		break;
 	case 2:
 		sha256(entropyPool, entropyLen, bytes);
 		_zero_bytes(entropyPool, entropyLen);
-		_reverse_bytes(bytes, 32);
-		_bytes_to_mp(bytes, &d_seqKey, 32);
+		mp_read_unsigned_bin_le(&d_seqKey, bytes, 32);
 		_zero_bytes(bytes, 32);
 	break;
 	default:
@@ -717,16 +726,15 @@ char *getPasscode(const mp_int *n) {
 
 	/* Get ciphertext block (cipher N, N+1, N+2)
 	 */
-	mp_int cipherBlock;
-	mp_init(&cipherBlock);
-	_compute_passcode_block(&cipherNum, &cipherBlock);
+	unsigned char cipherBlock[16*3];
+	_compute_passcode_block(&cipherNum, cipherBlock);
 	mp_clear(&cipherNum);
 
 	_mp_to_uint(&offset, &ofs);
 	mp_clear(&offset);
 
-	char *passcode = _extract_passcode_from_block(&cipherBlock, ofs);
-	mp_clear(&cipherBlock);
+	char *passcode = _extract_passcode_from_block(cipherBlock, ofs);
+	_zero_bytes(cipherBlock, 16*3);
 	ofs = 0;
 
 	return passcode;
@@ -735,8 +743,7 @@ char *getPasscode(const mp_int *n) {
 void getPasscodeBlock(mp_int *startingPasscodeNum, int qty, char *output) {
 	int i;
 
-	mp_int cipherBlock;
-	mp_init (&cipherBlock);
+	unsigned char cipherBlock[16*3];
 
 	mp_int cipherNum;
 	mp_init(&cipherNum);
@@ -759,16 +766,17 @@ void getPasscodeBlock(mp_int *startingPasscodeNum, int qty, char *output) {
 		_locate_passcode(&passcodeNum, &cipherNum, &offset);
 
 		if (mp_cmp(&cipherNum, &lastCipherNum) != 0) {
-			_compute_passcode_block(&cipherNum, &cipherBlock);
+			_compute_passcode_block(&cipherNum, cipherBlock);
 			mp_copy(&cipherNum, &lastCipherNum);
 		}
 
 		_mp_to_uint(&offset, &ofs);
-		strncpy(output+4*i, _extract_passcode_from_block(&cipherBlock, ofs), 4);
+		strncpy(output+4*i, _extract_passcode_from_block(cipherBlock, ofs), 4);
 
 		mp_add_d(&passcodeNum, 1, &passcodeNum);
 	}
 
+	_zero_bytes(cipherBlock, 16*3);
 	ofs = 0;
 }
 
@@ -44,14 +44,27 @@
 #define PPP_DONT_SKIP_ON_FAILURES	0x0002
 #define PPP_TIME_BASED				0x0004
 #define PPP_SHOW_PASSCODE			0x0008
+
+/* Characters in a passcode */
+#define PPP_PASSCODE_LEN	4
+
+/* What the warnings after a login depend on; small enough to keep
+ * between authentication and the session */
+struct ppp_status {
+	int remaining;		/* printed passcodes left, up to 71 */
+	int upgrade;		/* newer PPP version available, or 0 */
+};
     
 void pppInit();
 void pppCleanup();
 char * mpToDecimalString(mp_int *mp, char groupChar);
 char *currCode();
 char *currPrompt();
+char *currPromptFor(const char *what);
 int pppAuthenticate(const char *attempt);
 int pppWarning(char *buf, int size);
+void pppStatus(struct ppp_status *st);
+int pppStatusWarning(const struct ppp_status *st, int n, char *buf, int size);
 mp_int *seqKey();
 void setSeqKey(mp_int *mp);
 mp_int *currPasscodeNum();
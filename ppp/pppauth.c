@@ -58,6 +58,55 @@ int main( int argc, char * argv[] )
 	}
 
 
+	if (fImport || fExport) {
+		setStore(getStorePath());
+		if ( ! (fImport ? storeImport() : storeExport()) )
+			errorExit(fImport ? "unable to import the key into the store"
+			    : "unable to export the key from the store");
+		pppCleanup();
+		return 0;
+	}
+
+	if (fStats) {
+		const char *phase_names[PPP_PHASES] = { "lookup", "lock", "read",
+		    "reserve", "passcode", "typing", "verify", "total" };
+		struct ppp_phase_stats phases[PPP_PHASES];
+		struct ppp_lock_stats st;
+		int i, j;
+
+		if ( ! readLockStats(getStatsPath(), &st))
+			errorExit("unable to read the lock statistics");
+		printf("Locks taken:       %llu\n", st.acquired);
+		printf("Waited for:        %llu\n", st.contended);
+		printf("Timed out:         %llu\n", st.timeouts);
+		printf("Failed:            %llu\n", st.errors);
+		printf("Total wait:        %llu.%03llu ms\n", st.wait_us / 1000, st.wait_us % 1000);
+		printf("Average wait:      %llu.%03llu ms\n", st.contended ? st.wait_us / st.contended / 1000 : 0ULL,
+		    st.contended ? st.wait_us / st.contended % 1000 : 0ULL);
+		printf("Longest wait:      %llu.%03llu ms\n", st.max_wait_us / 1000, st.max_wait_us % 1000);
+		printf("Conflicts:         %llu\n", st.conflicts);
+
+		/* Login timings, if any were kept */
+		if (readTimingStats(getStatsPath(), phases) && phases[PPP_PHASE_TOTAL].count) {
+			printf("\n%-10s %10s %10s %10s %10s %10s\n", "Phase (ms)",
+			    "logins", "p50", "p99", "p99.9", "max");
+			for (i = 0; i < PPP_PHASES; i++) {
+				unsigned long long q[4];
+
+				q[0] = timingPercentile(&phases[i], 0.5);
+				q[1] = timingPercentile(&phases[i], 0.99);
+				q[2] = timingPercentile(&phases[i], 0.999);
+				q[3] = phases[i].max_us;
+				printf("%-10s %10llu", phase_names[i], phases[i].count);
+				for (j = 0; j < 4; j++)
+					printf(" %6llu.%03llu", q[j] / 1000, q[j] % 1000);
+				printf("\n");
+			}
+		}
+		pppCleanup();
+		return 0;
+	}
+
 	if (fVerbose)
 		printf("Verbose output enabled.\n");
 
@@ -0,0 +1,523 @@
+/* Copyright (c) 2007, Thomas Fors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pppstated - keeps users' OTP state in memory and serialises
+ * changes to it, so that logins need neither lock nor read files.
+ *
+ * pam_ppp.so talks to it over a Unix socket (see keyfiles.h for the
+ * messages).  A login asks for the user's record and, with it, the
+ * user's lock; other logins for the same user wait in line until the
+ * first has stored its reserved counter and let go.  New counters are
+ * appended to a journal before they are acknowledged, and written to
+ * the store in the background; the journal is replayed into the store
+ * at startup, so a crash loses nothing.
+ */
+
+/* for struct ucred */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ppp.h"
+
+#define JOURNAL_PATH	"/var/lib/ppp/state.journal"
+#define MAX_CLIENTS	1024
+#define USER_BUCKETS	1024
+#define FLUSH_MS	1000	/* write-behind delay */
+#define FLUSH_DIRTY	256	/* or after this many users changed */
+
+struct user {
+	char name[PPP_MSG_NAME_SIZE];
+	unsigned char rec[PPP_STATE_SIZE];
+	int dirty;
+	struct client *owner;		/* holder of the user's lock */
+	struct user *next;
+};
+
+struct client {
+	int fd;
+	unsigned char msg[PPP_MSG_SIZE];
+	int got;
+	struct user *locked;		/* user whose lock this client holds */
+	struct user *waiting;		/* user whose lock it waits for */
+	unsigned long ticket;		/* place in line */
+};
+
+static struct user *users[USER_BUCKETS];
+static struct client clients[MAX_CLIENTS];
+static int nclients = 0;
+static int ndirty = 0;
+static unsigned long tickets = 0;
+static int journal_fd = -1;
+static int sync_level = PPP_SYNC_FULL;
+static volatile sig_atomic_t stopping = 0;
+
+static unsigned long _hash(const char *name) {
+	unsigned long h = 2166136261UL;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619UL;
+	return h % USER_BUCKETS;
+}
+
+static struct user *_find_user(const char *name) {
+	struct user *u;
+
+	for (u = users[_hash(name)]; u; u = u->next) {
+		if (strcmp(u->name, name) == 0)
+			return u;
+	}
+	return NULL;
+}
+
+/* Find a user, reading the record from the store if we don't have it */
+static struct user *_get_user(const char *name) {
+	struct user *u;
+	unsigned long h;
+
+	u = _find_user(name);
+	if (u)
+		return u;
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL)
+		return NULL;
+	if ( ! storeLoad(name, u->rec)) {
+		free(u);
+		return NULL;
+	}
+	strcpy(u->name, name);
+
+	h = _hash(name);
+	u->next = users[h];
+	users[h] = u;
+	return u;
+}
+
+/* Forget a user nobody is using and whose record is in the store */
+static void _drop_user(struct user *u) {
+	struct user **p;
+	int i;
+
+	if (u->dirty || u->owner)
+		return;
+	for (i = 0; i < nclients; i++) {
+		if (clients[i].waiting == u)
+			return;
+	}
+
+	for (p = &users[_hash(u->name)]; *p; p = &(*p)->next) {
+		if (*p == u) {
+			*p = u->next;
+			break;
+		}
+	}
+	memset(u, 0, sizeof(*u));
+	free(u);
+}
+
+static void _answer(struct client *c, int status, const unsigned char *rec) {
+	c->msg[PPP_MSG_OFF_OP] = status;
+	if (rec)
+		memcpy(c->msg + PPP_MSG_OFF_REC, rec, PPP_STATE_SIZE);
+	else
+		memset(c->msg + PPP_MSG_OFF_REC, 0, PPP_STATE_SIZE);
+
+	/* The answer is small enough never to block */
+	send(c->fd, c->msg, PPP_MSG_SIZE, MSG_NOSIGNAL);
+	memset(c->msg, 0, PPP_MSG_SIZE);
+}
+
+static void _load(struct client *c) {
+	const char *name = (char *)c->msg + PPP_MSG_OFF_NAME;
+	int lock = c->msg[PPP_MSG_OFF_FLAGS] & PPP_MSG_LOCK;
+	struct user *u;
+
+	u = _get_user(name);
+	if (u == NULL) {
+		_answer(c, PPP_STATUS_NOUSER, NULL);
+		return;
+	}
+
+	if (lock && u->owner && u->owner != c) {
+		/* Wait in line; answered when the lock comes free */
+		c->waiting = u;
+		c->ticket = ++tickets;
+		return;
+	}
+
+	/* The store may have been given a new key since we read it */
+	if ( ! u->dirty && ! u->owner && ! storeLoad(name, u->rec)) {
+		_answer(c, PPP_STATUS_NOUSER, NULL);
+		_drop_user(u);
+		return;
+	}
+
+	if (lock) {
+		u->owner = c;
+		c->locked = u;
+	}
+	_answer(c, PPP_STATUS_OK, u->rec);
+}
+
+/* Release a lock and give it to whoever has waited longest */
+static void _unlock(struct client *c) {
+	struct user *u = c->locked;
+	struct client *next = NULL;
+	int i;
+
+	if (u == NULL)
+		return;
+	u->owner = NULL;
+	c->locked = NULL;
+
+	for (i = 0; i < nclients; i++) {
+		if (clients[i].waiting == u && (next == NULL || clients[i].ticket < next->ticket))
+			next = &clients[i];
+	}
+
+	if (next) {
+		next->waiting = NULL;
+		_load(next);
+	} else
+		_drop_user(u);
+}
+
+static void _store(struct client *c) {
+	const char *name = (char *)c->msg + PPP_MSG_OFF_NAME;
+	const unsigned char *rec = c->msg + PPP_MSG_OFF_REC;
+	struct user *u;
+
+	u = _get_user(name);
+	if (u == NULL) {
+		_answer(c, PPP_STATUS_NOUSER, NULL);
+		return;
+	}
+
+	/* Counters only; the key is the one in the store */
+	if (memcmp(rec, "PPPS", 4) != 0
+	    || memcmp(rec + PPP_STATE_OFF_KEY, u->rec + PPP_STATE_OFF_KEY, PPP_STATE_KEY_SIZE) != 0) {
+		_answer(c, PPP_STATUS_ERROR, NULL);
+		return;
+	}
+
+	/* The journal holds the whole message, so that it can be
+	 * replayed as it stands */
+	if (write(journal_fd, c->msg, PPP_MSG_SIZE) != PPP_MSG_SIZE
+	    || (sync_level >= PPP_SYNC_DATA && fdatasync(journal_fd) != 0)) {
+		_answer(c, PPP_STATUS_ERROR, NULL);
+		return;
+	}
+
+	memcpy(u->rec, rec, PPP_STATE_SIZE);
+	if ( ! u->dirty) {
+		u->dirty = 1;
+		ndirty++;
+	}
+	_answer(c, PPP_STATUS_OK, NULL);
+}
+
+/* Write changed records to the store; once all are there, the
+ * journal can start again */
+static void _flush() {
+	struct user *u, *next;
+	int i, left = 0;
+
+	for (i = 0; i < USER_BUCKETS; i++) {
+		for (u = users[i]; u; u = next) {
+			next = u->next;
+			if ( ! u->dirty)
+				continue;
+			/* A user no longer in the store, or with a new key,
+			 * has nothing to keep; anything else that fails
+			 * stays dirty, to be tried again */
+			if (storeSave(u->name, u->rec) < 0) {
+				left++;
+				continue;
+			}
+			u->dirty = 0;
+			_drop_user(u);
+		}
+	}
+	ndirty = left;
+
+	if (left == 0 && ftruncate(journal_fd, 0) == 0 && sync_level >= PPP_SYNC_DATA)
+		fdatasync(journal_fd);
+}
+
+/* Apply whatever the journal holds from before a crash; returns 0,
+ * leaving the journal alone, if some of it couldn't be saved */
+static int _replay() {
+	unsigned char msg[PPP_MSG_SIZE];
+	char *name = (char *)msg + PPP_MSG_OFF_NAME;
+	int ok = 1;
+
+	lseek(journal_fd, 0, SEEK_SET);
+	while (read(journal_fd, msg, PPP_MSG_SIZE) == PPP_MSG_SIZE) {
+		name[PPP_MSG_NAME_SIZE - 1] = '\0';
+		if (msg[PPP_MSG_OFF_OP] == PPP_OP_STORE && storeSave(name, msg + PPP_MSG_OFF_REC) < 0)
+			ok = 0;
+	}
+	memset(msg, 0, PPP_MSG_SIZE);
+
+	if (ok && ftruncate(journal_fd, 0) == 0)
+		fdatasync(journal_fd);
+	return ok;
+}
+
+static void _drop_client(int i) {
+	struct client *c = &clients[i];
+
+	_unlock(c);
+	c->waiting = NULL;
+	close(c->fd);
+
+	/* Keep the table packed; anyone pointing at the last entry
+	 * must follow it to its new place */
+	if (i != nclients - 1) {
+		struct user *u;
+		int k;
+
+		*c = clients[nclients - 1];
+		for (k = 0; k < USER_BUCKETS; k++) {
+			for (u = users[k]; u; u = u->next) {
+				if (u->owner == &clients[nclients - 1])
+					u->owner = c;
+			}
+		}
+	}
+	memset(&clients[nclients - 1], 0, sizeof(struct client));
+	nclients--;
+}
+
+static int _read_client(int i) {
+	struct client *c = &clients[i];
+	ssize_t n;
+
+	n = recv(c->fd, c->msg + c->got, PPP_MSG_SIZE - c->got, 0);
+	if (n <= 0)
+		return 0;
+	c->got += n;
+	if (c->got < PPP_MSG_SIZE)
+		return 1;
+	c->got = 0;
+
+	c->msg[PPP_MSG_OFF_NAME + PPP_MSG_NAME_SIZE - 1] = '\0';
+	switch (c->msg[PPP_MSG_OFF_OP]) {
+	case PPP_OP_LOAD:
+		/* One user per connection */
+		_unlock(c);
+		_load(c);
+		break;
+	case PPP_OP_STORE:
+		_store(c);
+		break;
+	case PPP_OP_UNLOCK:
+		_unlock(c);
+		memset(c->msg, 0, PPP_MSG_SIZE);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static int _accept(int sock) {
+	int fd;
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+#endif
+
+	fd = accept(sock, NULL, NULL);
+	if (fd < 0)
+		return 0;
+
+#ifdef SO_PEERCRED
+	/* Only root may ask for keys */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != 0) {
+		close(fd);
+		return 0;
+	}
+#endif
+
+	if (nclients == MAX_CLIENTS) {
+		close(fd);
+		return 0;
+	}
+	memset(&clients[nclients], 0, sizeof(struct client));
+	clients[nclients++].fd = fd;
+	return 1;
+}
+
+static void _stop(int sig) {
+	(void)sig;
+	stopping = 1;
+}
+
+static void usage(const char *pn) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"  -f                 Stay in the foreground.\n"
+		"  -d <path>          The store (default " PPP_STORE_PATH ").\n"
+		"  -j <path>          The journal (default " JOURNAL_PATH ").\n"
+		"  -s <path>          The socket to listen on (default " PPP_DAEMON_SOCKET ").\n"
+		"  -y none|data|full  How hard to sync changes to disk (default full).\n"
+		, pn);
+	exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *store = PPP_STORE_PATH, *journal = JOURNAL_PATH;
+	const char *path = PPP_DAEMON_SOCKET;
+	struct pollfd pfd[MAX_CLIENTS + 1];
+	struct sockaddr_un sa;
+	struct sigaction sact;
+	int foreground = 0, sock, i, n;
+
+	while ((i = getopt(argc, argv, "fd:j:s:y:")) != -1) {
+		switch (i) {
+		case 'f':
+			foreground = 1;
+			break;
+		case 'd':
+			store = optarg;
+			break;
+		case 'j':
+			journal = optarg;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'y':
+			if (strcmp(optarg, "none") == 0)
+				sync_level = PPP_SYNC_NONE;
+			else if (strcmp(optarg, "data") == 0)
+				sync_level = PPP_SYNC_DATA;
+			else if (strcmp(optarg, "full") == 0)
+				sync_level = PPP_SYNC_FULL;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || strlen(path) >= sizeof(sa.sun_path))
+		usage(argv[0]);
+
+	umask(S_IRWXG|S_IRWXO);
+	pppInit();
+	setStore(store);
+	setDurability(sync_level);
+
+	journal_fd = open(journal, O_RDWR | O_APPEND | O_CREAT, S_IRUSR|S_IWUSR);
+	if (journal_fd < 0) {
+		perror(journal);
+		exit(-1);
+	}
+	if ( ! _replay()) {
+		fprintf(stderr, "%s: can't replay %s into %s\n", argv[0], journal, store);
+		exit(-1);
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&sa, sizeof(sa)) != 0
+	    || listen(sock, 128) != 0) {
+		perror(path);
+		exit(-1);
+	}
+
+	memset(&sact, 0, sizeof(sact));
+	sact.sa_handler = _stop;
+	sigaction(SIGTERM, &sact, NULL);
+	sigaction(SIGINT, &sact, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ( ! foreground && daemon(0, 0) != 0) {
+		perror("daemon");
+		exit(-1);
+	}
+
+	while ( ! stopping) {
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			pfd[i + 1].fd = clients[i].fd;
+			/* Someone waiting for a lock has nothing more to say */
+			pfd[i + 1].events = clients[i].waiting ? 0 : POLLIN;
+		}
+
+		n = poll(pfd, nclients + 1, ndirty ? FLUSH_MS : -1);
+		if (n < 0 && errno != EINTR)
+			break;
+		if (n <= 0 || ndirty >= FLUSH_DIRTY) {
+			if (ndirty)
+				_flush();
+			if (n <= 0)
+				continue;
+		}
+
+		/* Walk backwards, so dropping a client doesn't skip one */
+		for (i = nclients - 1; i >= 0; i--) {
+			if (clients[i].waiting) {
+				if (pfd[i + 1].revents & (POLLHUP | POLLERR))
+					_drop_client(i);
+			} else if (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if ( ! _read_client(i))
+					_drop_client(i);
+			}
+		}
+
+		if (pfd[0].revents & POLLIN)
+			_accept(sock);
+	}
+
+	_flush();
+	unlink(path);
+	close(sock);
+	pppCleanup();
+	return 0;
+}
@@ -56,17 +56,14 @@ void printKey (mp_int *key) {
 		break;
 	default: 
 		/* unsupported */
-		break;
+		return;
 	}
 
-	for (i=0; i<len; i++) {
-		buf[i] = '\x00';
-	}
-	i = len - mp_unsigned_bin_size(key);
-	mp_to_unsigned_bin(key, buf+i);
+	/* keys are written least significant byte first */
+	mp_to_fixlen_bin_le(key, buf, len);
 	
 	for (i=0; i<len; i++) {
-		printf("%2.2X", buf[len-i-1]);
+		printf("%2.2X", buf[i]);
 	}
 }
 
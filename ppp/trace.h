@@ -0,0 +1,78 @@
+/* Copyright (c) 2007, Thomas Fors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * Static tracepoints, in the <sys/sdt.h> style, under the provider
+ * "pppauth".  Where the header is missing, or PPP_NO_TRACE is
+ * defined, they compile to nothing, arguments and all.  Where it is
+ * there, an unused probe is a single nop; bpftrace, perf or
+ * SystemTap patch it in when asked.
+ *
+ * Durations are measured from a mark taken with PPP_TRACE_MARK(),
+ * and are only measured when the probes are built in.
+ */
+
+#if defined(HAVE_SYS_SDT_H) && ! defined(PPP_NO_TRACE)
+
+#include <sys/sdt.h>
+#include <time.h>
+
+typedef struct timespec ppp_trace_mark;
+
+#define PPP_TRACE_MARK(t)	clock_gettime(CLOCK_MONOTONIC, &(t))
+#define PPP_TRACE_US(t)		_ppp_trace_us(&(t))
+
+#define PPP_TRACE1(name, a)		DTRACE_PROBE1(pppauth, name, a)
+#define PPP_TRACE2(name, a, b)		DTRACE_PROBE2(pppauth, name, a, b)
+#define PPP_TRACE3(name, a, b, c)	DTRACE_PROBE3(pppauth, name, a, b, c)
+
+/* Microseconds since the mark */
+static inline unsigned long long _ppp_trace_us(const struct timespec *t0) {
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (unsigned long long)(t1.tv_sec - t0->tv_sec) * 1000000
+	    + (t1.tv_nsec - t0->tv_nsec) / 1000;
+}
+
+#else
+
+typedef char ppp_trace_mark;
+
+#define PPP_TRACE_MARK(t)	((void)&(t))
+
+#define PPP_TRACE1(name, a)		do { } while (0)
+#define PPP_TRACE2(name, a, b)		do { } while (0)
+#define PPP_TRACE3(name, a, b, c)	do { } while (0)
+
+#endif
+
+#endif
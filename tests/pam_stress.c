@@ -0,0 +1,366 @@
+/* Load generator for pam_ppp.so
+ *
+ * Loads the module with dlopen() and plays the part of libpam and the
+ * application: the pam_* functions the module calls are defined here,
+ * and the conversation answers each prompt with the right passcode,
+ * worked out by the module's own library.  Users are made up
+ * (stress0, stress1, ...) with their homes under a temporary
+ * directory; getpwnam_r() is defined here too, so the module finds
+ * them there without touching the system's user database.
+ *
+ * Logins run in worker processes, since the module keeps its state in
+ * globals.  At the end it reports latency percentiles, throughput,
+ * lock timeouts and passcodes handed out to more than one login.
+ *
+ *   pam_stress [-m module] [-u users] [-w workers] [-n logins]
+ *              [-f percent] [-k] [module options...]
+ *
+ * The module always gets stats=<tmp>/stats on top of the options given.
+ * Exit status is 1 if any login gave an unexpected result or any
+ * passcode was handed out twice.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <ftw.h>
+#include <pwd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <security/pam_modules.h>
+
+#include "keyfiles.h"
+
+#define PROMPT_SIZE	32
+
+/* What each login left behind, in memory shared with the parent */
+struct result {
+	int user;
+	int retval;
+	int wrong;		/* answered wrongly on purpose */
+	double ms;
+	char prompt[PROMPT_SIZE];
+};
+
+typedef int (*pam_sm_fn)(pam_handle_t *, int, int, const char **);
+
+/* The module, and the parts of its library used here */
+static pam_sm_fn p_authenticate;
+static void (*p_pppInit)(void);
+static void (*p_pppCleanup)(void);
+static int (*p_setUser)(const char *);
+static void (*p_generateRandomSequenceKey)(void);
+static int (*p_writeKeyFile)(void);
+static void *(*p_currAuthPasscodeNum)(void);
+static char *(*p_getPasscode)(const void *);
+static int (*p_readLockStats)(const char *, struct ppp_lock_stats *);
+
+static char root[] = "/tmp/pam_stress.XXXXXX";
+
+/* The login in progress */
+static char cur_user[32];
+static struct result *cur;
+static void *cur_data;
+static void (*cur_cleanup)(pam_handle_t *, void *, int);
+
+/* --- stand-ins for libpam --- */
+
+static int conv(int n, const struct pam_message **msg,
+    struct pam_response **resp, void *appdata) {
+	const char *code = "";
+	int i;
+
+	*resp = calloc(n, sizeof(**resp));
+	if (*resp == NULL)
+		return PAM_BUF_ERR;
+
+	for (i = 0; i < n; i++) {
+		if (msg[i]->msg_style != PAM_PROMPT_ECHO_ON
+		    && msg[i]->msg_style != PAM_PROMPT_ECHO_OFF)
+			continue;
+		snprintf(cur->prompt, PROMPT_SIZE, "%s", msg[i]->msg);
+		if ( ! cur->wrong)
+			code = p_getPasscode(p_currAuthPasscodeNum());
+		(*resp)[i].resp = strdup(code);
+	}
+	return PAM_SUCCESS;
+}
+
+static struct pam_conv conversation = { conv, NULL };
+
+int pam_get_item(const pam_handle_t *pamh, int type, const void **item) {
+	if (type != PAM_CONV)
+		return PAM_BAD_ITEM;
+	*item = &conversation;
+	return PAM_SUCCESS;
+}
+
+int pam_set_item(pam_handle_t *pamh, int type, const void *item) {
+	return PAM_SUCCESS;
+}
+
+int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt) {
+	*user = cur_user;
+	return PAM_SUCCESS;
+}
+
+int pam_set_data(pam_handle_t *pamh, const char *name, void *data,
+    void (*cleanup)(pam_handle_t *, void *, int)) {
+	if (cur_cleanup)
+		cur_cleanup(pamh, cur_data, PAM_SUCCESS);
+	cur_data = data;
+	cur_cleanup = cleanup;
+	return PAM_SUCCESS;
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *name, const void **data) {
+	if (cur_data == NULL)
+		return PAM_NO_MODULE_DATA;
+	*data = cur_data;
+	return PAM_SUCCESS;
+}
+
+const char *pam_strerror(pam_handle_t *pamh, int errnum) {
+	return "error";
+}
+
+/* --- stand-in for the user database --- */
+
+int getpwnam_r(const char *name, struct passwd *pwd, char *buf,
+    size_t buflen, struct passwd **result) {
+	static int (*real)(const char *, struct passwd *, char *, size_t,
+	    struct passwd **);
+	int n;
+
+	if (strncmp(name, "stress", 6) != 0) {
+		if (real == NULL)
+			real = dlsym(RTLD_NEXT, "getpwnam_r");
+		return real(name, pwd, buf, buflen, result);
+	}
+
+	n = snprintf(buf, buflen, "%s/%s", root, name);
+	if (n < 0 || (size_t)n + strlen(name) + 2 > buflen) {
+		*result = NULL;
+		return ERANGE;
+	}
+	memset(pwd, 0, sizeof(*pwd));
+	pwd->pw_dir = buf;
+	pwd->pw_name = strcpy(buf + n + 1, name);
+	pwd->pw_passwd = pwd->pw_gecos = pwd->pw_shell = "";
+	pwd->pw_uid = geteuid();
+	pwd->pw_gid = getegid();
+	*result = pwd;
+	return 0;
+}
+
+/* --- the harness --- */
+
+static void *sym(void *so, const char *name) {
+	void *p = dlsym(so, name);
+
+	if (p == NULL) {
+		fprintf(stderr, "pam_stress: %s: %s\n", name, dlerror());
+		exit(2);
+	}
+	return p;
+}
+
+static double now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int cmp_ms(const void *a, const void *b) {
+	double x = ((const struct result *)a)->ms, y = ((const struct result *)b)->ms;
+
+	return (x > y) - (x < y);
+}
+
+static int cmp_prompt(const void *a, const void *b) {
+	const struct result *x = a, *y = b;
+
+	if (x->user != y->user)
+		return x->user - y->user;
+	return strcmp(x->prompt, y->prompt);
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	return remove(path);
+}
+
+static void usage() {
+	fprintf(stderr, "usage: pam_stress [-m module] [-u users] [-w workers] "
+	    "[-n logins] [-f percent] [-k] [module options...]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	const char *module = "../pam_ppp.so";
+	int users = 4, workers = 8, logins = 2000, failpct = 0, keep = 0;
+	struct ppp_lock_stats st;
+	struct result *res;
+	const char **opts;
+	char path[256], stats[256];
+	double start, secs;
+	int nopts, i, j, c, fd, saved_out, saved_err;
+	int accepted, rejected, limited, errors, collisions;
+	void *so;
+
+	while ((c = getopt(argc, argv, "m:u:w:n:f:k")) != -1) {
+		switch (c) {
+		case 'm': module = optarg; break;
+		case 'u': users = atoi(optarg); break;
+		case 'w': workers = atoi(optarg); break;
+		case 'n': logins = atoi(optarg); break;
+		case 'f': failpct = atoi(optarg); break;
+		case 'k': keep = 1; break;
+		default: usage();
+		}
+	}
+	if (users < 1 || workers < 1 || logins < 1)
+		usage();
+
+	so = dlopen(module, RTLD_NOW | RTLD_LOCAL);
+	if (so == NULL) {
+		fprintf(stderr, "pam_stress: %s\n", dlerror());
+		return 2;
+	}
+	p_authenticate = sym(so, "pam_sm_authenticate");
+	p_pppInit = sym(so, "pppInit");
+	p_pppCleanup = sym(so, "pppCleanup");
+	p_setUser = sym(so, "setUser");
+	p_generateRandomSequenceKey = sym(so, "generateRandomSequenceKey");
+	p_writeKeyFile = sym(so, "writeKeyFile");
+	p_currAuthPasscodeNum = sym(so, "currAuthPasscodeNum");
+	p_getPasscode = sym(so, "getPasscode");
+	p_readLockStats = sym(so, "readLockStats");
+
+	if (mkdtemp(root) == NULL) {
+		perror("pam_stress: mkdtemp");
+		return 2;
+	}
+
+	/* A home and a fresh key for each user; making the key is chatty */
+	fflush(stdout);
+	saved_out = dup(1), saved_err = dup(2);
+	if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+		dup2(fd, 1), dup2(fd, 2), close(fd);
+	for (i = 0; i < users; i++) {
+		snprintf(cur_user, sizeof(cur_user), "stress%d", i);
+		snprintf(path, sizeof(path), "%s/%s", root, cur_user);
+		if (mkdir(path, 0755) != 0)
+			break;
+		p_pppInit();
+		p_setUser(cur_user);
+		p_generateRandomSequenceKey();
+		c = p_writeKeyFile();
+		p_pppCleanup();
+		if ( ! c)
+			break;
+	}
+	fflush(stdout);
+	dup2(saved_out, 1), dup2(saved_err, 2);
+	close(saved_out), close(saved_err);
+	if (i < users) {
+		fprintf(stderr, "pam_stress: unable to set up %s\n", path);
+		return 2;
+	}
+
+	snprintf(stats, sizeof(stats), "stats=%s/stats", root);
+	nopts = argc - optind;
+	opts = calloc(nopts + 1, sizeof(*opts));
+	for (i = 0; i < nopts; i++)
+		opts[i] = argv[optind + i];
+	opts[nopts] = stats;
+
+	res = mmap(NULL, logins * sizeof(*res), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED) {
+		perror("pam_stress: mmap");
+		return 2;
+	}
+	memset(res, 0, logins * sizeof(*res));
+
+	start = now_ms();
+	for (i = 0; i < workers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("pam_stress: fork");
+			return 2;
+		}
+		if (pid > 0)
+			continue;
+
+		srand(getpid());
+		for (j = i; j < logins; j += workers) {
+			double t;
+
+			cur = &res[j];
+			cur->user = rand() % users;
+			cur->wrong = rand() % 100 < failpct;
+			snprintf(cur_user, sizeof(cur_user), "stress%d", cur->user);
+
+			t = now_ms();
+			cur->retval = p_authenticate(NULL, 0, nopts + 1, opts);
+			cur->ms = now_ms() - t;
+
+			if (cur_cleanup)
+				cur_cleanup(NULL, cur_data, PAM_SUCCESS);
+			cur_data = NULL, cur_cleanup = NULL;
+		}
+		_exit(0);
+	}
+	while (wait(NULL) > 0)
+		;
+	secs = (now_ms() - start) / 1000.0;
+
+	accepted = rejected = limited = errors = 0;
+	for (i = 0; i < logins; i++) {
+		if (res[i].retval == PAM_MAXTRIES)
+			limited++;
+		else if (res[i].retval == (res[i].wrong ? PAM_AUTH_ERR : PAM_SUCCESS))
+			res[i].wrong ? rejected++ : accepted++;
+		else
+			errors++;
+	}
+
+	/* Every login must have been offered a passcode of its own */
+	collisions = 0;
+	qsort(res, logins, sizeof(*res), cmp_prompt);
+	for (i = 1; i < logins; i++) {
+		if (res[i].prompt[0] && res[i].user == res[i - 1].user
+		    && strcmp(res[i].prompt, res[i - 1].prompt) == 0)
+			collisions++;
+	}
+
+	qsort(res, logins, sizeof(*res), cmp_ms);
+	printf("logins %d, users %d, workers %d: %.2f s, %.0f logins/s\n",
+	    logins, users, workers, secs, logins / secs);
+	printf("latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+	    res[logins / 2].ms, res[logins * 99 / 100].ms,
+	    res[logins * 999 / 1000].ms, res[logins - 1].ms);
+	printf("accepted %d, rejected %d, rate limited %d, errors %d, collisions %d\n",
+	    accepted, rejected, limited, errors, collisions);
+
+	snprintf(path, sizeof(path), "%s/stats", root);
+	if (p_readLockStats(path, &st))
+		printf("locks %llu, contended %llu, timeouts %llu, lock errors %llu, conflicts %llu\n",
+		    st.acquired, st.contended, st.timeouts, st.errors, st.conflicts);
+
+	if (keep)
+		printf("kept %s\n", root);
+	else
+		nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	return errors || collisions;
+}